@@ -20,31 +20,324 @@
 
 #include <connorlib/dll.h>
 #include <connorlib/optional.h>
+#include <connorlib/rustop.h>
 #include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+
+// co_await support (IpcAwaitLoop, IpcClient::RecvAsync and SendAsync) needs C++20 and epoll
+#if defined(__linux__) && defined(__cpp_impl_coroutine)
+#define MIPC_COROUTINES 1
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#endif
 
 namespace MessageIpc
 {
     namespace FFI
     {
         struct IpcClient;
+        struct IpcServer;
+        struct IpcStream;
+        struct IpcSharedBuffer;
+        struct IpcCall;
+        struct IpcPublisher;
+        struct IpcSubscriber;
+
+        // Runs once with a call's response, which it must release with mipc_recv_free, or with
+        // MIPC_DISCONNECTED and no data if the response will never come
+        typedef void (*IpcCallCallback)(void *user, int status, uint8_t *data, size_t len);
+        // Runs with each message, which is only borrowed for the call. The last call has no
+        // data: MIPC_DISCONNECTED once the client is disconnected, which may come after
+        // mipc_close, or MIPC_EMPTY once the callback is replaced. `user` can be freed then.
+        typedef void (*IpcReceiveCallback)(void *user, int status, const uint8_t *data, size_t len);
 
         const int MIPC_SUCCESS = 0;
         const int MIPC_EMPTY = 1;
         const int MIPC_DISCONNECTED = 2;
+        // The send queue is over its high watermark; nothing was sent
+        const int MIPC_WOULDBLOCK = 3;
+        // The buffer passed to mipc_recv_into can't hold the next message
+        const int MIPC_TOO_SMALL = 4;
+        // The message is longer than MIPC_MAX_MESSAGE bytes; nothing was sent
+        const int MIPC_TOO_LARGE = 5;
+        // The stream being read has ended; the next read starts on the one after it
+        const int MIPC_END_OF_STREAM = 6;
+        // A broadcast subscriber fell behind and missed messages; it carries on from the
+        // oldest one still in the ring
+        const int MIPC_LAGGED = 7;
+
+        // The longest message the wire format can carry (1 GiB - 1)
+        const size_t MIPC_MAX_MESSAGE = (1u << 30) - 1;
+
+        // Pass as a timeout to wait forever
+        const uint64_t MIPC_INFINITE = UINT64_MAX;
+
+        // Named pipes. The default, and the only transport available on every platform.
+        const uint32_t MIPC_TRANSPORT_PIPE = 0;
+        // A shared-memory ring per direction, no syscalls per message. Linux only.
+        const uint32_t MIPC_TRANSPORT_SHM = 1;
+        // A SOCK_SEQPACKET Unix domain socket. Use it to connect to an IpcServer. Unix only.
+        const uint32_t MIPC_TRANSPORT_SOCKET = 2;
+
+        // A reader and a writer thread per connection. The default.
+        const uint32_t MIPC_IO_THREADS = 0;
+        // One background thread services every reactor connection in the process.
+        // Linux and MIPC_TRANSPORT_PIPE only.
+        const uint32_t MIPC_IO_REACTOR = 1;
+        // Like MIPC_IO_REACTOR, but no I/O happens until the application calls mipc_reactor_poll
+        const uint32_t MIPC_IO_MANUAL = 2;
+
+        // Fields may only ever be appended. Zero means "use the default" for every field.
+        // Functions taking one are also passed sizeof(IpcOptions), so a library newer than the
+        // header the caller was built with leaves the fields the caller doesn't know at zero.
+        struct IpcOptions
+        {
+            uint32_t transport = MIPC_TRANSPORT_PIPE;
+            // Bytes of ring buffer per direction for MIPC_TRANSPORT_SHM, rounded up to a power of two
+            uint32_t ring_size = 0;
+            uint32_t io_mode = MIPC_IO_THREADS;
+            // Once either queue holds this many messages or bytes, sends return MIPC_WOULDBLOCK
+            // (or wait) and nothing more is read from the peer, until the queue drains to the
+            // low watermarks. 0 means unbounded.
+            uint32_t high_water_messages = 0;
+            uint32_t high_water_bytes = 0;
+            // 0 means half the high watermark
+            uint32_t low_water_messages = 0;
+            uint32_t low_water_bytes = 0;
+            // Compress messages at least this many bytes long with LZ4, if the peer can
+            // decompress them. 0 never compresses. Each end decides for what it sends.
+            uint32_t compress_threshold = 0;
+            // Microseconds a receiver busy-polls for the next message before it parks, adapting
+            // downwards while spinning doesn't pay off. 0 never spins. Best paired with
+            // MIPC_TRANSPORT_SHM, which then needs no syscall per message. Off on single-CPU
+            // machines.
+            uint32_t spin_us = 0;
+        };
+
+        // Buckets in IpcStats' size histograms
+        const size_t MIPC_SIZE_BUCKETS = 32;
+
+        // A snapshot of a connection's counters, filled in by mipc_get_stats. Fields may only
+        // ever be appended, and mipc_get_stats is passed sizeof(IpcStats) so that it writes
+        // no more than the caller's header knows about.
+        struct IpcStats
+        {
+            // Messages handed to the transport, and their bytes before any compression.
+            // Streams add to the bytes but are not messages.
+            uint64_t messages_sent;
+            uint64_t bytes_sent;
+            // Messages taken off the transport, and their bytes after any decompression
+            uint64_t messages_received;
+            uint64_t bytes_received;
+            // Bytes actually written to and read from the transport, framing and compression included
+            uint64_t wire_bytes_sent;
+            uint64_t wire_bytes_received;
+            // What is waiting in each queue now, and the most it has ever held. Stream chunks
+            // wait in a queue of their own and are not included.
+            uint64_t send_queue_messages;
+            uint64_t send_queue_bytes;
+            uint64_t send_queue_peak_messages;
+            uint64_t send_queue_peak_bytes;
+            uint64_t recv_queue_messages;
+            uint64_t recv_queue_bytes;
+            uint64_t recv_queue_peak_messages;
+            uint64_t recv_queue_peak_bytes;
+            // Time the writer spent in write calls, mostly waiting for the peer to make room.
+            // Always 0 in the reactor I/O modes, whose writes never wait.
+            uint64_t write_blocked_ns;
+            // Message sizes. Bucket 0 counts empty messages, bucket i those of 2^(i-1) to
+            // 2^i - 1 bytes, and the last bucket everything bigger as well.
+            uint64_t sent_sizes[MIPC_SIZE_BUCKETS];
+            uint64_t received_sizes[MIPC_SIZE_BUCKETS];
+        };
 
         extern "C" IPC_DLL_IMPORT IpcClient *mipc_open_server(const char *name);
         extern "C" IPC_DLL_IMPORT IpcClient *mipc_open_client(const char *name, uint32_t pid);
+        // The client must be opened with the same transport as the server. Both return
+        // nullptr if the transport isn't supported on this platform. options_size is
+        // sizeof(IpcOptions).
+        extern "C" IPC_DLL_IMPORT IpcClient *mipc_open_server_ex(const char *name, const IpcOptions *options, size_t options_size);
+        extern "C" IPC_DLL_IMPORT IpcClient *mipc_open_client_ex(const char *name, uint32_t pid, const IpcOptions *options, size_t options_size);
         extern "C" IPC_DLL_IMPORT void mipc_close(IpcClient *client);
 
-        extern "C" IPC_DLL_IMPORT int mipc_send(IpcClient *client, const uint8_t *data, uint32_t len);
+        extern "C" IPC_DLL_IMPORT int mipc_send(IpcClient *client, const uint8_t *data, size_t len);
+        // Like mipc_send, but waits up to timeout_us for the send queue to drop to its low
+        // watermark instead of returning MIPC_WOULDBLOCK straight away
+        extern "C" IPC_DLL_IMPORT int mipc_send_timeout(IpcClient *client, const uint8_t *data, size_t len, uint64_t timeout_us);
+        // Sends the slices as one message, e.g. a header followed by a payload, without the
+        // caller concatenating them. They are gathered straight into the message buffer.
+        extern "C" IPC_DLL_IMPORT int mipc_sendv(IpcClient *client, const Rust::Slice<const uint8_t> *parts, size_t count);
+        // Queues each slice as its own message, all at once, so they go out in a single write
+        extern "C" IPC_DLL_IMPORT int mipc_send_batch(IpcClient *client, const Rust::Slice<const uint8_t> *messages, size_t count);
+        // Queues a message on the urgent lane, ahead of every normal message not yet started and
+        // between the 1 MiB fragments of a big one. Never returns MIPC_WOULDBLOCK: the urgent
+        // lane ignores the watermarks, so keep what goes on it small.
+        extern "C" IPC_DLL_IMPORT int mipc_send_urgent(IpcClient *client, const uint8_t *data, size_t len);
         extern "C" IPC_DLL_IMPORT int mipc_recv(IpcClient *client, uint8_t **data, size_t *len);
         extern "C" IPC_DLL_IMPORT int mipc_try_recv(IpcClient *client, uint8_t **data, size_t *len);
+        // Waits for a message and copies it into `buf`, setting `len` to its size. If it needs
+        // more than `cap` bytes, returns MIPC_TOO_SMALL with `len` set to the size needed and
+        // leaves the message queued, so it can be received again with a bigger buffer.
+        extern "C" IPC_DLL_IMPORT int mipc_recv_into(IpcClient *client, uint8_t *buf, size_t cap, size_t *len);
+        // Waits up to timeout_us for a message. Returns MIPC_EMPTY if none arrived in time.
+        extern "C" IPC_DLL_IMPORT int mipc_recv_timeout(IpcClient *client, uint8_t **data, size_t *len, uint64_t timeout_us);
+
+        struct IpcRawMessage
+        {
+            uint8_t *data;
+            size_t len;
+        };
+
+        // Waits up to timeout_us for a message, then takes up to `max` of the messages already
+        // received in one go. Every message returned must be released with mipc_recv_free.
+        // Returns MIPC_EMPTY if nothing arrived in time.
+        extern "C" IPC_DLL_IMPORT int mipc_recv_many(IpcClient *client, IpcRawMessage *msgs, size_t max, size_t *count, uint64_t timeout_us);
+        // Hands every message to `callback` on the I/O thread as it arrives instead of queueing
+        // it for mipc_recv, starting with any already queued. A null callback goes back to
+        // queueing. Never call this from inside the callback.
+        extern "C" IPC_DLL_IMPORT void mipc_set_receive_callback(IpcClient *client, IpcReceiveCallback callback, void *user);
+        // Waits up to timeout_us for any of the clients to have a message waiting or be
+        // disconnected, and returns the index of the first that does, or -1 if none did in
+        // time. The wait is on one notification shared by all of them, not a poll.
+        extern "C" IPC_DLL_IMPORT int mipc_wait_any(IpcClient *const *clients, size_t count, uint64_t timeout_us);
+        // A descriptor that polls readable for as long as messages are waiting to be received,
+        // and once the client is disconnected. Register it with epoll/poll/select, but never
+        // read from or close it; it belongs to the client. Returns -1 where unsupported (Windows).
+        extern "C" IPC_DLL_IMPORT int mipc_get_readable_fd(IpcClient *client);
+        // Like mipc_get_readable_fd, but polls readable while mipc_send would queue a message
+        // rather than return MIPC_WOULDBLOCK, and once the client is disconnected
+        extern "C" IPC_DLL_IMPORT int mipc_get_writable_fd(IpcClient *client);
+
+        // Waits up to timeout_us for I/O on the MIPC_IO_MANUAL connections and services all that
+        // are ready. Returns how many events were handled, or -1 where unsupported. Calls from
+        // several threads take turns.
+        extern "C" IPC_DLL_IMPORT int mipc_reactor_poll(uint64_t timeout_us);
+        // Polls readable whenever mipc_reactor_poll has work to do, for integrating with an
+        // existing event loop. Never read from or close it. Returns -1 where unsupported.
+        extern "C" IPC_DLL_IMPORT int mipc_reactor_fd();
+
+        // Listens for any number of clients, which connect with mipc_open_client_ex, the server's
+        // pid and MIPC_TRANSPORT_SOCKET. The options apply to every accepted client. Returns
+        // nullptr where unsupported (Windows).
+        extern "C" IPC_DLL_IMPORT IpcServer *mipc_listen(const char *name, const IpcOptions *options, size_t options_size);
+        // Connected clients stay open; close them separately
+        extern "C" IPC_DLL_IMPORT void mipc_server_close(IpcServer *server);
+        // Waits up to timeout_us for a client to connect. Returns nullptr if none did.
+        extern "C" IPC_DLL_IMPORT IpcClient *mipc_server_accept(IpcServer *server, uint64_t timeout_us);
+        // Receives from whichever accepted client has a message, taking turns between them, and
+        // reports which client it was. Once a client is disconnected and everything it sent was
+        // received, returns MIPC_DISCONNECTED and no data, once, with that client's id. Returns
+        // MIPC_EMPTY if nothing arrived in time.
+        extern "C" IPC_DLL_IMPORT int mipc_server_recv(IpcServer *server, uint32_t *client_id, uint8_t **data, size_t *len, uint64_t timeout_us);
+        // The id mipc_server_recv reports for this client, or 0 if it wasn't accepted by a server
+        extern "C" IPC_DLL_IMPORT uint32_t mipc_client_id(IpcClient *client);
+
+        // Starts sending a stream: one message of any length, written a chunk at a time. Chunks
+        // count against the send queue's watermarks like messages, so only as much of the stream
+        // as they allow is ever held in memory. Returns nullptr while another stream from this
+        // client is still open.
+        extern "C" IPC_DLL_IMPORT IpcStream *mipc_stream_begin(IpcClient *client);
+        // Waits up to timeout_us for the send queue to have room, then queues the next chunk.
+        // Empty chunks are skipped.
+        extern "C" IPC_DLL_IMPORT int mipc_stream_write_chunk(IpcStream *stream, const uint8_t *data, size_t len, uint64_t timeout_us);
+        // Ends the stream and frees the handle
+        extern "C" IPC_DLL_IMPORT void mipc_stream_end(IpcStream *stream);
+        // Waits up to timeout_us for the next chunk of the stream being received, which is
+        // released with mipc_recv_free. Returns MIPC_END_OF_STREAM once the stream has ended.
+        // Streams arrive one after another, separately from messages; readable fds and
+        // mipc_server_recv only report messages.
+        extern "C" IPC_DLL_IMPORT int mipc_stream_read_chunk(IpcClient *client, uint8_t **data, size_t *len, uint64_t timeout_us);
+
+        // Allocates `len` bytes of shared memory for the next message and points `data` at them.
+        // Fill them in, then pass the buffer to mipc_shared_send; the peer maps the same memory
+        // instead of the bytes being copied through the connection, and receives it like any
+        // other message. Linux and MIPC_TRANSPORT_SOCKET only; returns nullptr otherwise.
+        extern "C" IPC_DLL_IMPORT IpcSharedBuffer *mipc_shared_alloc(IpcClient *client, size_t len, uint8_t **data);
+        // Waits up to timeout_us for the send queue to have room, then sends the buffer. The
+        // buffer and its memory are no longer usable afterwards, whether or not it was sent.
+        extern "C" IPC_DLL_IMPORT int mipc_shared_send(IpcClient *client, IpcSharedBuffer *buffer, uint64_t timeout_us);
+        // Frees a buffer without sending it
+        extern "C" IPC_DLL_IMPORT void mipc_shared_free(IpcSharedBuffer *buffer);
+
+        // Counters are kept by the connection's I/O as it goes, so this is cheap enough to
+        // call as often as metrics are exported
+        extern "C" IPC_DLL_IMPORT void mipc_get_stats(IpcClient *client, IpcStats *stats, size_t stats_size);
+
+        // Records every message sent and received from now on to a new file at `path`, with
+        // the time it went through, ending any capture already running. Returns -1 if the file
+        // couldn't be created. benches/replay.rs plays a capture back.
+        extern "C" IPC_DLL_IMPORT int mipc_capture_start(IpcClient *client, const char *path);
+        // Stops recording and flushes the file. Returns -1 if writing it failed at some point,
+        // which stopped the capture there.
+        extern "C" IPC_DLL_IMPORT int mipc_capture_stop(IpcClient *client);
+
+        // Sends `data` as a request to the peer, which receives it with mipc_recv_request and
+        // answers with mipc_respond. Any number of calls can be in flight at once. timeout_us
+        // only covers waiting for the send queue to have room. On success `call` is set to a
+        // handle for mipc_call_wait, which must be freed with mipc_call_free.
+        extern "C" IPC_DLL_IMPORT int mipc_call_begin(IpcClient *client, const uint8_t *data, size_t len, uint64_t timeout_us, IpcCall **call);
+        // Waits up to timeout_us for the call's response, released with mipc_recv_free. Returns
+        // MIPC_EMPTY if it didn't come in time, and the call can be waited on again.
+        extern "C" IPC_DLL_IMPORT int mipc_call_wait(IpcCall *call, uint8_t **data, size_t *len, uint64_t timeout_us);
+        // Frees the handle. A response that comes afterwards is dropped.
+        extern "C" IPC_DLL_IMPORT void mipc_call_free(IpcCall *call);
+        // Like mipc_call_begin, but the response goes to `callback` on the connection's I/O
+        // thread, so it must be quick. On success the callback runs exactly once; otherwise
+        // it never does.
+        extern "C" IPC_DLL_IMPORT int mipc_call_async(IpcClient *client, const uint8_t *data, size_t len, uint64_t timeout_us, IpcCallCallback callback, void *user);
+        // Waits up to timeout_us for the peer's next request, released with mipc_recv_free.
+        // Requests arrive separately from messages; readable fds and mipc_server_recv only
+        // report messages.
+        extern "C" IPC_DLL_IMPORT int mipc_recv_request(IpcClient *client, uint64_t *id, uint8_t **data, size_t *len, uint64_t timeout_us);
+        // Sends the response to request `id`
+        extern "C" IPC_DLL_IMPORT int mipc_respond(IpcClient *client, uint64_t id, const uint8_t *data, size_t len, uint64_t timeout_us);
+
+        // Creates the broadcast channel `name` in shared memory, which subscribers join with
+        // it and this process's pid. Every message is written once into a ring of
+        // options->ring_size bytes that all subscribers read, so publishing costs the same
+        // however many there are. Linux only; returns nullptr otherwise.
+        extern "C" IPC_DLL_IMPORT IpcPublisher *mipc_publisher_open(const char *name, const IpcOptions *options, size_t options_size);
+        extern "C" IPC_DLL_IMPORT void mipc_publisher_close(IpcPublisher *publisher);
+        // Copies the message into the ring, overwriting the oldest ones to make room. Never
+        // waits for subscribers. Returns MIPC_TOO_LARGE if the message can't fit in the ring.
+        extern "C" IPC_DLL_IMPORT int mipc_publish(IpcPublisher *publisher, const uint8_t *data, size_t len);
+        // Joins a broadcast channel. The subscriber receives what is published from now on.
+        extern "C" IPC_DLL_IMPORT IpcSubscriber *mipc_subscriber_open(const char *name, uint32_t pid);
+        extern "C" IPC_DLL_IMPORT void mipc_subscriber_close(IpcSubscriber *subscriber);
+        // Waits up to timeout_us for the next message, released with mipc_recv_free. Returns
+        // MIPC_LAGGED with `len` set to how many messages were lost if the subscriber fell a
+        // whole ring behind, and MIPC_DISCONNECTED once the publisher is gone and everything
+        // it published has been received.
+        extern "C" IPC_DLL_IMPORT int mipc_subscriber_recv(IpcSubscriber *subscriber, uint8_t **data, size_t *len, uint64_t timeout_us);
+        // How many messages the subscriber has lost by falling behind, in all
+        extern "C" IPC_DLL_IMPORT uint64_t mipc_subscriber_lost(IpcSubscriber *subscriber);
+
+        // Hands the buffer back to the pool of the client that received it. Messages may
+        // outlive their client; the pool is kept alive until the last one is freed.
         extern "C" IPC_DLL_IMPORT void mipc_recv_free(uint8_t *data, size_t len);
     }
 
+    using FFI::IpcOptions;
+    using FFI::IpcStats;
+
     class IpcMessage
     {
     public:
+        inline IpcMessage()
+            : data_(nullptr), len_(0)
+        {
+        }
+
         inline IpcMessage(uint8_t *data, size_t len)
             : data_(data), len_(len)
         {
@@ -68,9 +361,14 @@ namespace MessageIpc
         IpcMessage &operator=(const IpcMessage &) = delete;
         inline IpcMessage &operator=(IpcMessage &&move)
         {
+            if (data_ && data_ != move.data_)
+            {
+                FFI::mipc_recv_free(data_, len_);
+            }
             data_ = move.data_;
             len_ = move.len_;
             move.data_ = nullptr;
+            return *this;
         }
 
         inline const uint8_t *data() const
@@ -93,9 +391,270 @@ namespace MessageIpc
         size_t len_;
     };
 
+    // The sending end of a stream; see FFI::mipc_stream_begin. Destroying it ends the stream.
+    class IpcStreamWriter
+    {
+    public:
+        inline ~IpcStreamWriter()
+        {
+            if (stream_)
+            {
+                FFI::mipc_stream_end(stream_);
+            }
+        }
+
+        IpcStreamWriter(const IpcStreamWriter &) = delete;
+        inline IpcStreamWriter(IpcStreamWriter &&move)
+            : stream_(move.stream_)
+        {
+            move.stream_ = nullptr;
+        }
+
+        IpcStreamWriter &operator=(const IpcStreamWriter &) = delete;
+        inline IpcStreamWriter &operator=(IpcStreamWriter &&move)
+        {
+            if (stream_ && stream_ != move.stream_)
+            {
+                FFI::mipc_stream_end(stream_);
+            }
+            stream_ = move.stream_;
+            move.stream_ = nullptr;
+            return *this;
+        }
+
+        // Returns false if the chunk wasn't queued in time, or if the client is disconnected,
+        // which sets `disconnected`
+        inline bool WriteChunk(const uint8_t *data, size_t len, bool &disconnected,
+                               std::chrono::microseconds timeout = std::chrono::microseconds::max());
+
+        // Ends the stream now rather than when the writer is destroyed
+        inline void End()
+        {
+            if (stream_)
+            {
+                FFI::mipc_stream_end(stream_);
+                stream_ = nullptr;
+            }
+        }
+
+    private:
+        friend class IpcClient;
+
+        inline explicit IpcStreamWriter(FFI::IpcStream *stream)
+            : stream_(stream)
+        {
+        }
+
+        FFI::IpcStream *stream_;
+    };
+
+    // Memory for a message that is handed to the peer rather than copied; see
+    // FFI::mipc_shared_alloc. Fill it in and pass it to IpcClient::SendShared.
+    class IpcSharedBuffer
+    {
+    public:
+        inline ~IpcSharedBuffer()
+        {
+            if (buffer_)
+            {
+                FFI::mipc_shared_free(buffer_);
+            }
+        }
+
+        IpcSharedBuffer(const IpcSharedBuffer &) = delete;
+        inline IpcSharedBuffer(IpcSharedBuffer &&move)
+            : buffer_(move.buffer_), data_(move.data_), len_(move.len_)
+        {
+            move.buffer_ = nullptr;
+        }
+
+        IpcSharedBuffer &operator=(const IpcSharedBuffer &) = delete;
+        inline IpcSharedBuffer &operator=(IpcSharedBuffer &&move)
+        {
+            if (buffer_ && buffer_ != move.buffer_)
+            {
+                FFI::mipc_shared_free(buffer_);
+            }
+            buffer_ = move.buffer_;
+            data_ = move.data_;
+            len_ = move.len_;
+            move.buffer_ = nullptr;
+            return *this;
+        }
+
+        inline uint8_t *data()
+        {
+            return data_;
+        }
+
+        inline size_t len() const
+        {
+            return len_;
+        }
+
+        inline size_t size() const
+        {
+            return len_;
+        }
+
+    private:
+        friend class IpcClient;
+
+        inline IpcSharedBuffer(FFI::IpcSharedBuffer *buffer, uint8_t *data, size_t len)
+            : buffer_(buffer), data_(data), len_(len)
+        {
+        }
+
+        FFI::IpcSharedBuffer *buffer_;
+        uint8_t *data_;
+        size_t len_;
+    };
+
+    // A call in flight; see FFI::mipc_call_begin. Destroying it abandons the call.
+    class IpcCall
+    {
+    public:
+        inline ~IpcCall()
+        {
+            if (call_)
+            {
+                FFI::mipc_call_free(call_);
+            }
+        }
+
+        IpcCall(const IpcCall &) = delete;
+        inline IpcCall(IpcCall &&move)
+            : call_(move.call_)
+        {
+            move.call_ = nullptr;
+        }
+
+        IpcCall &operator=(const IpcCall &) = delete;
+        inline IpcCall &operator=(IpcCall &&move)
+        {
+            if (call_ && call_ != move.call_)
+            {
+                FFI::mipc_call_free(call_);
+            }
+            call_ = move.call_;
+            move.call_ = nullptr;
+            return *this;
+        }
+
+        // The response. Returns nullopt if it didn't come in time, in which case the call can
+        // be waited on again, or if it never will, which sets `disconnected`.
+        inline std::optional<IpcMessage> Wait(bool &disconnected,
+                                              std::chrono::microseconds timeout = std::chrono::microseconds::max());
+
+    private:
+        friend class IpcClient;
+
+        inline explicit IpcCall(FFI::IpcCall *call)
+            : call_(call)
+        {
+        }
+
+        FFI::IpcCall *call_;
+    };
+
+#ifdef MIPC_COROUTINES
+    // Resumes the coroutines suspended in IpcClient::RecvAsync and SendAsync once their client
+    // is ready, on whichever thread calls Poll or Run, so one thread can serve any number of
+    // clients, each with any number of coroutines waiting on it. A coroutine destroyed while
+    // suspended simply drops out of the loop.
+    class IpcAwaitLoop
+    {
+    public:
+        // An operation suspended until a descriptor polls readable. Complete tries it again,
+        // returning false to go back to sleep.
+        class Waiter
+        {
+        public:
+            virtual bool Complete() = 0;
+
+        protected:
+            // Leaves the loop if still waiting on it
+            inline ~Waiter();
+
+        private:
+            friend class IpcAwaitLoop;
+
+            std::coroutine_handle<> handle_;
+            IpcAwaitLoop *loop_ = nullptr;
+            int fd_ = -1;
+        };
+
+        inline IpcAwaitLoop()
+            : epoll_(epoll_create1(EPOLL_CLOEXEC))
+        {
+            if (epoll_ == -1)
+                throw std::runtime_error("epoll_create1 failed");
+        }
+
+        inline ~IpcAwaitLoop()
+        {
+            for (auto &fd : waiters_)
+                for (auto waiter : fd.second)
+                    waiter->loop_ = nullptr;
+            close(epoll_);
+        }
+
+        IpcAwaitLoop(const IpcAwaitLoop &) = delete;
+        IpcAwaitLoop &operator=(const IpcAwaitLoop &) = delete;
+
+        // The loop RecvAsync and SendAsync use when they aren't given one
+        inline static IpcAwaitLoop &ThisThread()
+        {
+            thread_local IpcAwaitLoop loop;
+            return loop;
+        }
+
+        // Polls readable while Poll has coroutines to resume, for running this loop inside
+        // another one. Never read from or close it.
+        inline int Fd() const
+        {
+            return epoll_;
+        }
+
+        // How many coroutines are suspended on the loop
+        inline size_t Pending() const
+        {
+            return pending_;
+        }
+
+        // Waits up to `timeout` for clients to become ready and resumes their coroutines.
+        // Returns how many were resumed.
+        inline int Poll(std::chrono::milliseconds timeout = std::chrono::milliseconds::max());
+
+        // Resumes coroutines until none are left suspended
+        inline void Run()
+        {
+            while (pending_ != 0)
+                Poll();
+        }
+
+        // Suspends `handle` until `fd` polls readable and `waiter` completes
+        inline void Wait(int fd, Waiter *waiter, std::coroutine_handle<> handle);
+
+    private:
+        inline void Arm(int fd);
+        // Takes a waiter off its descriptor, once it has completed or is being destroyed
+        inline void Remove(Waiter *waiter);
+
+        int epoll_;
+        size_t pending_ = 0;
+        // The waiters suspended on each descriptor, which is registered for as long as any are.
+        // A descriptor is kept after its last waiter completes, disabled by its one shot.
+        std::unordered_map<int, std::vector<Waiter *>> waiters_;
+    };
+#endif
+
     class IpcClient
     {
     public:
+        typedef std::function<void(std::optional<IpcMessage>)> CallCallback;
+        typedef std::function<void(std::optional<Rust::Slice<const uint8_t>>)> ReceiveCallback;
+
         inline ~IpcClient()
         {
             if (client_)
@@ -133,11 +692,57 @@ namespace MessageIpc
             return std::nullopt;
         }
 
-        inline bool Send(const uint8_t *data, uint32_t len)
+        inline static std::optional<IpcClient> OpenServer(const char *name, const IpcOptions &options)
+        {
+            if (auto ptr = FFI::mipc_open_server_ex(name, &options, sizeof(IpcOptions)))
+                return IpcClient(ptr);
+            return std::nullopt;
+        }
+
+        inline static std::optional<IpcClient> OpenClient(const char *name, uint32_t pid, const IpcOptions &options)
+        {
+            if (auto ptr = FFI::mipc_open_client_ex(name, pid, &options, sizeof(IpcOptions)))
+                return IpcClient(ptr);
+            return std::nullopt;
+        }
+
+        inline bool Send(const uint8_t *data, size_t len)
         {
             return FFI::mipc_send(client_, data, len) == FFI::MIPC_SUCCESS;
         }
 
+        // Returns false if nothing was sent, either because the send queue is over its high
+        // watermark or because the client is disconnected, which sets `disconnected`
+        inline bool TrySend(const uint8_t *data, size_t len, bool &disconnected)
+        {
+            return SendStatus(FFI::mipc_send(client_, data, len), disconnected);
+        }
+
+        inline bool SendFor(const uint8_t *data, size_t len, std::chrono::microseconds timeout, bool &disconnected)
+        {
+            return SendStatus(FFI::mipc_send_timeout(client_, data, len, TimeoutUs(timeout)), disconnected);
+        }
+
+        inline bool SendV(const Rust::Slice<const uint8_t> *parts, size_t count)
+        {
+            return FFI::mipc_sendv(client_, parts, count) == FFI::MIPC_SUCCESS;
+        }
+
+        inline bool SendV(std::initializer_list<Rust::Slice<const uint8_t>> parts)
+        {
+            return SendV(parts.begin(), parts.size());
+        }
+
+        inline bool SendBatch(const Rust::Slice<const uint8_t> *messages, size_t count)
+        {
+            return FFI::mipc_send_batch(client_, messages, count) == FFI::MIPC_SUCCESS;
+        }
+
+        inline bool SendUrgent(const uint8_t *data, size_t len, bool &disconnected)
+        {
+            return SendStatus(FFI::mipc_send_urgent(client_, data, len), disconnected);
+        }
+
         inline std::optional<IpcMessage> Recv()
         {
             uint8_t *data;
@@ -169,12 +774,809 @@ namespace MessageIpc
             }
         }
 
-    private:
-        inline explicit IpcClient(FFI::IpcClient *client)
-            : client_(client)
+        // Copies the next message into `buf`. Returns false if disconnected, or if the message
+        // needs `len` > `cap` bytes, in which case it stays queued for the next call.
+        inline bool RecvInto(uint8_t *buf, size_t cap, size_t &len)
+        {
+            len = 0;
+            switch (FFI::mipc_recv_into(client_, buf, cap, &len))
+            {
+                case FFI::MIPC_SUCCESS:
+                    return true;
+                case FFI::MIPC_TOO_SMALL:
+                case FFI::MIPC_DISCONNECTED:
+                    return false;
+                default:
+                    throw std::runtime_error("Unknown status code returned from mipc_recv_into");
+            }
+        }
+
+        inline std::optional<IpcMessage> RecvFor(std::chrono::microseconds timeout, bool &disconnected)
+        {
+            uint8_t *data;
+            size_t len;
+
+            disconnected = false;
+            switch (FFI::mipc_recv_timeout(client_, &data, &len, TimeoutUs(timeout)))
+            {
+                case FFI::MIPC_SUCCESS:
+                    return IpcMessage(data, len);
+                case FFI::MIPC_EMPTY:
+                    return std::nullopt;
+                case FFI::MIPC_DISCONNECTED:
+                    disconnected = true;
+                    return std::nullopt;
+                default:
+                    throw std::runtime_error("Unknown status code returned from mipc_recv_timeout");
+            }
+        }
+
+        template <typename Clock, typename Duration>
+        inline std::optional<IpcMessage> RecvUntil(const std::chrono::time_point<Clock, Duration> &deadline, bool &disconnected)
         {
+            auto left = deadline - Clock::now();
+            if (left <= left.zero())
+                return RecvFor(std::chrono::microseconds::zero(), disconnected);
+
+            // Round up, so the wait never ends before the deadline
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(left);
+            if (us < left)
+                ++us;
+            return RecvFor(us, disconnected);
         }
 
-        FFI::IpcClient *client_;
+        // Waits up to `timeout` for the first message, then fills as much of `msgs` as it can
+        // with messages that have already arrived. Returns how many were received.
+        inline size_t RecvMany(IpcMessage *msgs, size_t max, std::chrono::microseconds timeout, bool &disconnected)
+        {
+            const size_t chunk = 32;
+            FFI::IpcRawMessage raw[chunk];
+            size_t received = 0;
+
+            disconnected = false;
+            while (received < max)
+            {
+                size_t count = 0;
+                size_t want = max - received < chunk ? max - received : chunk;
+                uint64_t wait = received == 0 ? TimeoutUs(timeout) : 0;
+                switch (FFI::mipc_recv_many(client_, raw, want, &count, wait))
+                {
+                    case FFI::MIPC_SUCCESS:
+                        break;
+                    case FFI::MIPC_EMPTY:
+                        return received;
+                    case FFI::MIPC_DISCONNECTED:
+                        disconnected = received == 0;
+                        return received;
+                    default:
+                        throw std::runtime_error("Unknown status code returned from mipc_recv_many");
+                }
+
+                for (size_t i = 0; i < count; ++i)
+                {
+                    msgs[received++] = IpcMessage(raw[i].data, raw[i].len);
+                }
+                if (count < want)
+                {
+                    break;
+                }
+            }
+            return received;
+        }
+
+        // See FFI::mipc_wait_any. Returns the index of a client there is something to receive
+        // from, or nullopt if none had anything in time.
+        inline static std::optional<size_t> WaitAny(IpcClient *const *clients, size_t count,
+                                                    std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            FFI::IpcClient *local[16];
+            std::unique_ptr<FFI::IpcClient *[]> heap;
+            FFI::IpcClient **raw = local;
+            if (count > 16)
+            {
+                heap.reset(new FFI::IpcClient *[count]);
+                raw = heap.get();
+            }
+            for (size_t i = 0; i < count; ++i)
+            {
+                raw[i] = clients[i]->client_;
+            }
+
+            int index = FFI::mipc_wait_any(raw, count, TimeoutUs(timeout));
+            if (index < 0)
+                return std::nullopt;
+            return static_cast<size_t>(index);
+        }
+
+        inline static std::optional<size_t> WaitAny(std::initializer_list<IpcClient *> clients,
+                                                    std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            return WaitAny(clients.begin(), clients.size(), timeout);
+        }
+
+        // Has every message handed to `callback` on the I/O thread as it arrives, instead of
+        // queued for Recv, then nullopt once disconnected. The message is only borrowed for the
+        // call. An empty callback goes back to queueing. See FFI::mipc_set_receive_callback.
+        inline void SetReceiveCallback(ReceiveCallback callback)
+        {
+            if (!callback)
+            {
+                FFI::mipc_set_receive_callback(client_, nullptr, nullptr);
+                return;
+            }
+            auto user = new ReceiveCallback(std::move(callback));
+            FFI::mipc_set_receive_callback(client_, &RunReceiveCallback, user);
+        }
+
+        // See FFI::mipc_shared_alloc
+        inline std::optional<IpcSharedBuffer> AllocShared(size_t len)
+        {
+            uint8_t *data = nullptr;
+            if (auto ptr = FFI::mipc_shared_alloc(client_, len, &data))
+                return IpcSharedBuffer(ptr, data, len);
+            return std::nullopt;
+        }
+
+        // Sends the buffer's memory as the next message, without copying it. The buffer is
+        // used up either way. Returns false if it wasn't sent in time, or if the client is
+        // disconnected, which sets `disconnected`.
+        inline bool SendShared(IpcSharedBuffer &&buffer, bool &disconnected,
+                               std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            auto ptr = buffer.buffer_;
+            buffer.buffer_ = nullptr;
+            return SendStatus(FFI::mipc_shared_send(client_, ptr, TimeoutUs(timeout)), disconnected);
+        }
+
+        // See FFI::mipc_stream_begin
+        inline std::optional<IpcStreamWriter> BeginStream()
+        {
+            if (auto ptr = FFI::mipc_stream_begin(client_))
+                return IpcStreamWriter(ptr);
+            return std::nullopt;
+        }
+
+        // The next chunk of the stream being received. Returns nullopt if nothing arrived in
+        // time, once the stream has ended, which sets `end`, or once disconnected, which sets
+        // `disconnected`.
+        inline std::optional<IpcMessage> ReadChunk(std::chrono::microseconds timeout, bool &end, bool &disconnected)
+        {
+            uint8_t *data;
+            size_t len;
+
+            end = false;
+            disconnected = false;
+            switch (FFI::mipc_stream_read_chunk(client_, &data, &len, TimeoutUs(timeout)))
+            {
+                case FFI::MIPC_SUCCESS:
+                    return IpcMessage(data, len);
+                case FFI::MIPC_EMPTY:
+                    return std::nullopt;
+                case FFI::MIPC_END_OF_STREAM:
+                    end = true;
+                    return std::nullopt;
+                case FFI::MIPC_DISCONNECTED:
+                    disconnected = true;
+                    return std::nullopt;
+                default:
+                    throw std::runtime_error("Unknown status code returned from mipc_stream_read_chunk");
+            }
+        }
+
+        // Sends a request; see FFI::mipc_call_begin. Returns nullopt if it wasn't sent in time,
+        // or if the client is disconnected, which sets `disconnected`.
+        inline std::optional<IpcCall> BeginCall(const uint8_t *data, size_t len, bool &disconnected,
+                                                std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            FFI::IpcCall *call = nullptr;
+            if (SendStatus(FFI::mipc_call_begin(client_, data, len, TimeoutUs(timeout), &call), disconnected))
+                return IpcCall(call);
+            return std::nullopt;
+        }
+
+        // Sends a request and waits for its response. `timeout` applies to each of the two.
+        inline std::optional<IpcMessage> Call(const uint8_t *data, size_t len, bool &disconnected,
+                                              std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            auto call = BeginCall(data, len, disconnected, timeout);
+            if (!call)
+                return std::nullopt;
+            return call->Wait(disconnected, timeout);
+        }
+
+        // Sends a request whose response goes to `callback`, on the connection's I/O thread.
+        // The callback gets nullopt if the response will never come. It runs exactly once if
+        // this returns true, and never otherwise.
+        inline bool CallAsync(const uint8_t *data, size_t len, CallCallback callback, bool &disconnected,
+                              std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            auto user = new CallCallback(std::move(callback));
+            int status = FFI::mipc_call_async(client_, data, len, TimeoutUs(timeout), &RunCallback, user);
+            if (status != FFI::MIPC_SUCCESS)
+                delete user;
+            return SendStatus(status, disconnected);
+        }
+
+        // The peer's next request, and the `id` to respond to it with. Returns nullopt if
+        // nothing arrived in time, or once disconnected, which sets `disconnected`.
+        inline std::optional<IpcMessage> RecvRequest(uint64_t &id, bool &disconnected,
+                                                     std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            uint8_t *data;
+            size_t len;
+
+            disconnected = false;
+            switch (FFI::mipc_recv_request(client_, &id, &data, &len, TimeoutUs(timeout)))
+            {
+                case FFI::MIPC_SUCCESS:
+                    return IpcMessage(data, len);
+                case FFI::MIPC_EMPTY:
+                    return std::nullopt;
+                case FFI::MIPC_DISCONNECTED:
+                    disconnected = true;
+                    return std::nullopt;
+                default:
+                    throw std::runtime_error("Unknown status code returned from mipc_recv_request");
+            }
+        }
+
+        inline bool Respond(uint64_t id, const uint8_t *data, size_t len, bool &disconnected,
+                            std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            return SendStatus(FFI::mipc_respond(client_, id, data, len, TimeoutUs(timeout)), disconnected);
+        }
+
+        // See FFI::mipc_get_readable_fd
+        inline int ReadableFd()
+        {
+            return FFI::mipc_get_readable_fd(client_);
+        }
+
+        // See FFI::mipc_get_writable_fd
+        inline int WritableFd()
+        {
+            return FFI::mipc_get_writable_fd(client_);
+        }
+
+#ifdef MIPC_COROUTINES
+        class RecvAwaiter : public IpcAwaitLoop::Waiter
+        {
+        public:
+            RecvAwaiter(const RecvAwaiter &) = delete;
+
+            inline bool await_ready()
+            {
+                return Complete();
+            }
+
+            inline void await_suspend(std::coroutine_handle<> handle)
+            {
+                loop_.Wait(client_.ReadableFd(), this, handle);
+            }
+
+            inline std::optional<IpcMessage> await_resume()
+            {
+                return std::move(message_);
+            }
+
+            inline bool Complete() override
+            {
+                bool disconnected;
+                message_ = client_.TryRecv(disconnected);
+                return message_ || disconnected;
+            }
+
+        private:
+            friend class IpcClient;
+
+            inline RecvAwaiter(IpcClient &client, IpcAwaitLoop &loop)
+                : client_(client), loop_(loop)
+            {
+            }
+
+            IpcClient &client_;
+            IpcAwaitLoop &loop_;
+            std::optional<IpcMessage> message_;
+        };
+
+        class SendAwaiter : public IpcAwaitLoop::Waiter
+        {
+        public:
+            SendAwaiter(const SendAwaiter &) = delete;
+
+            inline bool await_ready()
+            {
+                return Complete();
+            }
+
+            inline void await_suspend(std::coroutine_handle<> handle)
+            {
+                loop_.Wait(client_.WritableFd(), this, handle);
+            }
+
+            inline bool await_resume()
+            {
+                return sent_;
+            }
+
+            inline bool Complete() override
+            {
+                int status = FFI::mipc_send_timeout(client_.client_, data_, len_, 0);
+                sent_ = status == FFI::MIPC_SUCCESS;
+                return status != FFI::MIPC_WOULDBLOCK;
+            }
+
+        private:
+            friend class IpcClient;
+
+            inline SendAwaiter(IpcClient &client, IpcAwaitLoop &loop, const uint8_t *data, size_t len)
+                : client_(client), loop_(loop), data_(data), len_(len)
+            {
+            }
+
+            IpcClient &client_;
+            IpcAwaitLoop &loop_;
+            const uint8_t *data_;
+            size_t len_;
+            bool sent_ = false;
+        };
+
+        // co_await gives the next message, or nullopt once disconnected. Instead of blocking,
+        // the coroutine is suspended on `loop` until a message arrives.
+        inline RecvAwaiter RecvAsync(IpcAwaitLoop &loop = IpcAwaitLoop::ThisThread())
+        {
+            return RecvAwaiter(*this, loop);
+        }
+
+        // co_await queues the message, suspending on `loop` while the send queue is over its
+        // high watermark. `data` must stay valid until then. Gives false if the message wasn't
+        // queued because the client is disconnected or the message is too large.
+        inline SendAwaiter SendAsync(const uint8_t *data, size_t len, IpcAwaitLoop &loop = IpcAwaitLoop::ThisThread())
+        {
+            return SendAwaiter(*this, loop, data, len);
+        }
+#endif
+
+        // See FFI::mipc_client_id
+        inline uint32_t Id()
+        {
+            return FFI::mipc_client_id(client_);
+        }
+
+        // See FFI::mipc_get_stats
+        inline IpcStats Stats()
+        {
+            IpcStats stats;
+            FFI::mipc_get_stats(client_, &stats, sizeof(IpcStats));
+            return stats;
+        }
+
+        // See FFI::mipc_capture_start
+        inline bool StartCapture(const char *path)
+        {
+            return FFI::mipc_capture_start(client_, path) == FFI::MIPC_SUCCESS;
+        }
+
+        // See FFI::mipc_capture_stop
+        inline bool StopCapture()
+        {
+            return FFI::mipc_capture_stop(client_) == FFI::MIPC_SUCCESS;
+        }
+
+        // See FFI::mipc_reactor_poll
+        inline static int PollReactor(std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            return FFI::mipc_reactor_poll(TimeoutUs(timeout));
+        }
+
+        // See FFI::mipc_reactor_fd
+        inline static int ReactorFd()
+        {
+            return FFI::mipc_reactor_fd();
+        }
+
+    private:
+        friend class IpcServer;
+        friend class IpcStreamWriter;
+        friend class IpcCall;
+        friend class IpcSubscriber;
+
+        inline explicit IpcClient(FFI::IpcClient *client)
+            : client_(client)
+        {
+        }
+
+        inline static bool SendStatus(int status, bool &disconnected)
+        {
+            disconnected = false;
+            switch (status)
+            {
+                case FFI::MIPC_SUCCESS:
+                    return true;
+                case FFI::MIPC_WOULDBLOCK:
+                case FFI::MIPC_TOO_LARGE:
+                    return false;
+                case FFI::MIPC_DISCONNECTED:
+                    disconnected = true;
+                    return false;
+                default:
+                    throw std::runtime_error("Unknown status code returned from mipc_send");
+            }
+        }
+
+        inline static void RunCallback(void *user, int status, uint8_t *data, size_t len)
+        {
+            std::unique_ptr<CallCallback> callback(static_cast<CallCallback *>(user));
+            if (status == FFI::MIPC_SUCCESS)
+                (*callback)(IpcMessage(data, len));
+            else
+                (*callback)(std::nullopt);
+        }
+
+        inline static void RunReceiveCallback(void *user, int status, const uint8_t *data, size_t len)
+        {
+            auto callback = static_cast<ReceiveCallback *>(user);
+            if (status == FFI::MIPC_SUCCESS)
+            {
+                (*callback)(Rust::Slice<const uint8_t>(data, len));
+                return;
+            }
+            // The last call either way
+            std::unique_ptr<ReceiveCallback> owned(callback);
+            if (status == FFI::MIPC_DISCONNECTED)
+                (*owned)(std::nullopt);
+        }
+
+        inline static uint64_t TimeoutUs(std::chrono::microseconds timeout)
+        {
+            if (timeout == std::chrono::microseconds::max())
+                return FFI::MIPC_INFINITE;
+            if (timeout.count() < 0)
+                return 0;
+            return static_cast<uint64_t>(timeout.count());
+        }
+
+        FFI::IpcClient *client_;
+    };
+
+    inline bool IpcStreamWriter::WriteChunk(const uint8_t *data, size_t len, bool &disconnected, std::chrono::microseconds timeout)
+    {
+        return IpcClient::SendStatus(FFI::mipc_stream_write_chunk(stream_, data, len, IpcClient::TimeoutUs(timeout)), disconnected);
+    }
+
+    inline std::optional<IpcMessage> IpcCall::Wait(bool &disconnected, std::chrono::microseconds timeout)
+    {
+        uint8_t *data;
+        size_t len;
+
+        disconnected = false;
+        switch (FFI::mipc_call_wait(call_, &data, &len, IpcClient::TimeoutUs(timeout)))
+        {
+            case FFI::MIPC_SUCCESS:
+                return IpcMessage(data, len);
+            case FFI::MIPC_EMPTY:
+                return std::nullopt;
+            case FFI::MIPC_DISCONNECTED:
+                disconnected = true;
+                return std::nullopt;
+            default:
+                throw std::runtime_error("Unknown status code returned from mipc_call_wait");
+        }
+    }
+
+#ifdef MIPC_COROUTINES
+    inline int IpcAwaitLoop::Poll(std::chrono::milliseconds timeout)
+    {
+        int wait = -1;
+        if (timeout != std::chrono::milliseconds::max())
+            wait = static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(timeout.count(), INT32_MAX)));
+
+        epoll_event events[64];
+        int count = epoll_wait(epoll_, events, 64, wait);
+
+        // Collect the whole batch before resuming anything, since a resumed coroutine may
+        // destroy other waiters in it
+        std::vector<std::pair<int, Waiter *>> ready;
+        for (int i = 0; i < count; ++i)
+        {
+            auto found = waiters_.find(events[i].data.fd);
+            if (found != waiters_.end())
+                for (auto waiter : found->second)
+                    ready.emplace_back(found->first, waiter);
+        }
+
+        int resumed = 0;
+        for (auto &entry : ready)
+        {
+            // Skip it if it was destroyed meanwhile
+            auto found = waiters_.find(entry.first);
+            if (found == waiters_.end() ||
+                std::find(found->second.begin(), found->second.end(), entry.second) == found->second.end())
+                continue;
+            Waiter *waiter = entry.second;
+            // False if somebody else got there first
+            if (!waiter->Complete())
+                continue;
+            Remove(waiter);
+            resumed++;
+            waiter->handle_.resume();
+        }
+
+        // Whoever is still waiting goes back to sleep
+        for (int i = 0; i < count; ++i)
+        {
+            auto found = waiters_.find(events[i].data.fd);
+            if (found != waiters_.end() && !found->second.empty())
+                Arm(found->first);
+        }
+        return resumed;
+    }
+
+    inline void IpcAwaitLoop::Wait(int fd, Waiter *waiter, std::coroutine_handle<> handle)
+    {
+        if (fd == -1)
+            throw std::runtime_error("IpcClient has no descriptor to wait on");
+        Arm(fd);
+        waiter->handle_ = handle;
+        waiter->loop_ = this;
+        waiter->fd_ = fd;
+        waiters_[fd].push_back(waiter);
+        pending_++;
+    }
+
+    inline void IpcAwaitLoop::Arm(int fd)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.fd = fd;
+        // After its one shot a descriptor stays registered, just disabled
+        if (epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &event) == -1 &&
+            (errno != ENOENT || epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) == -1))
+            throw std::runtime_error("epoll_ctl failed");
+    }
+
+    inline void IpcAwaitLoop::Remove(Waiter *waiter)
+    {
+        auto found = waiters_.find(waiter->fd_);
+        if (found != waiters_.end())
+        {
+            auto &list = found->second;
+            list.erase(std::remove(list.begin(), list.end(), waiter), list.end());
+        }
+        waiter->loop_ = nullptr;
+        pending_--;
+    }
+
+    inline IpcAwaitLoop::Waiter::~Waiter()
+    {
+        if (!loop_)
+            return;
+        // Destroyed while suspended: stop polling for it, and for its descriptor if nobody
+        // else waits on it, which may be about to close
+        IpcAwaitLoop *loop = loop_;
+        loop->Remove(this);
+        auto found = loop->waiters_.find(fd_);
+        if (found != loop->waiters_.end() && found->second.empty())
+        {
+            epoll_ctl(loop->epoll_, EPOLL_CTL_DEL, fd_, nullptr);
+            loop->waiters_.erase(found);
+        }
+    }
+#endif
+
+    class IpcServer
+    {
+    public:
+        inline ~IpcServer()
+        {
+            if (server_)
+            {
+                FFI::mipc_server_close(server_);
+            }
+        }
+
+        IpcServer(const IpcServer &) = delete;
+        inline IpcServer(IpcServer &&move)
+            : server_(move.server_)
+        {
+            move.server_ = nullptr;
+        }
+
+        IpcServer &operator=(const IpcServer &) = delete;
+        inline IpcServer &operator=(IpcServer &&move)
+        {
+            if (server_ && server_ != move.server_)
+            {
+                FFI::mipc_server_close(server_);
+            }
+            server_ = move.server_;
+            move.server_ = nullptr;
+            return *this;
+        }
+
+        inline static std::optional<IpcServer> Listen(const char *name, const IpcOptions &options = IpcOptions())
+        {
+            if (auto ptr = FFI::mipc_listen(name, &options, sizeof(IpcOptions)))
+                return IpcServer(ptr);
+            return std::nullopt;
+        }
+
+        inline std::optional<IpcClient> Accept(std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            if (auto ptr = FFI::mipc_server_accept(server_, IpcClient::TimeoutUs(timeout)))
+                return IpcClient(ptr);
+            return std::nullopt;
+        }
+
+        // A message from any accepted client; `client_id` matches that client's Id(). Returns
+        // nullopt if nothing arrived in time, or once a client has disconnected and everything
+        // it sent was received, which sets `disconnected` and that client's `client_id`.
+        inline std::optional<IpcMessage> Recv(uint32_t &client_id, bool &disconnected,
+                                              std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            uint8_t *data;
+            size_t len;
+            disconnected = false;
+            switch (FFI::mipc_server_recv(server_, &client_id, &data, &len, IpcClient::TimeoutUs(timeout)))
+            {
+                case FFI::MIPC_SUCCESS:
+                    return IpcMessage(data, len);
+                case FFI::MIPC_EMPTY:
+                    return std::nullopt;
+                case FFI::MIPC_DISCONNECTED:
+                    disconnected = true;
+                    return std::nullopt;
+                default:
+                    throw std::runtime_error("Unknown status code returned from mipc_server_recv");
+            }
+        }
+
+        inline std::optional<IpcMessage> Recv(uint32_t &client_id, std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            bool disconnected;
+            return Recv(client_id, disconnected, timeout);
+        }
+
+    private:
+        inline explicit IpcServer(FFI::IpcServer *server)
+            : server_(server)
+        {
+        }
+
+        FFI::IpcServer *server_;
+    };
+
+    // The sending end of a broadcast channel; see FFI::mipc_publisher_open
+    class IpcPublisher
+    {
+    public:
+        inline ~IpcPublisher()
+        {
+            if (publisher_)
+            {
+                FFI::mipc_publisher_close(publisher_);
+            }
+        }
+
+        IpcPublisher(const IpcPublisher &) = delete;
+        inline IpcPublisher(IpcPublisher &&move)
+            : publisher_(move.publisher_)
+        {
+            move.publisher_ = nullptr;
+        }
+
+        IpcPublisher &operator=(const IpcPublisher &) = delete;
+        inline IpcPublisher &operator=(IpcPublisher &&move)
+        {
+            if (publisher_ && publisher_ != move.publisher_)
+            {
+                FFI::mipc_publisher_close(publisher_);
+            }
+            publisher_ = move.publisher_;
+            move.publisher_ = nullptr;
+            return *this;
+        }
+
+        inline static std::optional<IpcPublisher> Open(const char *name, const IpcOptions &options = IpcOptions())
+        {
+            if (auto ptr = FFI::mipc_publisher_open(name, &options, sizeof(IpcOptions)))
+                return IpcPublisher(ptr);
+            return std::nullopt;
+        }
+
+        // Returns false if the message is too large for the ring
+        inline bool Publish(const uint8_t *data, size_t len)
+        {
+            return FFI::mipc_publish(publisher_, data, len) == FFI::MIPC_SUCCESS;
+        }
+
+    private:
+        inline explicit IpcPublisher(FFI::IpcPublisher *publisher)
+            : publisher_(publisher)
+        {
+        }
+
+        FFI::IpcPublisher *publisher_;
+    };
+
+    // The receiving end of a broadcast channel; see FFI::mipc_subscriber_open
+    class IpcSubscriber
+    {
+    public:
+        inline ~IpcSubscriber()
+        {
+            if (subscriber_)
+            {
+                FFI::mipc_subscriber_close(subscriber_);
+            }
+        }
+
+        IpcSubscriber(const IpcSubscriber &) = delete;
+        inline IpcSubscriber(IpcSubscriber &&move)
+            : subscriber_(move.subscriber_)
+        {
+            move.subscriber_ = nullptr;
+        }
+
+        IpcSubscriber &operator=(const IpcSubscriber &) = delete;
+        inline IpcSubscriber &operator=(IpcSubscriber &&move)
+        {
+            if (subscriber_ && subscriber_ != move.subscriber_)
+            {
+                FFI::mipc_subscriber_close(subscriber_);
+            }
+            subscriber_ = move.subscriber_;
+            move.subscriber_ = nullptr;
+            return *this;
+        }
+
+        inline static std::optional<IpcSubscriber> Open(const char *name, uint32_t pid)
+        {
+            if (auto ptr = FFI::mipc_subscriber_open(name, pid))
+                return IpcSubscriber(ptr);
+            return std::nullopt;
+        }
+
+        // The next message. Returns nullopt if nothing arrived in time, if messages were lost
+        // to falling behind, which sets `lost` to how many, or once the publisher is gone,
+        // which sets `disconnected`.
+        inline std::optional<IpcMessage> Recv(uint64_t &lost, bool &disconnected,
+                                              std::chrono::microseconds timeout = std::chrono::microseconds::max())
+        {
+            uint8_t *data;
+            size_t len;
+
+            lost = 0;
+            disconnected = false;
+            switch (FFI::mipc_subscriber_recv(subscriber_, &data, &len, IpcClient::TimeoutUs(timeout)))
+            {
+                case FFI::MIPC_SUCCESS:
+                    return IpcMessage(data, len);
+                case FFI::MIPC_EMPTY:
+                    return std::nullopt;
+                case FFI::MIPC_LAGGED:
+                    lost = len;
+                    return std::nullopt;
+                case FFI::MIPC_DISCONNECTED:
+                    disconnected = true;
+                    return std::nullopt;
+                default:
+                    throw std::runtime_error("Unknown status code returned from mipc_subscriber_recv");
+            }
+        }
+
+        // See FFI::mipc_subscriber_lost
+        inline uint64_t Lost()
+        {
+            return FFI::mipc_subscriber_lost(subscriber_);
+        }
+
+    private:
+        inline explicit IpcSubscriber(FFI::IpcSubscriber *subscriber)
+            : subscriber_(subscriber)
+        {
+        }
+
+        FFI::IpcSubscriber *subscriber_;
     };
 }
@@ -0,0 +1,433 @@
+// The MIT License (MIT)
+// Copyright (c) 2016 Connor Hilarides
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+// and associated documentation files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+// BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#pragma once
+
+#include <connorlib/messageipc.h>
+#include <cassert>
+#include <cstring>
+#include <type_traits>
+
+// Typed messages read where they were received and built where they will be sent, with no
+// encoding pass and no copy in between. A schema is a list of fields, each a type of its own:
+//
+//     struct Id : MessageIpc::Layout::Field<uint64_t> {};
+//     struct Symbol : MessageIpc::Layout::Field<MessageIpc::Layout::String> {};
+//     struct Fills : MessageIpc::Layout::Field<MessageIpc::Layout::Array<double>> {};
+//     typedef MessageIpc::Layout::Schema<Id, Symbol, Fills> Order;
+//
+// A message starts with the size of its fixed part as a uint32_t and four bytes of padding.
+// Then come the fields in order, each at its natural alignment. Scalars, which can be any
+// trivially copyable type, are stored in place. Strings, byte strings and arrays are stored as
+// a uint32_t offset from the start of the message and a uint32_t count, with their contents
+// after the fixed part. Both ends are on one machine, so it's all in the host's byte order.
+//
+// Fields can be added to the end of a schema later on. Reading a field past the end of an
+// older message's fixed part gives its default, and fields a reader doesn't know are skipped.
+
+namespace MessageIpc
+{
+    namespace Layout
+    {
+        // Field types stored out of line
+        struct String {};
+        struct Bytes {};
+        template <typename T>
+        struct Array {};
+
+        template <typename T>
+        struct Field
+        {
+            typedef T Type;
+        };
+
+        // A run of array elements inside a message
+        template <typename T>
+        class ArrayView
+        {
+        public:
+            inline ArrayView()
+                : data_(nullptr), len_(0)
+            {
+            }
+
+            inline ArrayView(const T *data, size_t len)
+                : data_(data), len_(len)
+            {
+            }
+
+            inline const T &operator[](size_t index) const
+            {
+                assert(index < len_);
+                return data_[index];
+            }
+
+            inline const T *data() const
+            {
+                return data_;
+            }
+
+            inline const T *begin() const
+            {
+                return data_;
+            }
+
+            inline const T *end() const
+            {
+                return data_ + len_;
+            }
+
+            inline size_t size() const
+            {
+                return len_;
+            }
+
+            inline bool empty() const
+            {
+                return len_ == 0;
+            }
+
+        private:
+            const T *data_;
+            size_t len_;
+        };
+
+        namespace Detail
+        {
+            struct Ref
+            {
+                uint32_t offset;
+                uint32_t count;
+            };
+
+            // Stands in for the scalar or element type of a field that has none, so the
+            // builder overloads for it can never be picked
+            struct None;
+
+            const size_t HeaderSize = 8;
+
+            constexpr size_t AlignUp(size_t offset, size_t align)
+            {
+                return (offset + align - 1) / align * align;
+            }
+
+            constexpr size_t Max(size_t a, size_t b)
+            {
+                return a > b ? a : b;
+            }
+
+            // How a field's type is stored, and what reading it gives back
+            template <typename T>
+            struct Kind
+            {
+                static_assert(std::is_trivially_copyable<T>::value, "scalar fields must be trivially copyable");
+                typedef T Stored;
+                typedef T Value;
+                typedef T Scalar;
+                typedef None Element;
+
+                static inline Value Read(const uint8_t *data, size_t offset)
+                {
+                    T value;
+                    std::memcpy(&value, data + offset, sizeof(T));
+                    return value;
+                }
+            };
+
+            template <typename E, typename V>
+            struct RefKind
+            {
+                typedef Ref Stored;
+                typedef V Value;
+                typedef None Scalar;
+                typedef E Element;
+
+                static inline Value Read(const uint8_t *data, size_t offset)
+                {
+                    Ref ref;
+                    std::memcpy(&ref, data + offset, sizeof(Ref));
+                    if (ref.count == 0)
+                        return Value();
+                    return Value(reinterpret_cast<const E *>(data + ref.offset), ref.count);
+                }
+            };
+
+            template <>
+            struct Kind<String> : RefKind<char, Rust::Slice<const char>> {};
+
+            template <>
+            struct Kind<Bytes> : RefKind<uint8_t, Rust::Slice<const uint8_t>> {};
+
+            template <typename T>
+            struct Kind<Array<T>> : RefKind<T, ArrayView<T>>
+            {
+                static_assert(std::is_trivially_copyable<T>::value, "array elements must be trivially copyable");
+            };
+
+            template <typename F>
+            using KindOf = Kind<typename F::Type>;
+
+            template <typename F>
+            using StoredOf = typename KindOf<F>::Stored;
+
+            // Where the fixed part ends
+            template <size_t Offset, typename... Fields>
+            struct End : std::integral_constant<size_t, Offset> {};
+
+            template <size_t Offset, typename F, typename... Rest>
+            struct End<Offset, F, Rest...>
+                : End<AlignUp(Offset, alignof(StoredOf<F>)) + sizeof(StoredOf<F>), Rest...> {};
+
+            // Where field G starts
+            template <typename G, size_t Offset, typename... Fields>
+            struct OffsetOf
+            {
+                static_assert(sizeof(G) == 0, "the field is not part of this schema");
+            };
+
+            template <typename G, size_t Offset, typename... Rest>
+            struct OffsetOf<G, Offset, G, Rest...>
+                : std::integral_constant<size_t, AlignUp(Offset, alignof(StoredOf<G>))> {};
+
+            template <typename G, size_t Offset, typename F, typename... Rest>
+            struct OffsetOf<G, Offset, F, Rest...>
+                : OffsetOf<G, AlignUp(Offset, alignof(StoredOf<F>)) + sizeof(StoredOf<F>), Rest...> {};
+
+            // The strictest alignment of any field, which is what the message needs
+            template <typename... Fields>
+            struct AlignOf : std::integral_constant<size_t, alignof(uint32_t)> {};
+
+            template <typename F, typename... Rest>
+            struct AlignOf<F, Rest...>
+                : std::integral_constant<size_t, Max(alignof(StoredOf<F>), AlignOf<Rest...>::value)> {};
+
+            // Whether a string or array field points inside the message. Scalars can't be wrong.
+            template <typename F>
+            inline bool Check(const uint8_t *, size_t, size_t, size_t, std::false_type)
+            {
+                return true;
+            }
+
+            template <typename F>
+            inline bool Check(const uint8_t *data, size_t len, size_t fixed, size_t offset, std::true_type)
+            {
+                typedef typename KindOf<F>::Element E;
+                if (offset + sizeof(Ref) > fixed)
+                    return true;
+                Ref ref;
+                std::memcpy(&ref, data + offset, sizeof(Ref));
+                return ref.count == 0
+                    || (ref.offset % alignof(E) == 0 && ref.offset <= len
+                        && ref.count <= (len - ref.offset) / sizeof(E));
+            }
+        }
+
+        template <typename... Fields>
+        struct Schema
+        {
+            // The bytes up to the end of the last field, the least a message of this schema takes
+            static constexpr size_t FixedSize = Detail::End<Detail::HeaderSize, Fields...>::value;
+            // The alignment a message must have to be read in place
+            static constexpr size_t Align = Detail::AlignOf<Fields...>::value;
+
+            template <typename F>
+            using Offset = Detail::OffsetOf<F, Detail::HeaderSize, Fields...>;
+
+            // Enough room for `count` elements of a string or array, however they fall
+            template <typename T>
+            static constexpr size_t SpaceFor(size_t count)
+            {
+                return count * sizeof(T) + alignof(T) - 1;
+            }
+
+            static inline bool Verify(const uint8_t *data, size_t len, size_t fixed)
+            {
+                bool ok = true;
+                (void)std::initializer_list<int>{
+                    (ok = ok && Detail::Check<Fields>(data, len, fixed, Offset<Fields>::value,
+                                                      std::integral_constant<bool, std::is_same<Detail::StoredOf<Fields>, Detail::Ref>::value>()), 0)...
+                };
+                return ok;
+            }
+        };
+
+        template <typename... Fields>
+        constexpr size_t Schema<Fields...>::FixedSize;
+
+        template <typename... Fields>
+        constexpr size_t Schema<Fields...>::Align;
+
+        // An empty schema has nothing to check beyond its header
+        template <>
+        inline bool Schema<>::Verify(const uint8_t *, size_t, size_t)
+        {
+            return true;
+        }
+    }
+
+    // A message read in place through its schema. It points into the message's buffer, so it
+    // must not outlive the IpcMessage it was opened on.
+    template <typename Schema>
+    class IpcMessageView
+    {
+    public:
+        // Checks once that the message is aligned and that every string and array in it lies
+        // within it, so the accessors never read outside it. Returns nullopt if not. Received
+        // messages are always aligned well enough.
+        inline static std::optional<IpcMessageView> Open(const uint8_t *data, size_t len)
+        {
+            if (len < Layout::Detail::HeaderSize || reinterpret_cast<uintptr_t>(data) % Schema::Align != 0)
+                return std::nullopt;
+            uint32_t fixed;
+            std::memcpy(&fixed, data, sizeof(fixed));
+            if (fixed < Layout::Detail::HeaderSize || fixed > len || !Schema::Verify(data, len, fixed))
+                return std::nullopt;
+            return IpcMessageView(data, fixed);
+        }
+
+        inline static std::optional<IpcMessageView> Open(const IpcMessage &message)
+        {
+            return Open(message.data(), message.len());
+        }
+
+        // Whether the sender's schema had field F. If not, Get gives its default.
+        template <typename F>
+        inline bool Has() const
+        {
+            return Schema::template Offset<F>::value + sizeof(Layout::Detail::StoredOf<F>) <= fixed_;
+        }
+
+        // A scalar's value, or a string or array's contents still inside the message
+        template <typename F>
+        inline typename Layout::Detail::KindOf<F>::Value Get() const
+        {
+            if (!Has<F>())
+                return typename Layout::Detail::KindOf<F>::Value();
+            return Layout::Detail::KindOf<F>::Read(data_, Schema::template Offset<F>::value);
+        }
+
+    private:
+        inline IpcMessageView(const uint8_t *data, size_t fixed)
+            : data_(data), fixed_(fixed)
+        {
+        }
+
+        const uint8_t *data_;
+        size_t fixed_;
+    };
+
+    // Lays a message out directly in the memory it will be sent from, e.g. an IpcSharedBuffer.
+    // Fields not set read as zero or empty.
+    template <typename Schema>
+    class IpcMessageBuilder
+    {
+    public:
+        // `capacity` needs to be Schema::FixedSize plus Schema::SpaceFor each string and array
+        inline IpcMessageBuilder(uint8_t *data, size_t capacity)
+            : data_(data), capacity_(capacity), len_(Schema::FixedSize), ok_(capacity >= Schema::FixedSize)
+        {
+            if (ok_)
+            {
+                uint32_t fixed = Schema::FixedSize;
+                std::memset(data_, 0, Schema::FixedSize);
+                std::memcpy(data_, &fixed, sizeof(fixed));
+            }
+        }
+
+        inline explicit IpcMessageBuilder(IpcSharedBuffer &buffer)
+            : IpcMessageBuilder(buffer.data(), buffer.len())
+        {
+        }
+
+        template <typename F>
+        inline void Set(const typename Layout::Detail::KindOf<F>::Scalar &value)
+        {
+            if (ok_)
+            {
+                std::memcpy(data_ + Schema::template Offset<F>::value, &value, sizeof(value));
+            }
+        }
+
+        // Copies the contents of a string or array in after what's already been added. Returns
+        // false, and leaves the builder failed, if they don't fit.
+        template <typename F>
+        inline bool Set(const typename Layout::Detail::KindOf<F>::Element *items, size_t count)
+        {
+            typedef typename Layout::Detail::KindOf<F>::Element E;
+            E *dest = Add<F>(count);
+            if (dest && count)
+            {
+                std::memcpy(dest, items, count * sizeof(E));
+            }
+            return ok_;
+        }
+
+        template <typename F>
+        inline bool Set(Rust::Slice<const typename Layout::Detail::KindOf<F>::Element> items)
+        {
+            return Set<F>(items.data, items.len);
+        }
+
+        // Makes room for `count` elements of a string or array and returns them to be filled in
+        // place. Returns nullptr, and leaves the builder failed, if they don't fit. The buffer
+        // must have Schema::Align alignment for the elements to be aligned.
+        template <typename F>
+        inline typename Layout::Detail::KindOf<F>::Element *Add(size_t count)
+        {
+            typedef typename Layout::Detail::KindOf<F>::Element E;
+            size_t start = Layout::Detail::AlignUp(len_, alignof(E));
+            if (!ok_ || start > capacity_ || count > (capacity_ - start) / sizeof(E)
+                || start + count * sizeof(E) > UINT32_MAX)
+            {
+                ok_ = false;
+                return nullptr;
+            }
+            assert(reinterpret_cast<uintptr_t>(data_ + start) % alignof(E) == 0);
+
+            Layout::Detail::Ref ref;
+            ref.offset = static_cast<uint32_t>(start);
+            ref.count = static_cast<uint32_t>(count);
+            std::memcpy(data_ + Schema::template Offset<F>::value, &ref, sizeof(ref));
+            len_ = start + count * sizeof(E);
+            return reinterpret_cast<E *>(data_ + start);
+        }
+
+        // False if something didn't fit, in which case the message is incomplete
+        inline bool ok() const
+        {
+            return ok_;
+        }
+
+        inline const uint8_t *data() const
+        {
+            return data_;
+        }
+
+        // How much of the buffer the message takes so far
+        inline size_t len() const
+        {
+            return len_;
+        }
+
+    private:
+        uint8_t *data_;
+        size_t capacity_;
+        size_t len_;
+        bool ok_;
+    };
+}
@@ -10,6 +10,11 @@
 # ifndef ___OPTIONAL_HPP___
 # define ___OPTIONAL_HPP___
 
+// From C++17 on the standard library has the real thing, which this would collide with
+# if __cplusplus >= 201703L || (defined _MSVC_LANG && _MSVC_LANG >= 201703L)
+#   include <optional>
+# else
+
 # include <utility>
 # include <type_traits>
 # include <initializer_list>
@@ -1066,5 +1071,7 @@ namespace std
 # undef TR2_OPTIONAL_REQUIRES
 # undef TR2_OPTIONAL_ASSERTED_EXPRESSION
 
+# endif // C++17
+
 # endif //___OPTIONAL_HPP___
 
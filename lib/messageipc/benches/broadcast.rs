@@ -0,0 +1,146 @@
+//! What publishing on a broadcast channel costs as subscribers are added, each subscriber a
+//! process of its own. Linux only.
+//!
+//! For each subscriber count the publisher sends a run of messages as fast as it can, then
+//! waits for every subscriber to report how many it received and how many it lost to falling
+//! behind. The cost of a publish is the publisher's time over the run divided by the messages.
+//!
+//! Run with `cargo bench --bench broadcast [-- options]`:
+//!   --subscribers 1,2,4,8,16   subscriber counts to measure
+//!   --size BYTES               message size (default: 64)
+//!   --messages N               messages per run (default: 1000000)
+//!
+//! The subscribers are this same executable, started again with `--subscriber`.
+
+extern crate messageipc;
+
+#[cfg(target_os = "linux")]
+mod bench {
+    use std::io::{self, BufRead, BufReader};
+    use std::process::{self, Command, Stdio};
+    use std::time::{Duration, Instant};
+    use std::{env, thread};
+
+    use messageipc::{Options, Publisher, RecvError, Subscriber};
+
+    fn seconds(duration: Duration) -> f64 {
+        duration.as_secs() as f64 + duration.subsec_nanos() as f64 / 1e9
+    }
+
+    fn subscribe(name: &str, pid: u32) -> Subscriber {
+        // The publisher may not have created the channel yet
+        let deadline = Instant::now() + Duration::from_secs(10);
+        loop {
+            match Subscriber::open(name, pid) {
+                Ok(subscriber) => return subscriber,
+                Err(ref e) if Instant::now() < deadline && e.kind() == io::ErrorKind::NotFound => {
+                    thread::sleep(Duration::from_millis(1))
+                }
+                Err(e) => panic!("failed to subscribe: {}", e),
+            }
+        }
+    }
+
+    /// Receive until the publisher goes away, then report "received lost" on stdout
+    fn run_subscriber(mut args: env::Args) {
+        let name = args.next().unwrap();
+        let pid = args.next().unwrap().parse().unwrap();
+        let subscriber = subscribe(&name, pid);
+        println!("ready");
+
+        let mut received = 0u64;
+        loop {
+            match subscriber.recv(None) {
+                Ok(_) => received += 1,
+                Err(RecvError::Lagged(_)) => {}
+                Err(_) => break,
+            }
+        }
+        println!("{} {}", received, subscriber.lost());
+    }
+
+    struct Run {
+        ns_per_publish: f64,
+        received: u64,
+        lost: u64,
+    }
+
+    fn run(count: usize, size: usize, messages: usize, index: usize) -> Run {
+        let name = format!("bench_broadcast_{}_{}", process::id(), index);
+        let options = Options { ring_size: 64 << 20, ..Options::default() };
+        let publisher = Publisher::open(&name, &options).unwrap();
+
+        let mut children = Vec::new();
+        for _ in 0..count {
+            let mut child = Command::new(env::current_exe().unwrap())
+                .args(&["--subscriber", &name, &process::id().to_string()])
+                .stdout(Stdio::piped())
+                .spawn()
+                .unwrap();
+            let mut stdout = BufReader::new(child.stdout.take().unwrap());
+            let mut line = String::new();
+            stdout.read_line(&mut line).unwrap();
+            assert_eq!(line.trim(), "ready");
+            children.push((child, stdout));
+        }
+
+        let message = vec![0x5a; size];
+        let start = Instant::now();
+        for _ in 0..messages {
+            publisher.publish(&message).unwrap();
+        }
+        let elapsed = seconds(start.elapsed());
+        drop(publisher);
+
+        let (mut received, mut lost) = (0, 0);
+        for (mut child, mut stdout) in children {
+            let mut line = String::new();
+            stdout.read_line(&mut line).unwrap();
+            let counts: Vec<u64> = line.split_whitespace().map(|count| count.parse().unwrap()).collect();
+            received += counts[0];
+            lost += counts[1];
+            assert!(child.wait().unwrap().success(), "subscriber failed");
+        }
+
+        Run { ns_per_publish: elapsed * 1e9 / messages as f64, received: received, lost: lost }
+    }
+
+    pub fn main() {
+        let mut args = env::args();
+        args.next();
+        let mut counts = vec![1, 2, 4, 8, 16];
+        let mut size = 64;
+        let mut messages = 1000000;
+        while let Some(arg) = args.next() {
+            match &arg[..] {
+                "--subscriber" => return run_subscriber(args),
+                "--bench" => {}
+                "--subscribers" => {
+                    counts = args.next().expect("--subscribers needs a list")
+                        .split(',')
+                        .map(|count| count.parse().expect("bad subscriber count"))
+                        .collect();
+                }
+                "--size" => size = args.next().and_then(|arg| arg.parse().ok()).expect("--size needs a number"),
+                "--messages" => messages = args.next().and_then(|arg| arg.parse().ok()).expect("--messages needs a number"),
+                _ => panic!("unknown argument {}", arg),
+            }
+        }
+
+        println!("{:>6} {:>12} {:>14} {:>14}", "subs", "ns/publish", "received", "lost");
+        for (index, &count) in counts.iter().enumerate() {
+            let run = run(count, size, messages, index);
+            println!("{:>6} {:>12.1} {:>14} {:>14}", count, run.ns_per_publish, run.received, run.lost);
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn main() {
+    bench::main();
+}
+
+#[cfg(not(target_os = "linux"))]
+fn main() {
+    println!("broadcast channels are Linux only");
+}
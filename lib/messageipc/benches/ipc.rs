@@ -0,0 +1,286 @@
+//! Round-trip latency and one-way throughput of each transport, swept over message sizes from
+//! 8 bytes to 64 MiB, with the peer both in this process and in a child process.
+//!
+//! Latency is the time for a message to go to the peer and be echoed back, reported as
+//! percentiles. Throughput is how long the peer takes to receive a run of messages and
+//! acknowledge the last one. A table goes to stdout and every row to a CSV file as well.
+//!
+//! Run with `cargo bench --bench ipc [-- options]`:
+//!   --transport pipe,shm,socket   transports to measure (default: all this platform has)
+//!   --max-size BYTES              skip sizes above this (default: 64 MiB)
+//!   --csv PATH                    where to write results (default: target/bench-ipc.csv)
+//!   --spin-us N                   busy-poll budget for both ends (default: 0, never spin)
+//!
+//! The child process is this same executable, started again with `--peer`.
+
+extern crate messageipc;
+
+use std::fs::File;
+use std::io::{self, BufWriter, Write};
+use std::process::{self, Command};
+use std::time::{Duration, Instant};
+use std::{cmp, env, str, thread};
+
+use messageipc::{options, IpcClient, Options};
+
+const SIZES: &'static [usize] = &[8, 64, 512, 4 << 10, 32 << 10, 256 << 10, 2 << 20, 16 << 20, 64 << 20];
+
+// Every measurement moves about this many bytes each way, within the count limits below
+const LATENCY_BYTES: usize = 64 << 20;
+const THROUGHPUT_BYTES: usize = 256 << 20;
+const MIN_ROUND_TRIPS: usize = 5;
+const MAX_ROUND_TRIPS: usize = 20000;
+const MIN_MESSAGES: usize = 4;
+const MAX_MESSAGES: usize = 200000;
+
+#[cfg(target_os = "linux")]
+const TRANSPORTS: &'static [(&'static str, u32)] = &[
+    ("pipe", options::TRANSPORT_PIPE),
+    ("shm", options::TRANSPORT_SHM),
+    ("socket", options::TRANSPORT_SOCKET),
+];
+#[cfg(all(unix, not(target_os = "linux")))]
+const TRANSPORTS: &'static [(&'static str, u32)] = &[
+    ("pipe", options::TRANSPORT_PIPE),
+    ("socket", options::TRANSPORT_SOCKET),
+];
+#[cfg(windows)]
+const TRANSPORTS: &'static [(&'static str, u32)] = &[("pipe", options::TRANSPORT_PIPE)];
+
+fn options(transport: u32, spin_us: u32) -> Options {
+    Options {
+        transport: transport,
+        // Keeps the sender from queueing up gigabytes ahead of the peer at the larger sizes
+        high_water_bytes: 16 << 20,
+        spin_us: spin_us,
+        ..Options::default()
+    }
+}
+
+fn micros(duration: Duration) -> f64 {
+    duration.as_secs() as f64 * 1e6 + duration.subsec_nanos() as f64 / 1e3
+}
+
+fn seconds(duration: Duration) -> f64 {
+    duration.as_secs() as f64 + duration.subsec_nanos() as f64 / 1e9
+}
+
+fn percentile(sorted: &[f64], p: f64) -> f64 {
+    sorted[((sorted.len() - 1) as f64 * p) as usize]
+}
+
+fn open_client(name: &str, pid: u32, options: &Options) -> IpcClient {
+    // The server may not have created its end yet
+    let deadline = Instant::now() + Duration::from_secs(10);
+    loop {
+        match IpcClient::open_client(name, pid, options) {
+            Ok(client) => return client,
+            Err(ref e) if Instant::now() < deadline && match e.kind() {
+                io::ErrorKind::NotFound | io::ErrorKind::ConnectionRefused | io::ErrorKind::InvalidData => true,
+                _ => false,
+            } => thread::sleep(Duration::from_millis(1)),
+            Err(e) => panic!("failed to open client: {}", e),
+        }
+    }
+}
+
+/// The far end of every measurement. Commands arrive as messages of their own:
+/// "ping N" echoes the next N messages, "sink N" takes N messages and then acknowledges them
+/// with one of its own, and "quit" ends the session.
+fn peer(client: IpcClient) {
+    while let Some(command) = client.recv() {
+        let command = str::from_utf8(&command).unwrap().to_string();
+        let mut words = command.split(' ');
+        let verb = words.next().unwrap();
+        let count: usize = words.next().map(|count| count.parse().unwrap()).unwrap_or(0);
+        match verb {
+            "ping" => for _ in 0..count {
+                let message = client.recv().unwrap();
+                client.send_timeout(&message, None).unwrap();
+            },
+            "sink" => {
+                for _ in 0..count {
+                    client.recv().unwrap();
+                }
+                client.send_timeout(b"done", None).unwrap();
+            }
+            _ => break,
+        }
+    }
+}
+
+enum Peer {
+    Thread(thread::JoinHandle<()>),
+    Process(process::Child),
+}
+
+impl Peer {
+    fn wait(self) {
+        match self {
+            Peer::Thread(thread) => thread.join().unwrap(),
+            Peer::Process(mut child) => assert!(child.wait().unwrap().success(), "peer process failed"),
+        }
+    }
+}
+
+fn connect(scope: &str, transport: u32, spin_us: u32, index: usize) -> (IpcClient, Peer) {
+    let name = format!("bench_ipc_{}_{}", process::id(), index);
+    let pid = process::id();
+    let options = options(transport, spin_us);
+    match scope {
+        "thread" => {
+            let client_name = name.clone();
+            let peer = thread::spawn(move || peer(open_client(&client_name, pid, &options)));
+            let server = IpcClient::open_server(&name, &options).unwrap();
+            (server, Peer::Thread(peer))
+        }
+        _ => {
+            let child = Command::new(env::current_exe().unwrap())
+                .args(&["--peer", &name, &pid.to_string(), &transport.to_string(), &spin_us.to_string()])
+                .spawn()
+                .unwrap();
+            let server = IpcClient::open_server(&name, &options).unwrap();
+            (server, Peer::Process(child))
+        }
+    }
+}
+
+struct Latency {
+    samples: usize,
+    min: f64,
+    p50: f64,
+    p99: f64,
+    p999: f64,
+    max: f64,
+}
+
+fn latency(client: &IpcClient, message: &[u8]) -> Latency {
+    let round_trips = cmp::min(cmp::max(LATENCY_BYTES / message.len(), MIN_ROUND_TRIPS), MAX_ROUND_TRIPS);
+    // A few unmeasured round trips first, so the buffer pools are warm
+    let warmup = cmp::min(round_trips / 10, 100) + 1;
+
+    client.send(format!("ping {}", warmup + round_trips).as_bytes()).unwrap();
+    for _ in 0..warmup {
+        client.send_timeout(message, None).unwrap();
+        client.recv().unwrap();
+    }
+
+    let mut samples = Vec::with_capacity(round_trips);
+    for _ in 0..round_trips {
+        let start = Instant::now();
+        client.send_timeout(message, None).unwrap();
+        let echo = client.recv().unwrap();
+        samples.push(micros(start.elapsed()));
+        assert_eq!(echo.len(), message.len());
+    }
+    samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+
+    Latency {
+        samples: samples.len(),
+        min: samples[0],
+        p50: percentile(&samples, 0.5),
+        p99: percentile(&samples, 0.99),
+        p999: percentile(&samples, 0.999),
+        max: samples[samples.len() - 1],
+    }
+}
+
+struct Throughput {
+    messages: usize,
+    mb_per_sec: f64,
+    messages_per_sec: f64,
+}
+
+fn throughput(client: &IpcClient, message: &[u8]) -> Throughput {
+    let messages = cmp::min(cmp::max(THROUGHPUT_BYTES / message.len(), MIN_MESSAGES), MAX_MESSAGES);
+
+    let start = Instant::now();
+    client.send(format!("sink {}", messages).as_bytes()).unwrap();
+    for _ in 0..messages {
+        client.send_timeout(message, None).unwrap();
+    }
+    assert_eq!(&client.recv().unwrap()[..], b"done");
+    let elapsed = seconds(start.elapsed());
+
+    Throughput {
+        messages: messages,
+        mb_per_sec: (messages * message.len()) as f64 / elapsed / (1 << 20) as f64,
+        messages_per_sec: messages as f64 / elapsed,
+    }
+}
+
+fn size_label(size: usize) -> String {
+    if size >= 1 << 20 {
+        format!("{}M", size >> 20)
+    } else if size >= 1 << 10 {
+        format!("{}K", size >> 10)
+    } else {
+        format!("{}", size)
+    }
+}
+
+fn run_peer(mut args: env::Args) {
+    let name = args.next().unwrap();
+    let pid = args.next().unwrap().parse().unwrap();
+    let transport = args.next().unwrap().parse().unwrap();
+    let spin_us = args.next().unwrap().parse().unwrap();
+    peer(open_client(&name, pid, &options(transport, spin_us)));
+}
+
+fn main() {
+    let mut args = env::args();
+    args.next();
+    let mut transports: Vec<(&str, u32)> = TRANSPORTS.to_vec();
+    let mut max_size = 64 << 20;
+    let mut csv_path = "target/bench-ipc.csv".to_string();
+    let mut spin_us = 0;
+    while let Some(arg) = args.next() {
+        match &arg[..] {
+            "--peer" => return run_peer(args),
+            "--bench" => {}
+            "--transport" => {
+                let wanted = args.next().expect("--transport needs a list");
+                transports = wanted.split(',')
+                    .map(|name| *TRANSPORTS.iter()
+                        .find(|&&(known, _)| known == name)
+                        .unwrap_or_else(|| panic!("unknown transport {}", name)))
+                    .collect();
+            }
+            "--max-size" => max_size = args.next().and_then(|arg| arg.parse().ok()).expect("--max-size needs a number"),
+            "--csv" => csv_path = args.next().expect("--csv needs a path"),
+            "--spin-us" => spin_us = args.next().and_then(|arg| arg.parse().ok()).expect("--spin-us needs a number"),
+            _ => panic!("unknown argument {}", arg),
+        }
+    }
+
+    let mut csv = BufWriter::new(File::create(&csv_path).unwrap());
+    writeln!(csv, "scope,transport,size,round_trips,min_us,p50_us,p99_us,p999_us,max_us,messages,mb_per_sec,messages_per_sec").unwrap();
+
+    println!("{:<8} {:<7} {:>6} {:>10} {:>10} {:>10} {:>10} {:>10} {:>12}",
+             "scope", "trans", "size", "min us", "p50 us", "p99 us", "p99.9 us", "MiB/s", "msg/s");
+    let mut index = 0;
+    for &scope in &["thread", "process"] {
+        for &(transport_name, transport) in &transports {
+            for &size in SIZES.iter().filter(|&&size| size <= max_size) {
+                let (client, peer) = connect(scope, transport, spin_us, index);
+                index += 1;
+
+                let message = vec![0x5a; size];
+                let latency = latency(&client, &message);
+                let throughput = throughput(&client, &message);
+                client.send(b"quit").unwrap();
+                peer.wait();
+
+                println!("{:<8} {:<7} {:>6} {:>10.2} {:>10.2} {:>10.2} {:>10.2} {:>10.1} {:>12.0}",
+                         scope, transport_name, size_label(size), latency.min, latency.p50, latency.p99,
+                         latency.p999, throughput.mb_per_sec, throughput.messages_per_sec);
+                writeln!(csv, "{},{},{},{},{:.3},{:.3},{:.3},{:.3},{:.3},{},{:.3},{:.1}",
+                         scope, transport_name, size, latency.samples, latency.min, latency.p50, latency.p99,
+                         latency.p999, latency.max, throughput.messages, throughput.mb_per_sec,
+                         throughput.messages_per_sec).unwrap();
+                csv.flush().unwrap();
+            }
+        }
+    }
+    println!("results written to {}", csv_path);
+}
@@ -0,0 +1,88 @@
+//! Compares IO_THREADS and IO_REACTOR with many connections open at once: how many threads
+//! the process ends up running, and the round-trip latency of a small message.
+//!
+//! Both ends of every connection live in this process, so each connection is counted twice.
+//! Run with `cargo bench --bench reactor [connections] [round trips per connection]`.
+
+extern crate messageipc;
+
+use std::fs::File;
+use std::io::{self, Read};
+use std::time::{Duration, Instant};
+use std::{env, process, thread};
+
+use messageipc::{options, IpcClient, Options};
+
+fn thread_count() -> usize {
+    let mut status = String::new();
+    File::open("/proc/self/status").and_then(|mut file| file.read_to_string(&mut status)).unwrap();
+    status.lines()
+        .find(|line| line.starts_with("Threads:"))
+        .and_then(|line| line["Threads:".len()..].trim().parse().ok())
+        .unwrap_or(0)
+}
+
+fn open_pair(name: &str, options: Options) -> (IpcClient, IpcClient) {
+    let server_name = name.to_string();
+    let server = thread::spawn(move || IpcClient::open_server(&server_name, &options).unwrap());
+
+    // The server creates the FIFOs, so the client keeps trying until they exist
+    let pid = process::id();
+    let client = loop {
+        match IpcClient::open_client(name, pid, &options) {
+            Ok(client) => break client,
+            Err(ref e) if e.kind() == io::ErrorKind::NotFound => thread::sleep(Duration::from_millis(1)),
+            Err(e) => panic!("failed to open client: {}", e),
+        }
+    };
+    (server.join().unwrap(), client)
+}
+
+fn percentile(sorted: &[f64], p: f64) -> f64 {
+    sorted[((sorted.len() - 1) as f64 * p) as usize]
+}
+
+fn run(label: &str, io_mode: u32, connections: usize, round_trips: usize) {
+    let options = Options { io_mode: io_mode, ..Options::default() };
+    let before = thread_count();
+    let pairs: Vec<_> = (0..connections)
+        .map(|i| open_pair(&format!("bench_reactor_{}_{}", io_mode, i), options))
+        .collect();
+    let threads = thread_count() - before;
+
+    let message = [0u8; 16];
+    let mut samples = Vec::with_capacity(connections * round_trips);
+    for _ in 0..round_trips {
+        for &(ref server, ref client) in &pairs {
+            let start = Instant::now();
+            server.send(&message).unwrap();
+            let request = client.recv().unwrap();
+            client.send(&request).unwrap();
+            server.recv().unwrap();
+            let elapsed = start.elapsed();
+            samples.push(elapsed.as_secs() as f64 * 1e6 + elapsed.subsec_nanos() as f64 / 1e3);
+        }
+    }
+    samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+
+    println!("{:<8} {:>6} {:>8} {:>10.2} {:>10.2} {:>10.2}", label, connections, threads,
+             percentile(&samples, 0.5), percentile(&samples, 0.99), percentile(&samples, 0.999));
+
+    // I/O threads exit on their own once their connection closes; let them finish before the
+    // next run counts threads
+    drop(pairs);
+    let deadline = Instant::now() + Duration::from_secs(5);
+    while thread_count() > before && Instant::now() < deadline {
+        thread::sleep(Duration::from_millis(10));
+    }
+}
+
+fn main() {
+    let mut args = env::args().skip(1).filter(|arg| arg != "--bench");
+    let connections = args.next().and_then(|arg| arg.parse().ok()).unwrap_or(50);
+    let round_trips = args.next().and_then(|arg| arg.parse().ok()).unwrap_or(2000);
+
+    println!("{:<8} {:>6} {:>8} {:>10} {:>10} {:>10}", "mode", "conns", "threads", "p50 us", "p99 us", "p99.9 us");
+    run("threads", options::IO_THREADS, connections, round_trips);
+    run("reactor", options::IO_REACTOR, connections, round_trips);
+}
@@ -0,0 +1,204 @@
+//! Plays back a capture made with `IpcClient::start_capture`, so a transport or a consumer
+//! can be measured against traffic recorded from a real application instead of a made-up load.
+//!
+//! The messages the capturing end sent go to a consumer process, at the pace they were
+//! recorded at or as fast as the connection takes them. The consumer receives until the
+//! connection closes and reports what it got. At the recorded pace, how late each message goes
+//! out shows where the transport or the consumer fell behind the original traffic.
+//!
+//! Run with `cargo bench --bench replay -- CAPTURE [options]`:
+//!   --fast                         send as fast as possible instead of at the recorded pace
+//!   --received                     replay what the capturing end received instead
+//!   --transport pipe|shm|socket    transport to replay over (default: pipe)
+//!   --reactor                      use the reactor I/O mode, for pipes
+//!   --spin-us N                    busy-poll budget for both ends (default: 0, never spin)
+//!
+//! The consumer is this same executable, started again with `--consumer`.
+
+extern crate messageipc;
+
+use std::io::{self, BufRead, BufReader};
+use std::process::{self, Command, Stdio};
+use std::time::{Duration, Instant};
+use std::{env, thread};
+
+use messageipc::{options, CaptureReader, Captured, IpcClient, Options};
+
+// Sleeping overshoots by tens of microseconds, so the last stretch before a message is due is
+// spent yielding instead
+const SPIN: Duration = Duration::from_micros(200);
+
+fn options(transport: u32, io_mode: u32, spin_us: u32) -> Options {
+    Options {
+        transport: transport,
+        io_mode: io_mode,
+        spin_us: spin_us,
+        ..Options::default()
+    }
+}
+
+fn seconds(duration: Duration) -> f64 {
+    duration.as_secs() as f64 + duration.subsec_nanos() as f64 / 1e9
+}
+
+fn micros(duration: Duration) -> f64 {
+    duration.as_secs() as f64 * 1e6 + duration.subsec_nanos() as f64 / 1e3
+}
+
+fn percentile(sorted: &[f64], p: f64) -> f64 {
+    sorted[((sorted.len() - 1) as f64 * p) as usize]
+}
+
+fn open_client(name: &str, pid: u32, options: &Options) -> IpcClient {
+    // The server may not have created its end yet
+    let deadline = Instant::now() + Duration::from_secs(10);
+    loop {
+        match IpcClient::open_client(name, pid, options) {
+            Ok(client) => return client,
+            Err(ref e) if Instant::now() < deadline && match e.kind() {
+                io::ErrorKind::NotFound | io::ErrorKind::ConnectionRefused | io::ErrorKind::InvalidData => true,
+                _ => false,
+            } => thread::sleep(Duration::from_millis(1)),
+            Err(e) => panic!("failed to open client: {}", e),
+        }
+    }
+}
+
+/// Receive until the connection closes, then report "messages bytes" on stdout
+fn run_consumer(mut args: env::Args) {
+    let name = args.next().unwrap();
+    let pid = args.next().unwrap().parse().unwrap();
+    let transport = args.next().unwrap().parse().unwrap();
+    let io_mode = args.next().unwrap().parse().unwrap();
+    let spin_us = args.next().unwrap().parse().unwrap();
+    let client = open_client(&name, pid, &options(transport, io_mode, spin_us));
+
+    let (mut messages, mut bytes) = (0u64, 0u64);
+    while let Some(message) = client.recv() {
+        messages += 1;
+        bytes += message.len() as u64;
+    }
+    println!("{} {}", messages, bytes);
+}
+
+fn wait_until(due: Instant) {
+    loop {
+        let now = Instant::now();
+        if now >= due {
+            return;
+        }
+        if due - now > SPIN {
+            thread::sleep(due - now - SPIN);
+        } else {
+            thread::yield_now();
+        }
+    }
+}
+
+fn load(path: &str, received: bool) -> Vec<Captured> {
+    let reader = CaptureReader::open(path).unwrap_or_else(|e| panic!("can't open {}: {}", path, e));
+    let mut messages = Vec::new();
+    for captured in reader {
+        match captured {
+            Ok(captured) => if captured.received == received {
+                messages.push(captured);
+            },
+            // Most likely the capturing process was killed; replay what was written
+            Err(e) => {
+                println!("capture ends early: {}", e);
+                break;
+            }
+        }
+    }
+    messages
+}
+
+fn main() {
+    let mut args = env::args();
+    args.next();
+    let mut path = None;
+    let mut fast = false;
+    let mut received = false;
+    let mut transport = ("pipe", options::TRANSPORT_PIPE);
+    let mut io_mode = options::IO_THREADS;
+    let mut spin_us = 0;
+    while let Some(arg) = args.next() {
+        match &arg[..] {
+            "--consumer" => return run_consumer(args),
+            "--bench" => {}
+            "--fast" => fast = true,
+            "--received" => received = true,
+            "--transport" => {
+                transport = match &args.next().expect("--transport needs a name")[..] {
+                    "pipe" => ("pipe", options::TRANSPORT_PIPE),
+                    "shm" => ("shm", options::TRANSPORT_SHM),
+                    "socket" => ("socket", options::TRANSPORT_SOCKET),
+                    name => panic!("unknown transport {}", name),
+                };
+            }
+            "--reactor" => io_mode = options::IO_REACTOR,
+            "--spin-us" => spin_us = args.next().and_then(|arg| arg.parse().ok()).expect("--spin-us needs a number"),
+            _ if !arg.starts_with("--") && path.is_none() => path = Some(arg),
+            _ => panic!("unknown argument {}", arg),
+        }
+    }
+    let path = path.expect("usage: replay CAPTURE [--fast] [--received] [--transport NAME] [--reactor] [--spin-us N]");
+
+    let messages = load(&path, received);
+    let total_bytes: u64 = messages.iter().map(|captured| captured.message.len() as u64).sum();
+    let recorded = match (messages.first(), messages.last()) {
+        (Some(first), Some(last)) => last.time - first.time,
+        _ => Duration::from_secs(0),
+    };
+    println!("{} {} messages, {} bytes, over {:.3}s as recorded",
+             messages.len(), if received { "received" } else { "sent" }, total_bytes, seconds(recorded));
+
+    let name = format!("bench_replay_{}", process::id());
+    let pid = process::id();
+    let options = options(transport.1, io_mode, spin_us);
+    let mut child = Command::new(env::current_exe().unwrap())
+        .args(&["--consumer", &name, &pid.to_string(), &transport.1.to_string(), &io_mode.to_string(),
+                &spin_us.to_string()])
+        .stdout(Stdio::piped())
+        .spawn()
+        .unwrap();
+    let client = IpcClient::open_server(&name, &options).unwrap();
+
+    let mut lateness = Vec::with_capacity(messages.len());
+    let offset = messages.first().map_or(Duration::from_secs(0), |first| first.time);
+    let start = Instant::now();
+    for captured in &messages {
+        if !fast {
+            let due = start + (captured.time - offset);
+            wait_until(due);
+            lateness.push(micros(Instant::now() - due));
+        }
+        if captured.urgent {
+            client.send_urgent(&captured.message).unwrap();
+        } else {
+            client.send_timeout(&captured.message, None).unwrap();
+        }
+    }
+    let sent = start.elapsed();
+    // Closing flushes what is still queued, then the consumer sees the end
+    drop(client);
+
+    let mut line = String::new();
+    BufReader::new(child.stdout.take().unwrap()).read_line(&mut line).unwrap();
+    let drained = start.elapsed();
+    assert!(child.wait().unwrap().success(), "consumer failed");
+    let counts: Vec<u64> = line.split_whitespace().map(|count| count.parse().unwrap()).collect();
+    assert_eq!(counts, [messages.len() as u64, total_bytes], "consumer got something else");
+
+    println!("replayed over {}{} {}: sent in {:.3}s, consumer done after {:.3}s, {:.1} MiB/s, {:.0} msg/s",
+             transport.0, if io_mode == options::IO_REACTOR { " (reactor)" } else { "" },
+             if fast { "as fast as possible" } else { "at the recorded pace" },
+             seconds(sent), seconds(drained), total_bytes as f64 / seconds(drained) / (1 << 20) as f64,
+             messages.len() as f64 / seconds(drained));
+    if !lateness.is_empty() {
+        lateness.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        println!("sent behind the recording by: p50 {:.1}us, p99 {:.1}us, p99.9 {:.1}us, max {:.1}us",
+                 percentile(&lateness, 0.5), percentile(&lateness, 0.99), percentile(&lateness, 0.999),
+                 lateness[lateness.len() - 1]);
+    }
+}
@@ -0,0 +1,427 @@
+//! One-to-many broadcast over shared memory. Linux only.
+//!
+//! A publisher owns a segment in /dev/shm holding a single byte ring that any number of
+//! subscribers map. Each message is copied into the ring once however many subscribers there
+//! are, and each subscriber keeps its own read cursor in its own process, so publishing costs
+//! the same with one subscriber as with sixteen.
+//!
+//! The publisher never waits for anybody. A subscriber that falls a whole ring behind finds
+//! the messages it hadn't read yet overwritten; it is told how many it lost and carries on
+//! from the oldest message still in the ring.
+//!
+//! A record is a 16 byte header (the length, then the message's sequence number) followed by
+//! the message, padded to 8 bytes. Before copying a record in, the publisher moves `reserve`
+//! past its end, so a subscriber that copied a record out can tell afterwards whether the
+//! publisher might have been overwriting it at the time.
+
+use std::sync::atomic::{self, AtomicU32, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::fs::{self, OpenOptions};
+use std::io;
+use std::os::unix::fs::OpenOptionsExt;
+use std::time::{Duration, Instant};
+use std::{cmp, mem, ptr, thread};
+
+use libc;
+
+use options::Options;
+use pool::{Buffer, Pool};
+use queue::{RecvError, SendError};
+use shm::{self, Mapping};
+
+const MAGIC: u32 = 0x5343424d; // "MBCS"
+const RECORD_HEADER: usize = 16;
+
+// Written by the publisher alone: the fixed fields once, the cursors once per message
+#[repr(C)]
+struct Segment {
+    magic: AtomicU32,
+    capacity: AtomicU32,
+    publisher_pid: AtomicU32,
+    closed: AtomicU32,
+    _pad0: [u8; 48],
+    // Odd while the publisher is changing the cursors below, which are only consistent with
+    // each other when read between two equal even versions
+    version: AtomicU64,
+    // End of the newest whole record, and the sequence number the next one will get
+    head: AtomicU64,
+    next_seq: AtomicU64,
+    // Start of the oldest record that hasn't been overwritten, and its sequence number
+    tail: AtomicU64,
+    tail_seq: AtomicU64,
+    // End of the record being copied in
+    reserve: AtomicU64,
+    _pad1: [u8; 16],
+    // Subscribers park on data_seq, and count themselves in waiters while they do
+    data_seq: AtomicU32,
+    waiters: AtomicU32,
+    _pad2: [u8; 56],
+}
+
+fn segment_path(name: &str, pid: u32) -> String {
+    format!("/dev/shm/messageipc_broadcast_{}_{}", name, pid)
+}
+
+fn record_size(len: usize) -> usize {
+    (RECORD_HEADER + len + 7) & !7
+}
+
+#[derive(Copy, Clone)]
+struct Cursors {
+    head: u64,
+    next_seq: u64,
+    tail: u64,
+    tail_seq: u64,
+}
+
+struct Ring {
+    map: Mapping,
+    data: *mut u8,
+    mask: usize,
+}
+
+unsafe impl Send for Ring {}
+unsafe impl Sync for Ring {}
+
+impl Ring {
+    fn new(map: Mapping, capacity: usize) -> Ring {
+        let data = unsafe { map.as_ptr().offset(mem::size_of::<Segment>() as isize) };
+        Ring { map: map, data: data, mask: capacity - 1 }
+    }
+
+    fn segment(&self) -> &Segment {
+        unsafe { &*(self.map.as_ptr() as *const Segment) }
+    }
+
+    fn capacity(&self) -> usize {
+        self.mask + 1
+    }
+
+    fn copy_in(&self, pos: u64, src: &[u8]) {
+        let off = pos as usize & self.mask;
+        let first = cmp::min(src.len(), self.mask + 1 - off);
+        unsafe {
+            ptr::copy_nonoverlapping(src.as_ptr(), self.data.offset(off as isize), first);
+            ptr::copy_nonoverlapping(src.as_ptr().offset(first as isize), self.data, src.len() - first);
+        }
+    }
+
+    fn copy_out(&self, pos: u64, dst: &mut [u8]) {
+        let off = pos as usize & self.mask;
+        let first = cmp::min(dst.len(), self.mask + 1 - off);
+        unsafe {
+            ptr::copy_nonoverlapping(self.data.offset(off as isize), dst.as_mut_ptr(), first);
+            ptr::copy_nonoverlapping(self.data, dst.as_mut_ptr().offset(first as isize), dst.len() - first);
+        }
+    }
+
+    fn read_header(&self, pos: u64) -> (usize, u64) {
+        let mut header = [0; RECORD_HEADER];
+        self.copy_out(pos, &mut header);
+        let mut len = [0; 4];
+        let mut seq = [0; 8];
+        len.copy_from_slice(&header[..4]);
+        seq.copy_from_slice(&header[8..]);
+        (u32::from_le_bytes(len) as usize, u64::from_le_bytes(seq))
+    }
+
+    /// Whether what was just copied out from `pos` on is still what the publisher put there
+    fn intact(&self, pos: u64) -> bool {
+        atomic::fence(Ordering::Acquire);
+        self.segment().reserve.load(Ordering::Relaxed) <= pos + self.capacity() as u64
+    }
+
+    fn cursors(&self) -> Cursors {
+        let seg = self.segment();
+        loop {
+            let version = seg.version.load(Ordering::Acquire);
+            if version & 1 != 0 {
+                thread::yield_now();
+                continue;
+            }
+            let cursors = Cursors {
+                head: seg.head.load(Ordering::Relaxed),
+                next_seq: seg.next_seq.load(Ordering::Relaxed),
+                tail: seg.tail.load(Ordering::Relaxed),
+                tail_seq: seg.tail_seq.load(Ordering::Relaxed),
+            };
+            atomic::fence(Ordering::Acquire);
+            if seg.version.load(Ordering::Relaxed) == version {
+                return cursors;
+            }
+        }
+    }
+}
+
+struct WriteState {
+    version: u64,
+    cursors: Cursors,
+}
+
+/// The sending end of a broadcast channel
+pub struct Publisher {
+    ring: Ring,
+    path: String,
+    state: Mutex<WriteState>,
+}
+
+impl Publisher {
+    /// Create the channel `name`, which subscribers find by it and this process's pid. The
+    /// ring is `options.ring_size` bytes; nothing else in `options` applies.
+    pub fn open(name: &str, options: &Options) -> io::Result<Publisher> {
+        let capacity = shm::ring_capacity(options.ring_size);
+        let len = mem::size_of::<Segment>() + capacity;
+        let pid = unsafe { libc::getpid() as u32 };
+        let path = segment_path(name, pid);
+
+        fs::remove_file(&path).ok();
+        let file = try!(OpenOptions::new().read(true).write(true).create_new(true).mode(0o660).open(&path));
+        try!(file.set_len(len as u64));
+        let ring = Ring::new(try!(Mapping::new(&file, len)), capacity);
+        {
+            let seg = ring.segment();
+            seg.capacity.store(capacity as u32, Ordering::Relaxed);
+            seg.publisher_pid.store(pid, Ordering::Relaxed);
+            seg.magic.store(MAGIC, Ordering::Release);
+        }
+
+        // Unlike a connection's segment the name stays, so subscribers can join at any time
+        Ok(Publisher {
+            ring: ring,
+            path: path,
+            state: Mutex::new(WriteState {
+                version: 0,
+                cursors: Cursors { head: 0, next_seq: 0, tail: 0, tail_seq: 0 },
+            }),
+        })
+    }
+
+    /// The longest message the ring can hold
+    pub fn max_message(&self) -> usize {
+        self.ring.capacity() - RECORD_HEADER
+    }
+
+    /// Copy `message` into the ring, overwriting the oldest messages to make room for it if
+    /// need be. Never waits.
+    pub fn publish(&self, message: &[u8]) -> Result<(), SendError> {
+        self.publish_vectored(&[message])
+    }
+
+    /// Publish the parts as one message, one after another
+    pub fn publish_vectored(&self, parts: &[&[u8]]) -> Result<(), SendError> {
+        let len: usize = parts.iter().map(|part| part.len()).sum();
+        if len > self.max_message() {
+            return Err(SendError::TooLarge);
+        }
+
+        let ring = &self.ring;
+        let seg = ring.segment();
+        let capacity = ring.capacity() as u64;
+        let mut state = self.state.lock().unwrap();
+        let mut cursors = state.cursors;
+        let start = cursors.head;
+        let reserve = start + record_size(len) as u64;
+
+        // Give up the oldest records until the new one fits behind them
+        while cursors.tail + capacity < reserve {
+            let (old_len, _) = ring.read_header(cursors.tail);
+            cursors.tail += record_size(old_len) as u64;
+            cursors.tail_seq += 1;
+        }
+
+        state.version += 1;
+        seg.version.store(state.version, Ordering::Relaxed);
+        atomic::fence(Ordering::Release);
+        seg.tail.store(cursors.tail, Ordering::Relaxed);
+        seg.tail_seq.store(cursors.tail_seq, Ordering::Relaxed);
+        seg.reserve.store(reserve, Ordering::Relaxed);
+        state.version += 1;
+        seg.version.store(state.version, Ordering::Release);
+        // Nobody may see the new record's bytes before seeing the reserve that covers them
+        atomic::fence(Ordering::Release);
+
+        let mut header = [0; RECORD_HEADER];
+        header[..4].copy_from_slice(&(len as u32).to_le_bytes());
+        header[8..].copy_from_slice(&cursors.next_seq.to_le_bytes());
+        ring.copy_in(start, &header);
+        let mut pos = start + RECORD_HEADER as u64;
+        for part in parts {
+            ring.copy_in(pos, part);
+            pos += part.len() as u64;
+        }
+
+        cursors.head = reserve;
+        cursors.next_seq += 1;
+        state.version += 1;
+        seg.version.store(state.version, Ordering::Relaxed);
+        atomic::fence(Ordering::Release);
+        seg.head.store(cursors.head, Ordering::Relaxed);
+        seg.next_seq.store(cursors.next_seq, Ordering::Relaxed);
+        state.version += 1;
+        seg.version.store(state.version, Ordering::SeqCst);
+        state.cursors = cursors;
+
+        if seg.waiters.load(Ordering::SeqCst) != 0 {
+            seg.data_seq.fetch_add(1, Ordering::SeqCst);
+            shm::futex_wake(&seg.data_seq);
+        }
+        Ok(())
+    }
+}
+
+impl Drop for Publisher {
+    fn drop(&mut self) {
+        let seg = self.ring.segment();
+        seg.closed.store(1, Ordering::SeqCst);
+        seg.data_seq.fetch_add(1, Ordering::SeqCst);
+        shm::futex_wake(&seg.data_seq);
+        fs::remove_file(&self.path).ok();
+    }
+}
+
+struct ReadState {
+    pos: u64,
+    next_seq: u64,
+    lost: u64,
+    publisher_gone: bool,
+}
+
+/// The receiving end of a broadcast channel. Each one sees every message published after it
+/// was opened, unless it falls too far behind.
+pub struct Subscriber {
+    ring: Ring,
+    pool: Arc<Pool>,
+    publisher_pid: u32,
+    state: Mutex<ReadState>,
+}
+
+impl Subscriber {
+    /// Join the channel `name` published by process `pid`
+    pub fn open(name: &str, pid: u32) -> io::Result<Subscriber> {
+        let path = segment_path(name, pid);
+        let file = try!(OpenOptions::new().read(true).write(true).open(&path));
+
+        // The publisher creates the file before it sizes and initializes it, so give it a moment
+        let header = mem::size_of::<Segment>();
+        let mut len = 0;
+        for _ in 0..1000 {
+            len = try!(file.metadata()).len() as usize;
+            if len > header {
+                break;
+            }
+            thread::sleep(Duration::from_millis(1));
+        }
+        if len <= header {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "broadcast segment was never initialized"));
+        }
+
+        let map = try!(Mapping::new(&file, len));
+        let (capacity, publisher_pid) = {
+            let seg = unsafe { &*(map.as_ptr() as *const Segment) };
+            for _ in 0..1000 {
+                if seg.magic.load(Ordering::Acquire) == MAGIC {
+                    break;
+                }
+                thread::sleep(Duration::from_millis(1));
+            }
+            if seg.magic.load(Ordering::Acquire) != MAGIC {
+                return Err(io::Error::new(io::ErrorKind::InvalidData, "broadcast segment was never initialized"));
+            }
+
+            let capacity = seg.capacity.load(Ordering::Relaxed) as usize;
+            if !capacity.is_power_of_two() || header + capacity != len {
+                return Err(io::Error::new(io::ErrorKind::InvalidData, "broadcast segment has a bad size"));
+            }
+            (capacity, seg.publisher_pid.load(Ordering::Relaxed))
+        };
+
+        let ring = Ring::new(map, capacity);
+        let cursors = ring.cursors();
+        Ok(Subscriber {
+            ring: ring,
+            pool: Pool::new(),
+            publisher_pid: publisher_pid,
+            state: Mutex::new(ReadState {
+                pos: cursors.head,
+                next_seq: cursors.next_seq,
+                lost: 0,
+                publisher_gone: false,
+            }),
+        })
+    }
+
+    /// How many messages were overwritten before this subscriber got to them, in all
+    pub fn lost(&self) -> u64 {
+        self.state.lock().unwrap().lost
+    }
+
+    /// Wait up to `timeout` (forever if None) for the next message. Fails with Lagged once
+    /// for each time the subscriber fell behind and lost messages, after which it carries on
+    /// from the oldest one left, and with Disconnected once the publisher is gone and
+    /// everything it published has been received.
+    pub fn recv(&self, timeout: Option<Duration>) -> Result<Buffer, RecvError> {
+        let deadline = timeout.map(|timeout| Instant::now() + timeout);
+        let mut state = self.state.lock().unwrap();
+        loop {
+            let seg = self.ring.segment();
+            if seg.head.load(Ordering::Acquire) != state.pos {
+                return self.read(&mut state);
+            }
+
+            if state.publisher_gone || seg.closed.load(Ordering::Acquire) != 0 {
+                // Anything published before the close still gets delivered
+                if seg.head.load(Ordering::Acquire) == state.pos {
+                    return Err(RecvError::Disconnected);
+                }
+                continue;
+            }
+
+            let mut wait_ms = shm::PEER_CHECK_MS;
+            if let Some(deadline) = deadline {
+                let now = Instant::now();
+                if now >= deadline {
+                    return Err(RecvError::Empty);
+                }
+                let left = deadline - now;
+                let left_ms = left.as_secs() * 1000 + (left.subsec_nanos() as u64 + 999_999) / 1_000_000;
+                wait_ms = cmp::min(wait_ms, left_ms);
+            }
+
+            let seq = seg.data_seq.load(Ordering::SeqCst);
+            seg.waiters.fetch_add(1, Ordering::SeqCst);
+            if seg.head.load(Ordering::SeqCst) == state.pos && seg.closed.load(Ordering::SeqCst) == 0 {
+                if shm::futex_wait(&seg.data_seq, seq, Some(wait_ms)) && !shm::process_alive(self.publisher_pid) {
+                    state.publisher_gone = true;
+                }
+            }
+            seg.waiters.fetch_sub(1, Ordering::SeqCst);
+        }
+    }
+
+    // Copy out the record at the cursor, which the publisher has finished
+    fn read(&self, state: &mut ReadState) -> Result<Buffer, RecvError> {
+        let ring = &self.ring;
+        loop {
+            let (len, seq) = ring.read_header(state.pos);
+            if ring.intact(state.pos) && seq == state.next_seq && len <= ring.capacity() - RECORD_HEADER {
+                let mut buffer = Pool::get(&self.pool, len);
+                ring.copy_out(state.pos + RECORD_HEADER as u64, &mut buffer);
+                if ring.intact(state.pos) {
+                    state.pos += record_size(len) as u64;
+                    state.next_seq += 1;
+                    return Ok(buffer);
+                }
+            }
+
+            // Overwritten before we got to it; skip to the oldest record that is still there
+            let cursors = ring.cursors();
+            if cursors.tail_seq > state.next_seq {
+                let lost = cursors.tail_seq - state.next_seq;
+                state.pos = cursors.tail;
+                state.next_seq = cursors.tail_seq;
+                state.lost += lost;
+                return Err(RecvError::Lagged(lost));
+            }
+        }
+    }
+}
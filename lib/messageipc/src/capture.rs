@@ -0,0 +1,265 @@
+//! Recording a connection's traffic to a file, to be replayed later.
+//!
+//! A capture starts with the magic "MIPCCAP" and a version byte, then the wall-clock
+//! time it started as nanoseconds since the Unix epoch (u64, little endian). Every message
+//! after that is a record:
+//!
+//! - a flags byte: RECEIVED if the message came from the peer rather than going to it, and
+//!   URGENT if it went on the urgent lane
+//! - nanoseconds since the record before it, or since the capture started, as a LEB128 varint
+//! - the message's length as a varint, then the message itself
+//!
+//! Messages are recorded as the application sees them, before compression and after
+//! reassembly, at the moment the connection's I/O takes or delivers them. Stream chunks,
+//! calls and outgoing shared buffers are not recorded. Incoming shared buffers are, since
+//! they arrive as ordinary messages.
+
+use std::fs::File;
+use std::io::{self, BufReader, BufWriter, Read, Write};
+use std::mem;
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Mutex;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use frame::MAX_MESSAGE;
+
+const MAGIC: &'static [u8; 7] = b"MIPCCAP";
+const VERSION: u8 = 1;
+
+pub const SENT: u8 = 0;
+pub const RECEIVED: u8 = 1;
+pub const URGENT: u8 = 2;
+
+fn nanos(duration: Duration) -> u64 {
+    duration.as_secs().saturating_mul(1000000000).saturating_add(duration.subsec_nanos() as u64)
+}
+
+fn write_varint<W: Write>(out: &mut W, mut value: u64) -> io::Result<()> {
+    let mut bytes = [0; 10];
+    let mut len = 0;
+    loop {
+        let byte = (value & 0x7f) as u8;
+        value >>= 7;
+        if value == 0 {
+            bytes[len] = byte;
+            len += 1;
+            break;
+        }
+        bytes[len] = byte | 0x80;
+        len += 1;
+    }
+    out.write_all(&bytes[..len])
+}
+
+fn invalid_data(message: &'static str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message)
+}
+
+struct Recorder {
+    out: BufWriter<File>,
+    start: Instant,
+    last_ns: u64,
+    // The first write that failed. Nothing more is written after one does.
+    error: Option<io::Error>,
+}
+
+impl Recorder {
+    fn write(&mut self, flags: u8, message: &[u8]) -> io::Result<()> {
+        let now = nanos(self.start.elapsed());
+        try!(self.out.write_all(&[flags]));
+        try!(write_varint(&mut self.out, now - self.last_ns));
+        try!(write_varint(&mut self.out, message.len() as u64));
+        try!(self.out.write_all(message));
+        self.last_ns = now;
+        Ok(())
+    }
+
+    fn finish(mut self) -> io::Result<()> {
+        match self.error.take() {
+            Some(e) => Err(e),
+            None => self.out.flush(),
+        }
+    }
+}
+
+/// A connection's capture, if one is running. Both of its I/O sides record into it, so
+/// records are written under a lock; when no capture is running that costs one flag check.
+pub struct Capture {
+    active: AtomicBool,
+    recorder: Mutex<Option<Recorder>>,
+}
+
+impl Capture {
+    pub fn new() -> Capture {
+        Capture {
+            active: AtomicBool::new(false),
+            recorder: Mutex::new(None),
+        }
+    }
+
+    /// Start recording to a new file at `path`, ending any capture already running
+    pub fn start(&self, path: &Path) -> io::Result<()> {
+        let mut out = BufWriter::new(try!(File::create(path)));
+        let started = SystemTime::now().duration_since(UNIX_EPOCH).unwrap_or(Duration::from_secs(0));
+        try!(out.write_all(MAGIC));
+        try!(out.write_all(&[VERSION]));
+        try!(out.write_all(&nanos(started).to_le_bytes()));
+
+        let recorder = Recorder {
+            out: out,
+            start: Instant::now(),
+            last_ns: 0,
+            error: None,
+        };
+        let old = mem::replace(&mut *self.recorder.lock().unwrap(), Some(recorder));
+        self.active.store(true, Ordering::Relaxed);
+        match old {
+            Some(old) => old.finish(),
+            None => Ok(()),
+        }
+    }
+
+    /// Stop recording and flush the file. Returns the first error writing it, if any.
+    pub fn stop(&self) -> io::Result<()> {
+        let recorder = self.recorder.lock().unwrap().take();
+        self.active.store(false, Ordering::Relaxed);
+        match recorder {
+            Some(recorder) => recorder.finish(),
+            None => Ok(()),
+        }
+    }
+
+    pub fn record(&self, flags: u8, message: &[u8]) {
+        if !self.active.load(Ordering::Relaxed) {
+            return;
+        }
+        let mut recorder = self.recorder.lock().unwrap();
+        if let Some(ref mut recorder) = *recorder {
+            if recorder.error.is_none() {
+                if let Err(e) = recorder.write(flags, message) {
+                    recorder.error = Some(e);
+                    self.active.store(false, Ordering::Relaxed);
+                }
+            }
+        }
+    }
+
+    pub fn is_active(&self) -> bool {
+        self.active.load(Ordering::Relaxed)
+    }
+}
+
+/// One message from a capture
+#[derive(Clone, Debug)]
+pub struct Captured {
+    /// When it was recorded, since the capture started
+    pub time: Duration,
+    /// Whether the capturing end received it rather than sent it
+    pub received: bool,
+    pub urgent: bool,
+    pub message: Vec<u8>,
+}
+
+/// Reads back the messages `IpcClient::start_capture` recorded, in order
+pub struct CaptureReader<R> {
+    input: R,
+    started: SystemTime,
+    time_ns: u64,
+}
+
+impl CaptureReader<BufReader<File>> {
+    pub fn open<P: AsRef<Path>>(path: P) -> io::Result<CaptureReader<BufReader<File>>> {
+        CaptureReader::new(BufReader::new(try!(File::open(path))))
+    }
+}
+
+impl<R: Read> CaptureReader<R> {
+    pub fn new(mut input: R) -> io::Result<CaptureReader<R>> {
+        let mut header = [0; 16];
+        try!(input.read_exact(&mut header));
+        if &header[..7] != MAGIC {
+            return Err(invalid_data("not a messageipc capture"));
+        }
+        if header[7] != VERSION {
+            return Err(invalid_data("unsupported capture version"));
+        }
+        let mut started = [0; 8];
+        started.copy_from_slice(&header[8..]);
+        Ok(CaptureReader {
+            input: input,
+            started: UNIX_EPOCH + Duration::from_nanos(u64::from_le_bytes(started)),
+            time_ns: 0,
+        })
+    }
+
+    /// The wall-clock time the capture started
+    pub fn started(&self) -> SystemTime {
+        self.started
+    }
+
+    fn read_byte(&mut self) -> io::Result<Option<u8>> {
+        let mut byte = [0];
+        loop {
+            return match self.input.read(&mut byte) {
+                Ok(0) => Ok(None),
+                Ok(_) => Ok(Some(byte[0])),
+                Err(ref e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => Err(e),
+            };
+        }
+    }
+
+    fn read_varint(&mut self) -> io::Result<u64> {
+        let mut value = 0u64;
+        for shift in 0..10 {
+            let byte = match try!(self.read_byte()) {
+                Some(byte) => byte,
+                None => return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "truncated capture")),
+            };
+            value |= ((byte & 0x7f) as u64) << (shift * 7);
+            if byte & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+        Err(invalid_data("corrupt capture"))
+    }
+
+    /// The next message, or None at the end of the capture. A capture cut short, e.g. by its
+    /// process being killed, ends in an UnexpectedEof error.
+    pub fn next_message(&mut self) -> io::Result<Option<Captured>> {
+        let flags = match try!(self.read_byte()) {
+            Some(flags) => flags,
+            None => return Ok(None),
+        };
+        let delta = try!(self.read_varint());
+        let len = try!(self.read_varint());
+        if len > MAX_MESSAGE as u64 {
+            return Err(invalid_data("corrupt capture"));
+        }
+        let mut message = vec![0; len as usize];
+        try!(self.input.read_exact(&mut message).map_err(|e| match e.kind() {
+            io::ErrorKind::UnexpectedEof => io::Error::new(io::ErrorKind::UnexpectedEof, "truncated capture"),
+            _ => e,
+        }));
+        self.time_ns = self.time_ns.saturating_add(delta);
+        Ok(Some(Captured {
+            time: Duration::from_nanos(self.time_ns),
+            received: flags & RECEIVED != 0,
+            urgent: flags & URGENT != 0,
+            message: message,
+        }))
+    }
+}
+
+impl<R: Read> Iterator for CaptureReader<R> {
+    type Item = io::Result<Captured>;
+
+    fn next(&mut self) -> Option<io::Result<Captured>> {
+        match self.next_message() {
+            Ok(Some(captured)) => Some(Ok(captured)),
+            Ok(None) => None,
+            Err(e) => Some(Err(e)),
+        }
+    }
+}
@@ -0,0 +1,94 @@
+//! Handing received messages straight to a callback on the reader's thread instead of queueing
+//! them for `recv`, which saves the queue hop and waking whoever is blocked in `recv`.
+
+use std::mem;
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+use pool::Buffer;
+use queue::Queue;
+
+/// Called with each message as it arrives, then once with None when the connection is gone.
+/// The message is only borrowed; its buffer goes back to the pool when the call returns.
+pub type ReceiveHandler = Box<dyn FnMut(Option<&[u8]>) + Send>;
+
+struct Slot {
+    handler: Option<ReceiveHandler>,
+    finished: bool,
+}
+
+/// Where a connection's messages go: to its receive queue, or to a handler if one is set.
+/// The lock is held while the handler runs, so a handler never overlaps the one replacing it.
+pub struct Dispatch {
+    slot: Mutex<Slot>,
+}
+
+impl Dispatch {
+    pub fn new() -> Arc<Dispatch> {
+        Arc::new(Dispatch {
+            slot: Mutex::new(Slot {
+                handler: None,
+                finished: false,
+            }),
+        })
+    }
+
+    /// Install a handler, or go back to queueing with None. Messages already in `queue` go to
+    /// the new handler first so the order is kept, and if the connection is already gone it
+    /// is told so straight away.
+    pub fn set(&self, handler: Option<ReceiveHandler>, queue: &Queue<Buffer>) {
+        let old = {
+            let mut slot = self.slot.lock().unwrap();
+            let old = mem::replace(&mut slot.handler, handler);
+            if let Some(ref mut handler) = slot.handler {
+                while let Some(count) = queue.pop_many(usize::max_value(), Some(Duration::from_secs(0)),
+                                                       |message| handler(Some(&message))) {
+                    if count == 0 {
+                        break;
+                    }
+                }
+            }
+            if slot.finished {
+                if let Some(mut handler) = slot.handler.take() {
+                    handler(None);
+                }
+            }
+            old
+        };
+        // Dropped without the lock, since dropping a handler may call out to the application
+        drop(old);
+    }
+
+    /// Hand the urgent and then the other messages to the handler, or push them to `queue` if
+    /// there isn't one. Returns false once the queue is closed.
+    pub fn deliver(&self, urgent: &mut Vec<Buffer>, messages: &mut Vec<Buffer>, queue: &Queue<Buffer>) -> bool {
+        let mut slot = self.slot.lock().unwrap();
+        match slot.handler {
+            Some(ref mut handler) => {
+                for message in urgent.drain(..).chain(messages.drain(..)) {
+                    handler(Some(&message));
+                }
+                !queue.is_finished()
+            }
+            None => {
+                (urgent.is_empty() || queue.push_urgent_all(urgent.drain(..)))
+                    && (messages.is_empty() || queue.push_all(messages.drain(..)))
+            }
+        }
+    }
+
+    /// The connection is gone. The handler is told so, once, and then let go.
+    pub fn finish(&self) {
+        let handler = {
+            let mut slot = self.slot.lock().unwrap();
+            if slot.finished {
+                return;
+            }
+            slot.finished = true;
+            slot.handler.take()
+        };
+        if let Some(mut handler) = handler {
+            handler(None);
+        }
+    }
+}
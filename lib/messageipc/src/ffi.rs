@@ -1,20 +1,146 @@
 use std::ffi::CStr;
-use std::{ptr, slice, mem};
+use std::{cmp, mem, ptr, slice};
+use std::time::Duration;
 use libc;
-use IpcClient;
+use {Call, IpcClient, Options, Buffer, ReceiveHandler, RecvError, SendError, Stats, StreamWriter};
+#[cfg(unix)]
+use IpcServer;
+#[cfg(target_os = "linux")]
+use {Publisher, SharedBuffer, Subscriber};
+
+/// Multi-client servers only exist on unix; elsewhere the server functions fail
+#[cfg(not(unix))]
+pub enum IpcServer {}
+
+/// Shared buffers need memfds, which only Linux has; elsewhere they can't be allocated
+#[cfg(not(target_os = "linux"))]
+pub enum SharedBuffer {}
+
+/// Broadcast channels live in /dev/shm, so they are Linux only too
+#[cfg(not(target_os = "linux"))]
+pub enum Publisher {}
+#[cfg(not(target_os = "linux"))]
+pub enum Subscriber {}
 
 const MIPC_SUCCESS: libc::c_int = 0;
 const MIPC_EMPTY: libc::c_int = 1;
 const MIPC_DISCONNECTED: libc::c_int = 2; 
+const MIPC_WOULDBLOCK: libc::c_int = 3;
+const MIPC_TOO_SMALL: libc::c_int = 4;
+const MIPC_TOO_LARGE: libc::c_int = 5;
+const MIPC_END_OF_STREAM: libc::c_int = 6;
+const MIPC_LAGGED: libc::c_int = 7;
+
+const MIPC_INFINITE: u64 = !0;
+
+/// Called once with a call's response, which the callee releases with `mipc_recv_free`, or
+/// with MIPC_DISCONNECTED and no data if the response will never come
+pub type CallCallback = extern "C" fn(user: *mut libc::c_void, status: libc::c_int, data: *mut u8, len: usize);
+
+/// Called with each message as it arrives, borrowed until the call returns. The last call has
+/// no data: MIPC_DISCONNECTED once the connection is gone, or MIPC_EMPTY when the callback
+/// was replaced or removed. Userdata can be freed then.
+pub type ReceiveCallback = extern "C" fn(user: *mut libc::c_void, status: libc::c_int, data: *const u8, len: usize);
+
+struct UserData(*mut libc::c_void);
+unsafe impl Send for UserData {}
+
+// Makes sure a receive callback gets its last call, however it is let go of
+struct ReceiveTarget {
+    callback: ReceiveCallback,
+    user: UserData,
+    ended: bool,
+}
+
+impl ReceiveTarget {
+    fn call(&mut self, message: Option<&[u8]>) {
+        match message {
+            Some(message) => (self.callback)(self.user.0, MIPC_SUCCESS, message.as_ptr(), message.len()),
+            None => {
+                self.ended = true;
+                (self.callback)(self.user.0, MIPC_DISCONNECTED, ptr::null(), 0);
+            }
+        }
+    }
+}
+
+impl Drop for ReceiveTarget {
+    fn drop(&mut self) {
+        if !self.ended {
+            (self.callback)(self.user.0, MIPC_EMPTY, ptr::null(), 0);
+        }
+    }
+}
+
+/// A received message handed over to C, released with `mipc_recv_free`
+#[repr(C)]
+pub struct RawMessage {
+    data: *mut u8,
+    len: usize,
+}
+
+/// Bytes borrowed from C, laid out like `Rust::Slice<const uint8_t>`. The data may be null
+/// when the length is 0.
+#[repr(C)]
+pub struct IpcSlice {
+    data: *const u8,
+    len: usize,
+}
+
+impl IpcSlice {
+    fn as_slice(&self) -> &[u8] {
+        if self.data.is_null() { &[] } else { unsafe { slice::from_raw_parts(self.data, self.len) } }
+    }
+}
+
+fn slices<'a>(slices: *const IpcSlice, count: usize) -> Vec<&'a [u8]> {
+    if slices.is_null() {
+        return Vec::new();
+    }
+    unsafe { slice::from_raw_parts(slices, count) }.iter().map(IpcSlice::as_slice).collect()
+}
+
+fn timeout_from_us(timeout_us: u64) -> Option<Duration> {
+    if timeout_us == MIPC_INFINITE {
+        None
+    } else {
+        Some(Duration::from_micros(timeout_us))
+    }
+}
+
+fn send_status(result: Result<(), SendError>) -> libc::c_int {
+    match result {
+        Ok(()) => MIPC_SUCCESS,
+        Err(SendError::WouldBlock) => MIPC_WOULDBLOCK,
+        Err(SendError::Disconnected) => MIPC_DISCONNECTED,
+        Err(SendError::TooLarge) => MIPC_TOO_LARGE,
+    }
+}
+
+// A caller built against an older messageipc.h passes a shorter struct. The fields it
+// doesn't know about keep their defaults.
+fn options_or_default(options: *const Options, size: usize) -> Options {
+    let mut result = Options::default();
+    if !options.is_null() {
+        let size = cmp::min(size, mem::size_of::<Options>());
+        unsafe { ptr::copy_nonoverlapping(options as *const u8, &mut result as *mut Options as *mut u8, size) };
+    }
+    result
+}
 
 #[no_mangle]
 pub extern "C" fn mipc_open_server(name: *const i8) -> *mut IpcClient {
+    mipc_open_server_ex(name, ptr::null(), 0)
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_open_server_ex(name: *const i8, options: *const Options, options_size: usize) -> *mut IpcClient {
     let name = match unsafe { CStr::from_ptr(name) }.to_str() {
         Ok(s) => s,
         Err(_) => return ptr::null_mut(),
     };
     
-    match IpcClient::open_server(name) {
+    match IpcClient::open_server(name, &options_or_default(options, options_size)) {
         Ok(server) => Box::into_raw(Box::new(server)),
         Err(_) => ptr::null_mut(),
     }
@@ -22,12 +148,18 @@ pub extern "C" fn mipc_open_server(name: *const i8) -> *mut IpcClient {
 
 #[no_mangle]
 pub extern "C" fn mipc_open_client(name: *const i8, pid: u32) -> *mut IpcClient {
+    mipc_open_client_ex(name, pid, ptr::null(), 0)
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_open_client_ex(name: *const i8, pid: u32, options: *const Options,
+                                      options_size: usize) -> *mut IpcClient {
     let name = match unsafe { CStr::from_ptr(name) }.to_str() {
         Ok(s) => s,
         Err(_) => return ptr::null_mut(),
     };
     
-    match IpcClient::open_client(name, pid) {
+    match IpcClient::open_client(name, pid, &options_or_default(options, options_size)) {
         Ok(client) => Box::into_raw(Box::new(client)),
         Err(_) => ptr::null_mut(),
     }
@@ -42,23 +174,69 @@ pub extern "C" fn mipc_close(client: *mut IpcClient) {
 pub extern "C" fn mipc_send(client: *mut IpcClient, data: *const u8, len: usize) -> libc::c_int {
     let client = unsafe { &*client };
     let buf = unsafe { slice::from_raw_parts(data, len) };
-    if client.send(Vec::from(buf)) {
-        MIPC_SUCCESS
-    } else {
-        MIPC_DISCONNECTED
+    send_status(client.send(buf))
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_send_timeout(client: *mut IpcClient, data: *const u8, len: usize, timeout_us: u64) -> libc::c_int {
+    let client = unsafe { &*client };
+    let buf = unsafe { slice::from_raw_parts(data, len) };
+    send_status(client.send_timeout(buf, timeout_from_us(timeout_us)))
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_sendv(client: *mut IpcClient, parts: *const IpcSlice, count: usize) -> libc::c_int {
+    let client = unsafe { &*client };
+    send_status(client.send_vectored(&slices(parts, count)))
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_send_batch(client: *mut IpcClient, messages: *const IpcSlice, count: usize) -> libc::c_int {
+    let client = unsafe { &*client };
+    send_status(client.send_batch(&slices(messages, count)))
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_send_urgent(client: *mut IpcClient, data: *const u8, len: usize) -> libc::c_int {
+    let client = unsafe { &*client };
+    let buf: &[u8] = if data.is_null() { &[] } else { unsafe { slice::from_raw_parts(data, len) } };
+    send_status(client.send_urgent(buf))
+}
+
+/// Returns the index of a client with a message waiting, or -1 if none had one in time
+#[no_mangle]
+pub extern "C" fn mipc_wait_any(clients: *const *mut IpcClient, count: usize, timeout_us: u64) -> libc::c_int {
+    if count == 0 {
+        return -1;
+    }
+    let clients: Vec<&IpcClient> = unsafe { slice::from_raw_parts(clients, count) }
+        .iter()
+        .map(|&client| unsafe { &*client })
+        .collect();
+    match IpcClient::wait_any(&clients, timeout_from_us(timeout_us)) {
+        Some(index) => index as libc::c_int,
+        None => -1,
     }
 }
 
+/// Pass a null callback to go back to queueing messages for mipc_recv
+#[no_mangle]
+pub extern "C" fn mipc_set_receive_callback(client: *mut IpcClient, callback: Option<ReceiveCallback>, user: *mut libc::c_void) {
+    let client = unsafe { &*client };
+    client.set_receive_handler(callback.map(|callback| {
+        let mut target = ReceiveTarget { callback: callback, user: UserData(user), ended: false };
+        Box::new(move |message: Option<&[u8]>| target.call(message)) as ReceiveHandler
+    }));
+}
+
 #[no_mangle]
 pub extern "C" fn mipc_recv(client: *mut IpcClient, data: *mut *mut u8, len: *mut usize) -> libc::c_int {
     let client = unsafe { &*client };
     match client.recv() {
-        Some(mut buf) => unsafe {
-            buf.shrink_to_fit();
-            assert!(buf.capacity() == buf.len());
-            *data = buf.as_mut_ptr();
-            *len = buf.len();
-            mem::forget(buf);
+        Some(buf) => unsafe {
+            let (ptr, size) = buf.into_raw();
+            *data = ptr;
+            *len = size;
             MIPC_SUCCESS
         },
         None => MIPC_DISCONNECTED,
@@ -69,12 +247,25 @@ pub extern "C" fn mipc_recv(client: *mut IpcClient, data: *mut *mut u8, len: *mu
 pub extern "C" fn mipc_try_recv(client: *mut IpcClient, data: *mut *mut u8, len: *mut usize) -> libc::c_int {
     let client = unsafe { &*client };
     match client.try_recv() {
-        Some(Some(mut buf)) => unsafe {
-            buf.shrink_to_fit();
-            assert!(buf.capacity() == buf.len());
-            *data = buf.as_mut_ptr();
-            *len = buf.len();
-            mem::forget(buf);
+        Some(Some(buf)) => unsafe {
+            let (ptr, size) = buf.into_raw();
+            *data = ptr;
+            *len = size;
+            MIPC_SUCCESS
+        },
+        Some(None) => MIPC_EMPTY,
+        None => MIPC_DISCONNECTED,
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_recv_timeout(client: *mut IpcClient, data: *mut *mut u8, len: *mut usize, timeout_us: u64) -> libc::c_int {
+    let client = unsafe { &*client };
+    match client.recv_timeout(timeout_from_us(timeout_us)) {
+        Some(Some(buf)) => unsafe {
+            let (ptr, size) = buf.into_raw();
+            *data = ptr;
+            *len = size;
             MIPC_SUCCESS
         },
         Some(None) => MIPC_EMPTY,
@@ -82,7 +273,482 @@ pub extern "C" fn mipc_try_recv(client: *mut IpcClient, data: *mut *mut u8, len:
     }
 }
 
+#[no_mangle]
+pub extern "C" fn mipc_recv_into(client: *mut IpcClient, buf: *mut u8, cap: usize, len: *mut usize) -> libc::c_int {
+    let client = unsafe { &*client };
+    // Passing no buffer at all is a way to ask for the size of the next message
+    let buf: &mut [u8] = if buf.is_null() { &mut [] } else { unsafe { slice::from_raw_parts_mut(buf, cap) } };
+    match client.recv_into(buf, None) {
+        Ok(size) => {
+            unsafe { *len = size };
+            MIPC_SUCCESS
+        }
+        Err(RecvError::TooSmall(size)) => {
+            unsafe { *len = size };
+            MIPC_TOO_SMALL
+        }
+        Err(RecvError::Empty) | Err(RecvError::Lagged(_)) => MIPC_EMPTY,
+        Err(RecvError::Disconnected) => MIPC_DISCONNECTED,
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_recv_many(client: *mut IpcClient, messages: *mut RawMessage, max: usize,
+                                 count: *mut usize, timeout_us: u64) -> libc::c_int {
+    let client = unsafe { &*client };
+    unsafe { *count = 0 };
+    if max == 0 {
+        return MIPC_EMPTY;
+    }
+
+    let messages = unsafe { slice::from_raw_parts_mut(messages, max) };
+    let mut received = 0;
+    let result = client.recv_many(max, timeout_from_us(timeout_us), |buf| {
+        let (data, len) = buf.into_raw();
+        messages[received] = RawMessage { data: data, len: len };
+        received += 1;
+    });
+
+    unsafe { *count = received };
+    match result {
+        Some(0) => MIPC_EMPTY,
+        Some(_) => MIPC_SUCCESS,
+        None => MIPC_DISCONNECTED,
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_stream_begin(client: *mut IpcClient) -> *mut StreamWriter {
+    let client = unsafe { &*client };
+    match client.begin_stream() {
+        Some(stream) => Box::into_raw(Box::new(stream)),
+        None => ptr::null_mut(),
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_stream_write_chunk(stream: *mut StreamWriter, data: *const u8, len: usize, timeout_us: u64) -> libc::c_int {
+    let stream = unsafe { &*stream };
+    let buf: &[u8] = if data.is_null() { &[] } else { unsafe { slice::from_raw_parts(data, len) } };
+    send_status(stream.write_chunk(buf, timeout_from_us(timeout_us)))
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_stream_end(stream: *mut StreamWriter) {
+    drop(unsafe { Box::from_raw(stream) });
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_stream_read_chunk(client: *mut IpcClient, data: *mut *mut u8, len: *mut usize, timeout_us: u64) -> libc::c_int {
+    let client = unsafe { &*client };
+    match client.read_chunk(timeout_from_us(timeout_us)) {
+        Ok(Some(buf)) => unsafe {
+            let (ptr, size) = buf.into_raw();
+            *data = ptr;
+            *len = size;
+            MIPC_SUCCESS
+        },
+        Ok(None) => MIPC_END_OF_STREAM,
+        Err(RecvError::Disconnected) => MIPC_DISCONNECTED,
+        Err(_) => MIPC_EMPTY,
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_call_begin(client: *mut IpcClient, data: *const u8, len: usize, timeout_us: u64,
+                                  call: *mut *mut Call) -> libc::c_int {
+    let client = unsafe { &*client };
+    let body: &[u8] = if data.is_null() { &[] } else { unsafe { slice::from_raw_parts(data, len) } };
+    unsafe { *call = ptr::null_mut() };
+    match client.call(body, timeout_from_us(timeout_us)) {
+        Ok(started) => {
+            unsafe { *call = Box::into_raw(Box::new(started)) };
+            MIPC_SUCCESS
+        }
+        Err(err) => send_status(Err(err)),
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_call_wait(call: *mut Call, data: *mut *mut u8, len: *mut usize, timeout_us: u64) -> libc::c_int {
+    let call = unsafe { &*call };
+    match call.wait(timeout_from_us(timeout_us)) {
+        Ok(buf) => unsafe {
+            let (ptr, size) = buf.into_raw();
+            *data = ptr;
+            *len = size;
+            MIPC_SUCCESS
+        },
+        Err(RecvError::Disconnected) => MIPC_DISCONNECTED,
+        Err(_) => MIPC_EMPTY,
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_call_free(call: *mut Call) {
+    drop(unsafe { Box::from_raw(call) });
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_call_async(client: *mut IpcClient, data: *const u8, len: usize, timeout_us: u64,
+                                  callback: CallCallback, user: *mut libc::c_void) -> libc::c_int {
+    let client = unsafe { &*client };
+    let body: &[u8] = if data.is_null() { &[] } else { unsafe { slice::from_raw_parts(data, len) } };
+    let user = UserData(user);
+    send_status(client.call_with(body, timeout_from_us(timeout_us), move |result| {
+        match result {
+            Ok(buf) => {
+                let (ptr, size) = buf.into_raw();
+                callback(user.0, MIPC_SUCCESS, ptr, size);
+            }
+            Err(_) => callback(user.0, MIPC_DISCONNECTED, ptr::null_mut(), 0),
+        }
+    }))
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_recv_request(client: *mut IpcClient, id: *mut u64, data: *mut *mut u8, len: *mut usize,
+                                    timeout_us: u64) -> libc::c_int {
+    let client = unsafe { &*client };
+    match client.recv_request(timeout_from_us(timeout_us)) {
+        Ok(request) => unsafe {
+            let (ptr, size) = request.body.into_raw();
+            *id = request.id;
+            *data = ptr;
+            *len = size;
+            MIPC_SUCCESS
+        },
+        Err(RecvError::Disconnected) => MIPC_DISCONNECTED,
+        Err(_) => MIPC_EMPTY,
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_respond(client: *mut IpcClient, id: u64, data: *const u8, len: usize, timeout_us: u64) -> libc::c_int {
+    let client = unsafe { &*client };
+    let body: &[u8] = if data.is_null() { &[] } else { unsafe { slice::from_raw_parts(data, len) } };
+    send_status(client.respond(id, body, timeout_from_us(timeout_us)))
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_shared_alloc(client: *mut IpcClient, len: usize, data: *mut *mut u8) -> *mut SharedBuffer {
+    let client = unsafe { &*client };
+    match client.alloc_shared(len) {
+        Ok(mut buffer) => {
+            unsafe { *data = buffer.as_mut_ptr() };
+            Box::into_raw(Box::new(buffer))
+        }
+        Err(_) => ptr::null_mut(),
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_shared_alloc(_client: *mut IpcClient, _len: usize, _data: *mut *mut u8) -> *mut SharedBuffer {
+    ptr::null_mut()
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_shared_send(client: *mut IpcClient, buffer: *mut SharedBuffer, timeout_us: u64) -> libc::c_int {
+    let client = unsafe { &*client };
+    let buffer = unsafe { Box::from_raw(buffer) };
+    send_status(client.send_shared(*buffer, timeout_from_us(timeout_us)))
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_shared_send(_client: *mut IpcClient, _buffer: *mut SharedBuffer, _timeout_us: u64) -> libc::c_int {
+    MIPC_DISCONNECTED
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_shared_free(buffer: *mut SharedBuffer) {
+    drop(unsafe { Box::from_raw(buffer) });
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_publisher_open(name: *const i8, options: *const Options, options_size: usize) -> *mut Publisher {
+    let name = match unsafe { CStr::from_ptr(name) }.to_str() {
+        Ok(s) => s,
+        Err(_) => return ptr::null_mut(),
+    };
+
+    match Publisher::open(name, &options_or_default(options, options_size)) {
+        Ok(publisher) => Box::into_raw(Box::new(publisher)),
+        Err(_) => ptr::null_mut(),
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_publisher_open(_name: *const i8, _options: *const Options, _options_size: usize) -> *mut Publisher {
+    ptr::null_mut()
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_publisher_close(publisher: *mut Publisher) {
+    drop(unsafe { Box::from_raw(publisher) });
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_publish(publisher: *mut Publisher, data: *const u8, len: usize) -> libc::c_int {
+    let publisher = unsafe { &*publisher };
+    let buf: &[u8] = if data.is_null() { &[] } else { unsafe { slice::from_raw_parts(data, len) } };
+    send_status(publisher.publish(buf))
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_publish(_publisher: *mut Publisher, _data: *const u8, _len: usize) -> libc::c_int {
+    MIPC_DISCONNECTED
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_subscriber_open(name: *const i8, pid: u32) -> *mut Subscriber {
+    let name = match unsafe { CStr::from_ptr(name) }.to_str() {
+        Ok(s) => s,
+        Err(_) => return ptr::null_mut(),
+    };
+
+    match Subscriber::open(name, pid) {
+        Ok(subscriber) => Box::into_raw(Box::new(subscriber)),
+        Err(_) => ptr::null_mut(),
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_subscriber_open(_name: *const i8, _pid: u32) -> *mut Subscriber {
+    ptr::null_mut()
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_subscriber_close(subscriber: *mut Subscriber) {
+    drop(unsafe { Box::from_raw(subscriber) });
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_subscriber_recv(subscriber: *mut Subscriber, data: *mut *mut u8, len: *mut usize,
+                                       timeout_us: u64) -> libc::c_int {
+    let subscriber = unsafe { &*subscriber };
+    match subscriber.recv(timeout_from_us(timeout_us)) {
+        Ok(buf) => unsafe {
+            let (ptr, size) = buf.into_raw();
+            *data = ptr;
+            *len = size;
+            MIPC_SUCCESS
+        },
+        Err(RecvError::Lagged(lost)) => {
+            unsafe { *len = lost as usize };
+            MIPC_LAGGED
+        }
+        Err(RecvError::Disconnected) => MIPC_DISCONNECTED,
+        Err(_) => MIPC_EMPTY,
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_subscriber_recv(_subscriber: *mut Subscriber, _data: *mut *mut u8, _len: *mut usize,
+                                       _timeout_us: u64) -> libc::c_int {
+    MIPC_DISCONNECTED
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_subscriber_lost(subscriber: *mut Subscriber) -> u64 {
+    unsafe { &*subscriber }.lost()
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_subscriber_lost(_subscriber: *mut Subscriber) -> u64 {
+    0
+}
+
+#[cfg(unix)]
+#[no_mangle]
+pub extern "C" fn mipc_get_readable_fd(client: *mut IpcClient) -> libc::c_int {
+    let client = unsafe { &*client };
+    match client.readable_fd() {
+        Ok(fd) => fd,
+        Err(_) => -1,
+    }
+}
+
+#[cfg(not(unix))]
+#[no_mangle]
+pub extern "C" fn mipc_get_readable_fd(_client: *mut IpcClient) -> libc::c_int {
+    -1
+}
+
+#[cfg(unix)]
+#[no_mangle]
+pub extern "C" fn mipc_get_writable_fd(client: *mut IpcClient) -> libc::c_int {
+    let client = unsafe { &*client };
+    match client.writable_fd() {
+        Ok(fd) => fd,
+        Err(_) => -1,
+    }
+}
+
+#[cfg(not(unix))]
+#[no_mangle]
+pub extern "C" fn mipc_get_writable_fd(_client: *mut IpcClient) -> libc::c_int {
+    -1
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_reactor_poll(timeout_us: u64) -> libc::c_int {
+    match ::reactor::manual().and_then(|reactor| reactor.poll(timeout_from_us(timeout_us))) {
+        Ok(events) => events as libc::c_int,
+        Err(_) => -1,
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_reactor_poll(_timeout_us: u64) -> libc::c_int {
+    -1
+}
+
+#[cfg(target_os = "linux")]
+#[no_mangle]
+pub extern "C" fn mipc_reactor_fd() -> libc::c_int {
+    match ::reactor::manual() {
+        Ok(reactor) => reactor.fd(),
+        Err(_) => -1,
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+#[no_mangle]
+pub extern "C" fn mipc_reactor_fd() -> libc::c_int {
+    -1
+}
+
+#[cfg(unix)]
+#[no_mangle]
+pub extern "C" fn mipc_listen(name: *const i8, options: *const Options, options_size: usize) -> *mut IpcServer {
+    let name = match unsafe { CStr::from_ptr(name) }.to_str() {
+        Ok(s) => s,
+        Err(_) => return ptr::null_mut(),
+    };
+
+    match IpcServer::listen(name, &options_or_default(options, options_size)) {
+        Ok(server) => Box::into_raw(Box::new(server)),
+        Err(_) => ptr::null_mut(),
+    }
+}
+
+#[cfg(not(unix))]
+#[no_mangle]
+pub extern "C" fn mipc_listen(_name: *const i8, _options: *const Options, _options_size: usize) -> *mut IpcServer {
+    ptr::null_mut()
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_server_close(server: *mut IpcServer) {
+    drop(unsafe { Box::from_raw(server) });
+}
+
+#[cfg(unix)]
+#[no_mangle]
+pub extern "C" fn mipc_server_accept(server: *mut IpcServer, timeout_us: u64) -> *mut IpcClient {
+    let server = unsafe { &*server };
+    match server.accept(timeout_from_us(timeout_us)) {
+        Ok(Some(client)) => Box::into_raw(Box::new(client)),
+        Ok(None) | Err(_) => ptr::null_mut(),
+    }
+}
+
+#[cfg(not(unix))]
+#[no_mangle]
+pub extern "C" fn mipc_server_accept(_server: *mut IpcServer, _timeout_us: u64) -> *mut IpcClient {
+    ptr::null_mut()
+}
+
+#[cfg(unix)]
+#[no_mangle]
+pub extern "C" fn mipc_server_recv(server: *mut IpcServer, client_id: *mut u32, data: *mut *mut u8,
+                                   len: *mut usize, timeout_us: u64) -> libc::c_int {
+    let server = unsafe { &*server };
+    match server.recv(timeout_from_us(timeout_us)) {
+        Some((id, Some(buf))) => unsafe {
+            let (ptr, size) = buf.into_raw();
+            *client_id = id;
+            *data = ptr;
+            *len = size;
+            MIPC_SUCCESS
+        },
+        Some((id, None)) => unsafe {
+            *client_id = id;
+            MIPC_DISCONNECTED
+        },
+        None => MIPC_EMPTY,
+    }
+}
+
+#[cfg(not(unix))]
+#[no_mangle]
+pub extern "C" fn mipc_server_recv(_server: *mut IpcServer, _client_id: *mut u32, _data: *mut *mut u8,
+                                   _len: *mut usize, _timeout_us: u64) -> libc::c_int {
+    MIPC_EMPTY
+}
+
+#[cfg(unix)]
+#[no_mangle]
+pub extern "C" fn mipc_client_id(client: *mut IpcClient) -> u32 {
+    unsafe { &*client }.id()
+}
+
+#[cfg(not(unix))]
+#[no_mangle]
+pub extern "C" fn mipc_client_id(_client: *mut IpcClient) -> u32 {
+    0
+}
+
+/// Returns MIPC_SUCCESS, or -1 if the file couldn't be created
+#[no_mangle]
+pub extern "C" fn mipc_capture_start(client: *mut IpcClient, path: *const i8) -> libc::c_int {
+    let client = unsafe { &*client };
+    let path = match unsafe { CStr::from_ptr(path) }.to_str() {
+        Ok(s) => s,
+        Err(_) => return -1,
+    };
+    match client.start_capture(path) {
+        Ok(()) => MIPC_SUCCESS,
+        Err(_) => -1,
+    }
+}
+
+/// Returns MIPC_SUCCESS, or -1 if writing the capture failed at some point
+#[no_mangle]
+pub extern "C" fn mipc_capture_stop(client: *mut IpcClient) -> libc::c_int {
+    let client = unsafe { &*client };
+    match client.stop_capture() {
+        Ok(()) => MIPC_SUCCESS,
+        Err(_) => -1,
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn mipc_get_stats(client: *mut IpcClient, stats: *mut Stats, stats_size: usize) {
+    // Only as much as the caller's IpcStats has room for
+    let snapshot = unsafe { (*client).stats() };
+    let size = cmp::min(stats_size, mem::size_of::<Stats>());
+    unsafe { ptr::copy_nonoverlapping(&snapshot as *const Stats as *const u8, stats as *mut u8, size) };
+}
+
 #[no_mangle]
 pub extern "C" fn mipc_recv_free(data: *mut u8, len: usize) {
-    unsafe { Vec::from_raw_parts(data, len, len) };
+    // Goes back to the pool of the client it was received from
+    drop(unsafe { Buffer::from_raw(data, len) });
 }
@@ -0,0 +1,899 @@
+//! Wire framing shared by every transport: each frame is a little-endian u32 header followed
+//! by the payload. The low 30 bits of the header are the payload length and the top two say
+//! what kind of frame it is.
+//!
+//! The first frame each end sends is a hello control frame listing what it understands. A
+//! message is only ever compressed once the peer's hello says it can decompress it, so there
+//! is no round trip at open and an end that never compresses costs the other nothing.
+//!
+//! The hello breaks compatibility with ends built before it, which sent plain length-prefixed
+//! messages and nothing else: such an end reads the hello's header as the length of a ~1 GiB
+//! message and waits for the rest. This end fails the connection instead, as soon as the
+//! peer's first frame turns out not to be a hello. The old end then sees it close.
+//!
+//! A stream is sent as a run of chunk frames ended by an empty one, so it can be any length
+//! and neither end ever holds more of it than its queues allow.
+//!
+//! A shared-memory message is a control frame giving the length of a sealed memfd, and the
+//! memfd itself travels alongside it as an SCM_RIGHTS descriptor on the first packet of the
+//! frame. Only transports that can pass descriptors (see Source and Sink) carry them.
+//!
+//! RPC requests and responses are control frames as well; see rpc.rs.
+//!
+//! Once the peer's hello says it can put them back together, messages over FRAGMENT_SIZE go
+//! out as a run of fragment control frames, and the writer stops between any two of them to
+//! let urgent messages through first. An urgent message is a control frame of its own, which
+//! the receiver queues ahead of the messages that aren't urgent.
+//!
+//! The Decoder and Encoder only ever make one read or write call at a time and keep their
+//! place in between, so the same code drives both the blocking I/O threads and the
+//! non-blocking reactor.
+
+use std::collections::VecDeque;
+use std::fs::File;
+use std::io::{self, IoSlice, Read, Write};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::Instant;
+use std::{cmp, usize};
+
+use lz4;
+use capture::{self, Capture};
+use dispatch::Dispatch;
+#[cfg(target_os = "linux")]
+use memfd;
+use options::Options;
+use pool::{Buffer, Pool};
+use queue::{Queue, Space, Watcher};
+use rpc::{self, Calls, Request};
+use stats::Counters;
+
+// Most platforms cap a single writev at 1024 iovecs, and every frame needs three: the
+// header, a prefix and the payload
+const MAX_IOVECS: usize = 1024;
+const SLICES: usize = 3;
+const MAX_BATCH: usize = MAX_IOVECS / SLICES;
+
+const HEADER_LEN: usize = 4;
+
+const KIND: u32 = 3 << 30;
+const MESSAGE: u32 = 0;
+// Between the two ends of the connection, never handed to the application
+const CONTROL: u32 = 1 << 30;
+// The payload is a u32 original length followed by an LZ4 block
+const COMPRESSED: u32 = 2 << 30;
+// Part of a stream; an empty one ends it
+const CHUNK: u32 = 3 << 30;
+
+/// The biggest message (or stream chunk) the header can describe
+pub const MAX_MESSAGE: usize = !KIND as usize;
+
+const HELLO_MAGIC: &'static [u8; 4] = b"MIPC";
+// Version 0 was the framing from before the hello
+const HELLO_VERSION: u8 = 1;
+const FEATURE_LZ4: u32 = 1;
+const FEATURE_LANES: u32 = 2;
+
+// A control frame for a shared-memory message: the magic, then the u64 length
+const SHARED_MAGIC: &'static [u8; 4] = b"MSHM";
+
+// A control frame for an urgent message: the magic, then the message
+const URGENT_MAGIC: &'static [u8; 4] = b"MURG";
+
+// A control frame carrying a piece of a big message: the magic, the u64 length of the whole
+// payload, the u32 kind of frame it would have gone out as, then the piece
+const FRAGMENT_MAGIC: &'static [u8; 4] = b"MFRG";
+const FRAGMENT_HEADER: usize = 16;
+
+/// Messages bigger than this are sent in pieces of this size, so an urgent message never
+/// waits for more than one piece to be written
+pub const FRAGMENT_SIZE: usize = 1 << 20;
+
+// Small messages are read many at a time through this, big ones are read straight into
+// their own buffer. It must be at least as big as the largest packet a transport delivers.
+pub const STAGING_SIZE: usize = 64 * 1024;
+
+/// What goes through a send queue
+pub enum Frame {
+    Message(Buffer),
+    /// Part of the connection's one outgoing stream. An empty chunk ends the stream.
+    Chunk(Buffer),
+    /// A sealed memfd and the length of the message in it
+    Shared(File, usize),
+    /// A request or response, already laid out by `rpc`
+    Rpc(Buffer),
+    /// A message that goes ahead of everything not yet written that isn't urgent
+    Urgent(Buffer),
+}
+
+impl Frame {
+    /// What the frame counts for against the send queue's byte watermarks
+    pub fn weight(&self) -> usize {
+        match *self {
+            Frame::Message(ref buffer) | Frame::Chunk(ref buffer) | Frame::Rpc(ref buffer)
+                | Frame::Urgent(ref buffer) => buffer.len(),
+            Frame::Shared(_, len) => len,
+        }
+    }
+}
+
+/// What the Decoder reads from
+pub trait Source: Read {
+    /// Take the oldest descriptor that has arrived along with the bytes read so far
+    fn take_fd(&mut self) -> Option<File> {
+        None
+    }
+}
+
+/// What the Encoder writes to
+pub trait Sink: Write {
+    /// Like `write_vectored`, but also pass `fd` to the peer with the first byte written
+    fn write_with_fd(&mut self, _bufs: &[IoSlice], _fd: &File) -> io::Result<usize> {
+        Err(io::Error::new(io::ErrorKind::InvalidInput, "transport can't pass descriptors"))
+    }
+}
+
+// Pipes, in the reactor
+impl Source for File {}
+impl Sink for File {}
+
+/// Where a connection's reader puts what it receives. Dropping it closes every queue in it
+/// and fails the calls still waiting, so however the reader stops, the client finds out.
+pub struct Inbox {
+    pub messages: Arc<Queue<Buffer>>,
+    pub chunks: Arc<Queue<Buffer>>,
+    pub requests: Arc<Queue<Request>>,
+    pub calls: Arc<Calls>,
+    pub dispatch: Arc<Dispatch>,
+}
+
+impl Inbox {
+    /// Wait for every queue to have room. Returns false once any of them is closed.
+    pub fn wait_space(&self) -> bool {
+        // Only the reader fills the queues, so once each has had room they all still do
+        self.messages.wait_space(None) != Space::Closed && self.chunks.wait_space(None) != Space::Closed
+            && self.requests.wait_space(None) != Space::Closed
+    }
+
+    pub fn is_full(&self) -> bool {
+        self.messages.is_full() || self.chunks.is_full() || self.requests.is_full()
+    }
+
+    pub fn watch(&self, watcher: Arc<dyn Watcher>) {
+        self.messages.watch(watcher.clone());
+        self.chunks.watch(watcher.clone());
+        self.requests.watch(watcher);
+    }
+
+    pub fn close(&self) {
+        self.messages.close();
+        self.chunks.close();
+        self.requests.close();
+        self.calls.close();
+        self.dispatch.finish();
+    }
+}
+
+impl Drop for Inbox {
+    fn drop(&mut self) {
+        self.close();
+    }
+}
+
+/// Everything one read completed, sorted by where it goes
+pub struct Batch {
+    pub messages: Vec<Buffer>,
+    pub urgent: Vec<Buffer>,
+    pub chunks: Vec<Buffer>,
+    pub requests: Vec<Request>,
+    pub responses: Vec<(u64, Buffer)>,
+}
+
+impl Batch {
+    pub fn new() -> Batch {
+        Batch {
+            messages: Vec::new(),
+            urgent: Vec::new(),
+            chunks: Vec::new(),
+            requests: Vec::new(),
+            responses: Vec::new(),
+        }
+    }
+
+    fn push_rpc(&mut self, kind: rpc::Kind, id: u64, body: Buffer) {
+        match kind {
+            rpc::Kind::Request => self.requests.push(Request { id: id, body: body }),
+            rpc::Kind::Response => self.responses.push((id, body)),
+        }
+    }
+
+    /// Move everything into the receive queues, or to the receive handler, and hand responses
+    /// to their calls. Returns false if any queue is closed.
+    pub fn push_to(&mut self, inbox: &Inbox) -> bool {
+        for (id, body) in self.responses.drain(..) {
+            inbox.calls.complete(id, body);
+        }
+        inbox.dispatch.deliver(&mut self.urgent, &mut self.messages, &inbox.messages)
+            && (self.chunks.is_empty() || inbox.chunks.push_all(self.chunks.drain(..)))
+            && (self.requests.is_empty() || inbox.requests.push_all(self.requests.drain(..)))
+    }
+}
+
+fn invalid_data(message: &'static str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message)
+}
+
+/// What one end of a connection knows about the other, which the Decoder learns from the
+/// peer's hello and the Encoder acts on, and the counters and capture both of them keep.
+pub struct Session {
+    compress_threshold: usize,
+    peer_lz4: AtomicBool,
+    peer_lanes: AtomicBool,
+    pub stats: Counters,
+    pub capture: Capture,
+}
+
+impl Session {
+    pub fn new(options: &Options) -> Arc<Session> {
+        Arc::new(Session {
+            compress_threshold: options.compress_threshold as usize,
+            peer_lz4: AtomicBool::new(false),
+            peer_lanes: AtomicBool::new(false),
+            stats: Counters::default(),
+            capture: Capture::new(),
+        })
+    }
+
+    fn should_compress(&self, len: usize) -> bool {
+        self.compress_threshold != 0 && len >= self.compress_threshold && self.peer_lz4.load(Ordering::Relaxed)
+    }
+
+    fn peer_lanes(&self) -> bool {
+        self.peer_lanes.load(Ordering::Relaxed)
+    }
+
+    fn hello() -> [u8; 9] {
+        let mut hello = [0; 9];
+        hello[..4].copy_from_slice(HELLO_MAGIC);
+        hello[4] = HELLO_VERSION;
+        hello[5..].copy_from_slice(&(FEATURE_LZ4 | FEATURE_LANES).to_le_bytes());
+        hello
+    }
+
+    fn on_control(&self, payload: &[u8]) {
+        // Anything unrecognised is from a newer peer and safe to ignore
+        if payload.len() >= 9 && &payload[..4] == HELLO_MAGIC {
+            let mut features = [0; 4];
+            features.copy_from_slice(&payload[5..9]);
+            let features = u32::from_le_bytes(features);
+            self.peer_lz4.store(features & FEATURE_LZ4 != 0, Ordering::Relaxed);
+            self.peer_lanes.store(features & FEATURE_LANES != 0, Ordering::Relaxed);
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn map_shared(file: File, len: u64) -> io::Result<Buffer> {
+    memfd::map(file, len)
+}
+
+#[cfg(not(target_os = "linux"))]
+fn map_shared(_file: File, _len: u64) -> io::Result<Buffer> {
+    Err(invalid_data("shared-memory messages are not supported on this platform"))
+}
+
+fn decompress(payload: &[u8], pool: &Arc<Pool>) -> io::Result<Buffer> {
+    if payload.len() < 4 {
+        return Err(invalid_data("truncated compressed message"));
+    }
+    let mut len = [0; 4];
+    len.copy_from_slice(&payload[..4]);
+    let len = u32::from_le_bytes(len) as usize;
+    if len > MAX_MESSAGE {
+        return Err(invalid_data("compressed message is too big"));
+    }
+    // Checked before a buffer that size is allocated on the sender's word
+    if len > (payload.len() - 4).saturating_mul(lz4::MAX_RATIO) {
+        return Err(invalid_data("corrupt compressed message"));
+    }
+
+    let mut buffer = Pool::get(pool, len);
+    try!(lz4::decompress(&payload[4..], &mut buffer).map_err(|_| invalid_data("corrupt compressed message")));
+    Ok(buffer)
+}
+
+// Hand over a complete frame's payload
+fn deliver(session: &Session, fds: &mut VecDeque<File>, payload: &[u8], kind: u32, pool: &Arc<Pool>,
+           out: &mut Batch) -> io::Result<()> {
+    let stats = &session.stats;
+    match kind {
+        MESSAGE => {
+            stats.received_message(payload.len());
+            out.messages.push(Pool::copy(pool, payload));
+        }
+        COMPRESSED => {
+            let buffer = try!(decompress(payload, pool));
+            stats.received_message(buffer.len());
+            out.messages.push(buffer);
+        }
+        CHUNK => {
+            stats.received_chunk(payload.len());
+            out.chunks.push(Pool::copy(pool, payload));
+        }
+        _ if payload.len() >= 12 && &payload[..4] == SHARED_MAGIC => {
+            let mut len = [0; 8];
+            len.copy_from_slice(&payload[4..12]);
+            let file = try!(fds.pop_front().ok_or_else(|| invalid_data("shared-memory message without a descriptor")));
+            let buffer = try!(map_shared(file, u64::from_le_bytes(len)));
+            stats.received_message(buffer.len());
+            out.messages.push(buffer);
+        }
+        _ if payload.len() >= 4 && &payload[..4] == URGENT_MAGIC => {
+            stats.received_message(payload.len() - 4);
+            out.urgent.push(Pool::copy(pool, &payload[4..]));
+        }
+        _ => match rpc::parse(payload) {
+            Some((rpc_kind, id)) => {
+                let body = Pool::copy(pool, &payload[rpc::HEADER_LEN..]);
+                stats.received_message(body.len());
+                out.push_rpc(rpc_kind, id, body);
+            }
+            None => session.on_control(payload),
+        },
+    }
+    Ok(())
+}
+
+// Like `deliver`, for a payload that was collected in its own buffer
+fn finish(session: &Session, fds: &mut VecDeque<File>, mut buffer: Buffer, kind: u32, pool: &Arc<Pool>,
+          out: &mut Batch) -> io::Result<()> {
+    match kind {
+        MESSAGE => {
+            session.stats.received_message(buffer.len());
+            out.messages.push(buffer);
+        }
+        CHUNK => {
+            session.stats.received_chunk(buffer.len());
+            out.chunks.push(buffer);
+        }
+        // Move the body to the front rather than copy it to a buffer of its own
+        CONTROL if buffer.starts_with(URGENT_MAGIC) => {
+            let len = buffer.len() - 4;
+            buffer.copy_within(4.., 0);
+            buffer.truncate(len);
+            session.stats.received_message(len);
+            out.urgent.push(buffer);
+        }
+        CONTROL => match rpc::parse(&buffer) {
+            Some((rpc_kind, id)) => {
+                let len = buffer.len() - rpc::HEADER_LEN;
+                buffer.copy_within(rpc::HEADER_LEN.., 0);
+                buffer.truncate(len);
+                session.stats.received_message(len);
+                out.push_rpc(rpc_kind, id, buffer);
+            }
+            None => return deliver(session, fds, &buffer, kind, pool, out),
+        },
+        _ => return deliver(session, fds, &buffer, kind, pool, out),
+    }
+    Ok(())
+}
+
+/// The length of the whole message and the kind of frame it would have been, if `payload`
+/// starts with a fragment header
+fn parse_fragment(payload: &[u8]) -> Option<(usize, u32)> {
+    if payload.len() < FRAGMENT_HEADER || &payload[..4] != FRAGMENT_MAGIC {
+        return None;
+    }
+    let mut total = [0; 8];
+    let mut kind = [0; 4];
+    total.copy_from_slice(&payload[4..12]);
+    kind.copy_from_slice(&payload[12..16]);
+    Some((u64::from_le_bytes(total) as usize, u32::from_le_bytes(kind)))
+}
+
+// A message arriving in fragments: its payload so far, how much of that is in, and what kind
+// of frame it would have come as
+type Assembly = Option<(Buffer, usize, u32)>;
+
+// Carry on with the message being put together, or start a new one
+fn take_assembly(assembly: &mut Assembly, total: usize, kind: u32, pool: &Arc<Pool>) -> io::Result<(Buffer, usize)> {
+    match assembly.take() {
+        Some((buffer, filled, assembling)) => {
+            if buffer.len() != total || assembling != kind {
+                return Err(invalid_data("fragment of a different message"));
+            }
+            Ok((buffer, filled))
+        }
+        None => {
+            if total > MAX_MESSAGE || (kind != MESSAGE && kind != COMPRESSED) {
+                return Err(invalid_data("bad fragment header"));
+            }
+            Ok((Pool::get(pool, total), 0))
+        }
+    }
+}
+
+// Keep what has come in of a message, or hand it over once it is all there
+fn assembled(session: &Session, assembly: &mut Assembly, buffer: Buffer, filled: usize, kind: u32,
+             pool: &Arc<Pool>, out: &mut Batch) -> io::Result<()> {
+    if filled < buffer.len() {
+        *assembly = Some((buffer, filled, kind));
+        return Ok(());
+    }
+    let message = if kind == COMPRESSED { try!(decompress(&buffer, pool)) } else { buffer };
+    session.stats.received_message(message.len());
+    out.messages.push(message);
+    Ok(())
+}
+
+// Add a fragment that arrived whole to the message it is part of
+fn reassemble(session: &Session, assembly: &mut Assembly, payload: &[u8], total: usize, kind: u32,
+              pool: &Arc<Pool>, out: &mut Batch) -> io::Result<()> {
+    let (mut buffer, filled) = try!(take_assembly(assembly, total, kind, pool));
+    let piece = &payload[FRAGMENT_HEADER..];
+    if piece.len() > total - filled {
+        return Err(invalid_data("fragment runs past the end of its message"));
+    }
+    buffer[filled..filled + piece.len()].copy_from_slice(piece);
+    assembled(session, assembly, buffer, filled + piece.len(), kind, pool, out)
+}
+
+// A frame too big for staging, being read into a buffer of its own, or a fragment being read
+// straight into the message it is part of. Either way its bytes go in buffer[filled..end].
+struct Partial {
+    buffer: Buffer,
+    filled: usize,
+    end: usize,
+    kind: u32,
+    fragment: bool,
+}
+
+pub struct Decoder {
+    session: Arc<Session>,
+    staging: Box<[u8]>,
+    start: usize,
+    end: usize,
+    partial: Option<Partial>,
+    assembly: Assembly,
+    // Descriptors the reader has passed on, for shared-memory frames to claim in order
+    fds: VecDeque<File>,
+    hello_seen: bool,
+}
+
+impl Decoder {
+    pub fn new(session: &Arc<Session>) -> Decoder {
+        Decoder {
+            session: session.clone(),
+            staging: vec![0; STAGING_SIZE].into_boxed_slice(),
+            start: 0,
+            end: 0,
+            partial: None,
+            assembly: None,
+            fds: VecDeque::new(),
+            hello_seen: false,
+        }
+    }
+
+    /// Make one read call and append every message it completed to `out`.
+    /// Returns false at end of stream.
+    pub fn read_from<R: Source>(&mut self, reader: &mut R, pool: &Arc<Pool>, out: &mut Batch) -> io::Result<bool> {
+        if !self.session.capture.is_active() {
+            return self.read_batch(reader, pool, out);
+        }
+        // Recorded in the order they will be delivered in, urgent ones first
+        let (urgent, messages) = (out.urgent.len(), out.messages.len());
+        let result = self.read_batch(reader, pool, out);
+        for message in &out.urgent[urgent..] {
+            self.session.capture.record(capture::RECEIVED | capture::URGENT, message);
+        }
+        for message in &out.messages[messages..] {
+            self.session.capture.record(capture::RECEIVED, message);
+        }
+        result
+    }
+
+    fn read_batch<R: Source>(&mut self, reader: &mut R, pool: &Arc<Pool>, out: &mut Batch) -> io::Result<bool> {
+        // The rest of a big message goes straight into its buffer, skipping the staging copy
+        if let Some(ref mut partial) = self.partial {
+            if partial.end - partial.filled >= STAGING_SIZE {
+                let n = try!(reader.read(&mut partial.buffer[partial.filled..partial.end]));
+                if n == 0 {
+                    return Ok(false);
+                }
+                self.session.stats.read(n);
+                while let Some(fd) = reader.take_fd() {
+                    self.fds.push_back(fd);
+                }
+                partial.filled += n;
+                if partial.filled < partial.end {
+                    return Ok(true);
+                }
+            }
+        }
+        if let Some(partial) = self.partial.take() {
+            if partial.filled == partial.end {
+                try!(self.complete(partial, pool, out));
+                return Ok(true);
+            }
+            self.partial = Some(partial);
+        }
+
+        if self.start != 0 {
+            self.staging.copy_within(self.start..self.end, 0);
+            self.end -= self.start;
+            self.start = 0;
+        }
+
+        let n = try!(reader.read(&mut self.staging[self.end..]));
+        if n == 0 {
+            return Ok(false);
+        }
+        self.session.stats.read(n);
+        while let Some(fd) = reader.take_fd() {
+            self.fds.push_back(fd);
+        }
+        self.end += n;
+        try!(self.parse(pool, out));
+        Ok(true)
+    }
+
+    fn complete(&mut self, partial: Partial, pool: &Arc<Pool>, out: &mut Batch) -> io::Result<()> {
+        if partial.fragment {
+            assembled(&self.session, &mut self.assembly, partial.buffer, partial.end, partial.kind, pool, out)
+        } else {
+            finish(&self.session, &mut self.fds, partial.buffer, partial.kind, pool, out)
+        }
+    }
+
+    fn parse(&mut self, pool: &Arc<Pool>, out: &mut Batch) -> io::Result<()> {
+        if let Some(mut partial) = self.partial.take() {
+            let take = cmp::min(self.end - self.start, partial.end - partial.filled);
+            partial.buffer[partial.filled..partial.filled + take].copy_from_slice(&self.staging[self.start..self.start + take]);
+            self.start += take;
+            partial.filled += take;
+            if partial.filled < partial.end {
+                self.partial = Some(partial);
+                return Ok(());
+            }
+            try!(self.complete(partial, pool, out));
+        }
+
+        while self.end - self.start >= HEADER_LEN {
+            let mut header = [0; HEADER_LEN];
+            header.copy_from_slice(&self.staging[self.start..self.start + HEADER_LEN]);
+            let header = u32::from_le_bytes(header);
+            let (len, kind) = ((header & !KIND) as usize, header & KIND);
+            // A peer from before the hello starts straight away with its first message
+            if !self.hello_seen && (kind != CONTROL || HEADER_LEN + len > STAGING_SIZE) {
+                return Err(invalid_data("peer uses an older messageipc protocol"));
+            }
+
+            let body = self.start + HEADER_LEN;
+            let have = self.end - body;
+            if have >= len {
+                let payload = &self.staging[body..body + len];
+                if !self.hello_seen {
+                    if !payload.starts_with(HELLO_MAGIC) {
+                        return Err(invalid_data("peer uses an older messageipc protocol"));
+                    }
+                    self.hello_seen = true;
+                }
+                match if kind == CONTROL { parse_fragment(payload) } else { None } {
+                    Some((total, whole)) => try!(reassemble(&self.session, &mut self.assembly, payload, total, whole, pool, out)),
+                    None => try!(deliver(&self.session, &mut self.fds, payload, kind, pool, out)),
+                }
+                self.start = body + len;
+                continue;
+            }
+
+            // Too big to ever fit in staging, so start collecting it in its own buffer
+            if HEADER_LEN + len > STAGING_SIZE {
+                // Unless it's a fragment, which goes straight into its message. Wait until
+                // there's enough of it to tell.
+                if kind == CONTROL && have < FRAGMENT_HEADER {
+                    break;
+                }
+                let fragment = if kind == CONTROL { parse_fragment(&self.staging[body..self.end]) } else { None };
+                let partial = match fragment {
+                    Some((total, whole)) => {
+                        let (mut buffer, filled) = try!(take_assembly(&mut self.assembly, total, whole, pool));
+                        let (piece, have) = (len - FRAGMENT_HEADER, have - FRAGMENT_HEADER);
+                        if piece > total - filled {
+                            return Err(invalid_data("fragment runs past the end of its message"));
+                        }
+                        buffer[filled..filled + have].copy_from_slice(&self.staging[body + FRAGMENT_HEADER..self.end]);
+                        Partial { buffer: buffer, filled: filled + have, end: filled + piece, kind: whole, fragment: true }
+                    }
+                    None => {
+                        let mut buffer = Pool::get(pool, len);
+                        buffer[..have].copy_from_slice(&self.staging[body..self.end]);
+                        Partial { buffer: buffer, filled: have, end: len, kind: kind, fragment: false }
+                    }
+                };
+                self.start = self.end;
+                self.partial = Some(partial);
+            }
+            break;
+        }
+
+        if self.start == self.end {
+            self.start = 0;
+            self.end = 0;
+        }
+        Ok(())
+    }
+}
+
+// A frame waiting to be written: the header, then `prefix`, then buffer[start..end]. A message
+// going out in fragments stays in the queue as one of these until its last piece is written.
+struct Out {
+    buffer: Buffer,
+    kind: u32,
+    fd: Option<File>,
+    prefix: [u8; FRAGMENT_HEADER],
+    prefix_len: usize,
+    start: usize,
+    end: usize,
+    fragmented: bool,
+}
+
+impl Out {
+    fn new(buffer: Buffer, kind: u32, fd: Option<File>) -> Out {
+        let end = buffer.len();
+        Out { buffer: buffer, kind: kind, fd: fd, prefix: [0; FRAGMENT_HEADER], prefix_len: 0, start: 0, end: end,
+              fragmented: false }
+    }
+
+    fn urgent(buffer: Buffer) -> Out {
+        let mut out = Out::new(buffer, CONTROL, None);
+        out.prefix[..4].copy_from_slice(URGENT_MAGIC);
+        out.prefix_len = 4;
+        out
+    }
+
+    fn fragmented(buffer: Buffer, kind: u32) -> Out {
+        let total = buffer.len();
+        let mut out = Out::new(buffer, CONTROL, None);
+        out.prefix[..4].copy_from_slice(FRAGMENT_MAGIC);
+        out.prefix[4..12].copy_from_slice(&(total as u64).to_le_bytes());
+        out.prefix[12..].copy_from_slice(&kind.to_le_bytes());
+        out.prefix_len = FRAGMENT_HEADER;
+        out.end = FRAGMENT_SIZE;
+        out.fragmented = true;
+        out
+    }
+
+    fn payload_len(&self) -> usize {
+        self.prefix_len + self.end - self.start
+    }
+
+    // Move on to the next fragment. Returns false if that was the last one.
+    fn next_fragment(&mut self) -> bool {
+        if !self.fragmented || self.end == self.buffer.len() {
+            return false;
+        }
+        self.start = self.end;
+        self.end = cmp::min(self.start + FRAGMENT_SIZE, self.buffer.len());
+        true
+    }
+}
+
+pub struct Encoder {
+    session: Arc<Session>,
+    pool: Arc<Pool>,
+    pending: VecDeque<Out>,
+    // How many frames at the front are urgent, or can't be overtaken because they're partly
+    // written
+    urgent: usize,
+    // How much of the front frame (header included) has already been written
+    written: usize,
+    // Compressor scratch space, allocated the first time it's needed
+    table: Vec<u32>,
+}
+
+impl Encoder {
+    /// The hello goes out ahead of everything else
+    pub fn new(session: &Arc<Session>, pool: &Arc<Pool>) -> Encoder {
+        let mut pending = VecDeque::new();
+        pending.push_back(Out::new(Pool::copy(pool, &Session::hello()), CONTROL, None));
+        Encoder {
+            session: session.clone(),
+            pool: pool.clone(),
+            pending: pending,
+            // Not even urgent frames overtake the hello, which the peer needs first
+            urgent: 1,
+            written: 0,
+            table: Vec::new(),
+        }
+    }
+
+    pub fn push(&mut self, frame: Frame) {
+        let buffer = match frame {
+            Frame::Message(buffer) => buffer,
+            Frame::Chunk(buffer) => {
+                self.session.stats.sent_chunk(buffer.len());
+                return self.pending.push_back(Out::new(buffer, CHUNK, None));
+            }
+            Frame::Rpc(buffer) => {
+                self.session.stats.sent_message(buffer.len() - rpc::HEADER_LEN);
+                return self.pending.push_back(Out::new(buffer, CONTROL, None));
+            }
+            Frame::Shared(file, len) => {
+                self.session.stats.sent_message(len);
+                let mut payload = Pool::get(&self.pool, 12);
+                payload[..4].copy_from_slice(SHARED_MAGIC);
+                payload[4..].copy_from_slice(&(len as u64).to_le_bytes());
+                return self.pending.push_back(Out::new(payload, CONTROL, Some(file)));
+            }
+            Frame::Urgent(buffer) => {
+                self.session.stats.sent_message(buffer.len());
+                self.session.capture.record(capture::SENT | capture::URGENT, &buffer);
+                // A peer that doesn't know urgent frames still gets the message ahead of the rest
+                let out = if self.session.peer_lanes() { Out::urgent(buffer) } else { Out::new(buffer, MESSAGE, None) };
+                let at = cmp::max(self.urgent, if self.written > 0 { 1 } else { 0 });
+                self.pending.insert(at, out);
+                self.urgent = at + 1;
+                return;
+            }
+        };
+        self.session.stats.sent_message(buffer.len());
+        self.session.capture.record(capture::SENT, &buffer);
+        let (buffer, kind) = match self.session.should_compress(buffer.len()) {
+            true => match self.compress(&buffer) {
+                Some(compressed) => (compressed, COMPRESSED),
+                None => (buffer, MESSAGE),
+            },
+            false => (buffer, MESSAGE),
+        };
+        if buffer.len() > FRAGMENT_SIZE && self.session.peer_lanes() {
+            self.pending.push_back(Out::fragmented(buffer, kind));
+        } else {
+            self.pending.push_back(Out::new(buffer, kind, None));
+        }
+    }
+
+    /// True once everything pushed has been written
+    pub fn is_empty(&self) -> bool {
+        self.pending.is_empty()
+    }
+
+    /// Forget everything not yet written
+    pub fn clear(&mut self) {
+        self.pending.clear();
+        self.urgent = 0;
+        self.written = 0;
+    }
+
+    // None if compressing didn't make it any smaller
+    fn compress(&mut self, message: &[u8]) -> Option<Buffer> {
+        if self.table.is_empty() {
+            self.table = vec![0; 1 << lz4::HASH_BITS];
+        }
+
+        let mut buffer = Pool::get(&self.pool, 4 + lz4::compress_bound(message.len()));
+        buffer[..4].copy_from_slice(&(message.len() as u32).to_le_bytes());
+        let len = 4 + lz4::compress(message, &mut buffer[4..], &mut self.table);
+        if len >= message.len() {
+            return None;
+        }
+        buffer.truncate(len);
+        Some(buffer)
+    }
+
+    /// Write as much as the writer will take. Returns true once everything is written or a
+    /// fragment has been, so the caller can push urgent frames before the next one, or false
+    /// if a non-blocking writer stopped accepting data.
+    pub fn write_to<W: Sink>(&mut self, writer: &mut W) -> io::Result<bool> {
+        while !self.pending.is_empty() {
+            let result = {
+                // A frame with a descriptor always starts a write of its own, so the descriptor
+                // goes with its first byte, and a fragment always ends one
+                let mut count = 0;
+                for (i, out) in self.pending.iter().take(MAX_BATCH).enumerate() {
+                    if i > 0 && out.fd.is_some() {
+                        break;
+                    }
+                    count += 1;
+                    if out.fragmented {
+                        break;
+                    }
+                }
+                let mut headers = [[0u8; HEADER_LEN]; MAX_BATCH];
+                let mut slices = [IoSlice::new(&[]); MAX_IOVECS];
+                for (i, out) in self.pending.iter().take(count).enumerate() {
+                    headers[i] = (out.payload_len() as u32 | out.kind).to_le_bytes();
+                }
+                for (i, out) in self.pending.iter().take(count).enumerate() {
+                    let skip = if i == 0 { self.written } else { 0 };
+                    let skip_prefix = cmp::min(skip.saturating_sub(HEADER_LEN), out.prefix_len);
+                    let skip_body = skip.saturating_sub(HEADER_LEN + out.prefix_len);
+                    slices[SLICES * i] = IoSlice::new(&headers[i][cmp::min(skip, HEADER_LEN)..]);
+                    slices[SLICES * i + 1] = IoSlice::new(&out.prefix[skip_prefix..out.prefix_len]);
+                    slices[SLICES * i + 2] = IoSlice::new(&out.buffer[out.start + skip_body..out.end]);
+                }
+                match self.pending[0].fd {
+                    Some(ref fd) if self.written == 0 => writer.write_with_fd(&slices[..SLICES * count], fd),
+                    _ => writer.write_vectored(&slices[..SLICES * count]),
+                }
+            };
+
+            match result {
+                Ok(0) => return Err(io::Error::new(io::ErrorKind::WriteZero, "failed to write message")),
+                Ok(n) => {
+                    self.session.stats.wrote(n);
+                    if self.consume(n) {
+                        return Ok(true);
+                    }
+                }
+                Err(ref e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Err(ref e) if e.kind() == io::ErrorKind::WouldBlock => return Ok(false),
+                Err(e) => return Err(e),
+            }
+        }
+        Ok(true)
+    }
+
+    // Returns true if that finished a fragment with more of its message still to go
+    fn consume(&mut self, mut n: usize) -> bool {
+        while n > 0 {
+            let left = HEADER_LEN + self.pending[0].payload_len() - self.written;
+            if n < left {
+                self.written += n;
+                return false;
+            }
+            n -= left;
+            self.written = 0;
+            let mut out = self.pending.pop_front().unwrap();
+            self.urgent = self.urgent.saturating_sub(1);
+            if out.next_fragment() {
+                // Anything urgent that came in while the fragment was being written goes first
+                self.pending.insert(self.urgent, out);
+                return true;
+            }
+        }
+        false
+    }
+}
+
+/// Read into `inbox` until the connection fails or any of its queues is closed. While any is
+/// full nothing is read, which leaves the peer's writes to back up instead.
+pub fn read_messages<R: Source>(reader: &mut R, session: &Arc<Session>, pool: &Arc<Pool>,
+                              inbox: &Inbox) -> io::Result<()> {
+    let mut decoder = Decoder::new(session);
+    let mut batch = Batch::new();
+    while inbox.wait_space() && try!(decoder.read_from(reader, pool, &mut batch)) {
+        if !batch.push_to(inbox) {
+            break;
+        }
+    }
+    Ok(())
+}
+
+// A blocking write, counting the time it takes
+fn write_timed<W: Sink>(encoder: &mut Encoder, writer: &mut W, session: &Session) -> io::Result<bool> {
+    let start = Instant::now();
+    let result = encoder.write_to(writer);
+    session.stats.write_blocked(start.elapsed());
+    result
+}
+
+/// Write frames from `queue` until the connection fails or the queue is closed and empty.
+/// Everything queued at the time the thread wakes up goes out together.
+pub fn write_messages<W: Sink>(writer: &mut W, session: &Arc<Session>, pool: &Arc<Pool>,
+                               queue: &Queue<Frame>) -> io::Result<()> {
+    let mut encoder = Encoder::new(session, pool);
+    try!(write_timed(&mut encoder, writer, session));
+    loop {
+        if encoder.is_empty() {
+            if queue.pop_many(usize::MAX, None, |frame| encoder.push(frame)).is_none() {
+                break;
+            }
+        } else {
+            // Partway through a big message, only urgent frames may go ahead of the rest of it
+            queue.pop_urgent(|frame| encoder.push(frame));
+        }
+        try!(write_timed(&mut encoder, writer, session));
+    }
+    Ok(())
+}
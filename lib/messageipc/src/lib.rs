@@ -1,5 +1,4 @@
 extern crate libc;
-extern crate byteorder;
 
 #[cfg(windows)]
 extern crate named_pipe;
@@ -8,10 +7,51 @@ extern crate named_pipe;
 pub use windows::IpcClient;
 #[cfg(unix)]
 pub use unix::IpcClient;
+#[cfg(unix)]
+pub use server::IpcServer;
+pub use options::Options;
+pub use capture::{CaptureReader, Captured};
+pub use dispatch::ReceiveHandler;
+pub use pool::Buffer;
+pub use queue::{RecvError, SendError};
+pub use rpc::{Call, Request};
+pub use stats::Stats;
+pub use frame::MAX_MESSAGE;
+pub use stream::StreamWriter;
+#[cfg(target_os = "linux")]
+pub use memfd::SharedBuffer;
+#[cfg(target_os = "linux")]
+pub use broadcast::{Publisher, Subscriber};
 
 pub mod ffi;
+pub mod options;
+
+mod capture;
+mod dispatch;
+mod frame;
+mod lz4;
+#[cfg(unix)]
+mod notify;
+mod pool;
+mod queue;
+mod rpc;
+mod spin;
+mod stats;
+mod stream;
 
 #[cfg(windows)]
 mod windows;
 #[cfg(unix)]
 mod unix;
+#[cfg(unix)]
+mod socket;
+#[cfg(unix)]
+mod server;
+#[cfg(target_os = "linux")]
+mod shm;
+#[cfg(target_os = "linux")]
+mod memfd;
+#[cfg(target_os = "linux")]
+mod broadcast;
+#[cfg(target_os = "linux")]
+mod reactor;
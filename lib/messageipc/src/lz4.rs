@@ -0,0 +1,208 @@
+//! The LZ4 block format, enough of it to compress large messages on the wire.
+//!
+//! The compressor is the plain greedy one with a single hash table; it trades some ratio for
+//! speed, which is the point when the alternative is a memcpy. The decompressor checks every
+//! length and offset against the buffers, so a corrupt frame is an error rather than a crash.
+
+use std::{cmp, ptr};
+
+const MIN_MATCH: usize = 4;
+// The last match must start at least this far from the end, and the last literals must be
+// at least LAST_LITERALS long
+const MF_LIMIT: usize = 12;
+const LAST_LITERALS: usize = 5;
+const MAX_OFFSET: usize = 65535;
+
+pub const HASH_BITS: u32 = 14;
+
+/// The most compressing `len` bytes can take
+pub fn compress_bound(len: usize) -> usize {
+    len + len / 255 + 16
+}
+
+/// No block decompresses to more than this many times its own size: past the first few, every
+/// 255 bytes of a literal run or a match take another byte to encode
+pub const MAX_RATIO: usize = 255;
+
+fn read_u32(src: &[u8], at: usize) -> u32 {
+    assert!(at + 4 <= src.len());
+    u32::from_le(unsafe { ptr::read_unaligned(src.as_ptr().add(at) as *const u32) })
+}
+
+fn read_u64(src: &[u8], at: usize) -> u64 {
+    assert!(at + 8 <= src.len());
+    u64::from_le(unsafe { ptr::read_unaligned(src.as_ptr().add(at) as *const u64) })
+}
+
+// How many bytes from `a` and `b` onwards are the same, looking no further than `limit`
+fn common_length(src: &[u8], mut a: usize, mut b: usize, limit: usize) -> usize {
+    let begin = b;
+    while b + 8 <= limit {
+        let diff = read_u64(src, a) ^ read_u64(src, b);
+        if diff != 0 {
+            return b - begin + (diff.trailing_zeros() / 8) as usize;
+        }
+        a += 8;
+        b += 8;
+    }
+    while b < limit && src[a] == src[b] {
+        a += 1;
+        b += 1;
+    }
+    b - begin
+}
+
+fn hash(sequence: u32) -> usize {
+    (sequence.wrapping_mul(2654435761) >> (32 - HASH_BITS)) as usize
+}
+
+fn write_length(dst: &mut [u8], out: &mut usize, mut len: usize) {
+    while len >= 255 {
+        dst[*out] = 255;
+        *out += 1;
+        len -= 255;
+    }
+    dst[*out] = len as u8;
+    *out += 1;
+}
+
+fn write_sequence(dst: &mut [u8], out: &mut usize, literals: &[u8], matched: Option<(usize, usize)>) {
+    let token = *out;
+    *out += 1;
+
+    let mut token_value = (cmp::min(literals.len(), 15) as u8) << 4;
+    if literals.len() >= 15 {
+        write_length(dst, out, literals.len() - 15);
+    }
+    dst[*out..*out + literals.len()].copy_from_slice(literals);
+    *out += literals.len();
+
+    if let Some((offset, len)) = matched {
+        dst[*out..*out + 2].copy_from_slice(&(offset as u16).to_le_bytes());
+        *out += 2;
+        let len = len - MIN_MATCH;
+        token_value |= cmp::min(len, 15) as u8;
+        if len >= 15 {
+            write_length(dst, out, len - 15);
+        }
+    }
+    dst[token] = token_value;
+}
+
+/// Compress `src` into `dst`, which must hold at least `compress_bound(src.len())` bytes.
+/// `table` is scratch space of 1 << HASH_BITS entries. Returns the compressed length.
+pub fn compress(src: &[u8], dst: &mut [u8], table: &mut [u32]) -> usize {
+    for entry in table.iter_mut() {
+        *entry = 0;
+    }
+
+    let mut out = 0;
+    let mut anchor = 0;
+    let mut i = 0;
+    while i + MF_LIMIT <= src.len() {
+        let sequence = read_u32(src, i);
+        let slot = hash(sequence);
+        // Positions are stored plus one, so 0 means empty
+        let candidate = table[slot] as usize;
+        table[slot] = i as u32 + 1;
+
+        if candidate == 0 || i - (candidate - 1) > MAX_OFFSET || read_u32(src, candidate - 1) != sequence {
+            // Step faster the longer nothing has matched
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        let mut start = i;
+        let mut from = candidate - 1;
+        while start > anchor && from > 0 && src[start - 1] == src[from - 1] {
+            start -= 1;
+            from -= 1;
+        }
+
+        let known = MIN_MATCH + (i - start);
+        let len = known + common_length(src, from + known, start + known, src.len() - LAST_LITERALS);
+
+        write_sequence(dst, &mut out, &src[anchor..start], Some((start - from, len)));
+        i = start + len;
+        anchor = i;
+    }
+
+    write_sequence(dst, &mut out, &src[anchor..], None);
+    out
+}
+
+fn read_length(src: &[u8], i: &mut usize, mut len: usize) -> Result<usize, ()> {
+    loop {
+        let byte = *try!(src.get(*i).ok_or(()));
+        *i += 1;
+        len += byte as usize;
+        if byte != 255 {
+            return Ok(len);
+        }
+    }
+}
+
+/// Decompress `src` into `dst`, which must be exactly the size of the original
+pub fn decompress(src: &[u8], dst: &mut [u8]) -> Result<(), ()> {
+    let mut i = 0;
+    let mut out = 0;
+    loop {
+        let token = *try!(src.get(i).ok_or(()));
+        i += 1;
+
+        let mut literals = (token >> 4) as usize;
+        if literals == 15 {
+            literals = try!(read_length(src, &mut i, literals));
+        }
+        if literals > src.len() - i || literals > dst.len() - out {
+            return Err(());
+        }
+        if literals <= 16 && src.len() - i >= 16 && dst.len() - out >= 16 {
+            // A fixed-size copy is much cheaper than an exact one; what it writes past the
+            // literals is overwritten by what comes next
+            dst[out..out + 16].copy_from_slice(&src[i..i + 16]);
+        } else {
+            dst[out..out + literals].copy_from_slice(&src[i..i + literals]);
+        }
+        i += literals;
+        out += literals;
+
+        // The last sequence is literals only
+        if i == src.len() {
+            return if out == dst.len() { Ok(()) } else { Err(()) };
+        }
+
+        if src.len() - i < 2 {
+            return Err(());
+        }
+        let offset = src[i] as usize | (src[i + 1] as usize) << 8;
+        i += 2;
+        if offset == 0 || offset > out {
+            return Err(());
+        }
+
+        let mut len = (token & 15) as usize;
+        if len == 15 {
+            len = try!(read_length(src, &mut i, len));
+        }
+        len += MIN_MATCH;
+        if len > dst.len() - out {
+            return Err(());
+        }
+
+        // The match may overlap what it is writing, so copy at most what already exists each
+        // time; that doubles with every pass
+        let start = out - offset;
+        let end = out + len;
+        if len <= 16 && offset >= 16 && dst.len() - out >= 16 {
+            dst.copy_within(start..start + 16, out);
+            out = end;
+            continue;
+        }
+        while out < end {
+            let chunk = cmp::min(end - out, out - start);
+            dst.copy_within(start..start + chunk, out);
+            out += chunk;
+        }
+    }
+}
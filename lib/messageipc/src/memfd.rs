@@ -0,0 +1,150 @@
+//! Shared-memory messages: a sealed memfd passed over a socket, which the receiver maps
+//! instead of having its bytes copied through the connection. Linux only.
+//!
+//! The sender fills a SharedBuffer, a writable mapping of a fresh memfd. Sending it unmaps it
+//! and seals the memfd against writes and resizing, so the receiver can map it read-only
+//! knowing it will neither change nor shrink underneath it.
+
+use std::fs::File;
+use std::io;
+use std::ops::{Deref, DerefMut};
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::{ptr, slice, usize};
+
+use libc;
+
+use pool::Buffer;
+
+const SEALS: libc::c_int = libc::F_SEAL_SEAL | libc::F_SEAL_SHRINK | libc::F_SEAL_GROW | libc::F_SEAL_WRITE;
+// What the receiver needs before it can trust the mapping
+const REQUIRED_SEALS: libc::c_int = libc::F_SEAL_SHRINK | libc::F_SEAL_WRITE;
+
+fn page_size() -> usize {
+    unsafe { libc::sysconf(libc::_SC_PAGESIZE) as usize }
+}
+
+fn invalid_data(message: &'static str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message)
+}
+
+/// A message being written straight into memory that will be handed to the peer
+pub struct SharedBuffer {
+    file: Option<File>,
+    data: *mut u8,
+    len: usize,
+}
+
+unsafe impl Send for SharedBuffer {}
+
+impl SharedBuffer {
+    pub fn new(len: usize) -> io::Result<SharedBuffer> {
+        let fd = unsafe {
+            libc::syscall(libc::SYS_memfd_create, b"messageipc\0".as_ptr(),
+                          libc::MFD_CLOEXEC | libc::MFD_ALLOW_SEALING)
+        };
+        if fd == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        let file = unsafe { File::from_raw_fd(fd as libc::c_int) };
+        try!(file.set_len(len as u64));
+
+        let mut buffer = SharedBuffer { file: Some(file), data: ptr::null_mut(), len: len };
+        if len > 0 {
+            let data = unsafe {
+                libc::mmap(ptr::null_mut(), len, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED,
+                           fd as libc::c_int, 0)
+            };
+            if data == libc::MAP_FAILED {
+                return Err(io::Error::last_os_error());
+            }
+            buffer.data = data as *mut u8;
+        }
+        Ok(buffer)
+    }
+
+    /// Give up the mapping and seal the memfd, ready to send
+    pub(crate) fn seal(mut self) -> (File, usize) {
+        self.unmap();
+        let file = self.file.take().unwrap();
+        // Only fails while a writable mapping exists, and ours was the only one
+        unsafe { libc::fcntl(file.as_raw_fd(), libc::F_ADD_SEALS, SEALS) };
+        (file, self.len)
+    }
+
+    fn unmap(&mut self) {
+        if !self.data.is_null() {
+            unsafe { libc::munmap(self.data as *mut libc::c_void, self.len) };
+            self.data = ptr::null_mut();
+        }
+    }
+}
+
+impl Deref for SharedBuffer {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        if self.data.is_null() {
+            return &[];
+        }
+        unsafe { slice::from_raw_parts(self.data, self.len) }
+    }
+}
+
+impl DerefMut for SharedBuffer {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        if self.data.is_null() {
+            return &mut [];
+        }
+        unsafe { slice::from_raw_parts_mut(self.data, self.len) }
+    }
+}
+
+impl Drop for SharedBuffer {
+    fn drop(&mut self) {
+        self.unmap();
+    }
+}
+
+/// Map the first `len` bytes of a memfd the peer sent, read-only. The page in front of the
+/// mapping holds the buffer's header.
+pub fn map(file: File, len: u64) -> io::Result<Buffer> {
+    let seals = unsafe { libc::fcntl(file.as_raw_fd(), libc::F_GET_SEALS) };
+    if seals == -1 || seals & REQUIRED_SEALS != REQUIRED_SEALS {
+        return Err(invalid_data("shared-memory message isn't sealed"));
+    }
+    if try!(file.metadata()).len() < len {
+        return Err(invalid_data("shared-memory message is shorter than it claims"));
+    }
+
+    let page = page_size();
+    if len > (usize::MAX - page) as u64 {
+        return Err(invalid_data("shared-memory message is too big to map"));
+    }
+    let len = len as usize;
+
+    unsafe {
+        let base = libc::mmap(ptr::null_mut(), page + len, libc::PROT_READ | libc::PROT_WRITE,
+                              libc::MAP_PRIVATE | libc::MAP_ANONYMOUS, -1, 0);
+        if base == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        let data = (base as *mut u8).offset(page as isize);
+        if len > 0 {
+            let mapped = libc::mmap(data as *mut libc::c_void, len, libc::PROT_READ,
+                                    libc::MAP_SHARED | libc::MAP_FIXED, file.as_raw_fd(), 0);
+            if mapped == libc::MAP_FAILED {
+                let err = io::Error::last_os_error();
+                libc::munmap(base, page + len);
+                return Err(err);
+            }
+        }
+        // The mapping keeps the memory alive once the descriptor is closed
+        Ok(Buffer::mapped(data, len))
+    }
+}
+
+/// Undo `map`, given the buffer's data pointer and length
+pub unsafe fn unmap(data: *mut u8, len: usize) {
+    let page = page_size();
+    libc::munmap(data.offset(-(page as isize)) as *mut libc::c_void, page + len);
+}
@@ -0,0 +1,112 @@
+//! A file descriptor that polls readable while a queue is ready, so an IpcClient can sit in
+//! an application's own epoll/poll/select loop next to its sockets and timers. SpaceFd does the
+//! same for a send queue having room.
+
+use std::io;
+use std::os::unix::io::RawFd;
+
+use libc;
+
+use queue::Watcher;
+
+pub struct ReadyFd {
+    read_fd: RawFd,
+    write_fd: RawFd,
+}
+
+impl ReadyFd {
+    #[cfg(target_os = "linux")]
+    pub fn new() -> io::Result<ReadyFd> {
+        let fd = unsafe { libc::eventfd(0, libc::EFD_CLOEXEC | libc::EFD_NONBLOCK) };
+        if fd == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(ReadyFd { read_fd: fd, write_fd: fd })
+    }
+
+    // Everywhere else a non-blocking self-pipe does the same job
+    #[cfg(not(target_os = "linux"))]
+    pub fn new() -> io::Result<ReadyFd> {
+        let mut fds = [0; 2];
+        if unsafe { libc::pipe(fds.as_mut_ptr()) } == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        for &fd in &fds {
+            unsafe {
+                libc::fcntl(fd, libc::F_SETFD, libc::FD_CLOEXEC);
+                libc::fcntl(fd, libc::F_SETFL, libc::fcntl(fd, libc::F_GETFL) | libc::O_NONBLOCK);
+            }
+        }
+        Ok(ReadyFd { read_fd: fds[0], write_fd: fds[1] })
+    }
+
+    pub fn fd(&self) -> RawFd {
+        self.read_fd
+    }
+
+    pub fn set(&self) {
+        let one = 1u64;
+        unsafe { libc::write(self.write_fd, &one as *const u64 as *const libc::c_void, 8) };
+    }
+
+    pub fn clear(&self) {
+        let mut buf = [0u64; 4];
+        loop {
+            let n = unsafe { libc::read(self.read_fd, buf.as_mut_ptr() as *mut libc::c_void, 32) };
+            // An eventfd is reset by a single read; a pipe is drained until it would block
+            if n <= 0 || self.read_fd == self.write_fd {
+                break;
+            }
+        }
+    }
+}
+
+impl Watcher for ReadyFd {
+    fn ready(&self) {
+        self.set();
+    }
+
+    fn drained(&self) {
+        self.clear();
+    }
+}
+
+impl Drop for ReadyFd {
+    fn drop(&mut self) {
+        unsafe {
+            libc::close(self.read_fd);
+            if self.write_fd != self.read_fd {
+                libc::close(self.write_fd);
+            }
+        }
+    }
+}
+
+/// Polls readable while a queue is under its high watermark, and once it is closed
+pub struct SpaceFd(ReadyFd);
+
+impl SpaceFd {
+    pub fn new() -> io::Result<SpaceFd> {
+        let fd = try!(ReadyFd::new());
+        fd.set();
+        Ok(SpaceFd(fd))
+    }
+
+    pub fn fd(&self) -> RawFd {
+        self.0.fd()
+    }
+}
+
+impl Watcher for SpaceFd {
+    fn ready(&self) {}
+
+    fn drained(&self) {}
+
+    fn space(&self) {
+        self.0.set();
+    }
+
+    fn full(&self) {
+        self.0.clear();
+    }
+}
@@ -0,0 +1,63 @@
+use std::time::Duration;
+
+use queue::Limits;
+
+/// Move messages through a pair of named pipes (FIFOs on unix).
+pub const TRANSPORT_PIPE: u32 = 0;
+/// Move messages through a shared-memory ring per direction. Linux only.
+pub const TRANSPORT_SHM: u32 = 1;
+/// Move messages through a SOCK_SEQPACKET Unix domain socket. This is also what IpcServer
+/// listens on, so it is the transport to use for connecting to one. Unix only.
+pub const TRANSPORT_SOCKET: u32 = 2;
+
+/// A reader and a writer thread per connection.
+pub const IO_THREADS: u32 = 0;
+/// One background thread services every reactor connection in the process. Linux only,
+/// pipe transport only.
+pub const IO_REACTOR: u32 = 1;
+/// Like IO_REACTOR, but nothing moves until the application calls `mipc_reactor_poll`.
+pub const IO_MANUAL: u32 = 2;
+
+/// Options chosen when a connection is opened. Mirrors `IpcOptions` in messageipc.h,
+/// so fields may only ever be appended. A zeroed struct means "use the defaults".
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default)]
+pub struct Options {
+    pub transport: u32,
+    /// Bytes of ring buffer per direction for TRANSPORT_SHM, and in a broadcast channel's
+    /// ring. Rounded up to a power of two; 0 picks a default.
+    pub ring_size: u32,
+    /// Who does the I/O for the connection, one of the IO_ constants
+    pub io_mode: u32,
+    /// Once either queue holds this many messages or bytes, sends fail with WouldBlock (or
+    /// wait) and no more is read from the peer, until it drains to the low watermarks.
+    /// 0 means unbounded.
+    pub high_water_messages: u32,
+    pub high_water_bytes: u32,
+    /// 0 means half the high watermark
+    pub low_water_messages: u32,
+    pub low_water_bytes: u32,
+    /// Compress messages at least this many bytes long with LZ4, if the peer can decompress
+    /// them. 0 never compresses. Each end decides for what it sends.
+    pub compress_threshold: u32,
+    /// Microseconds a receiver busy-polls for the next message before it parks, adapting
+    /// downwards while spinning doesn't pay off. 0 never spins. Best paired with
+    /// TRANSPORT_SHM, whose reader then spins on the ring too and whose writer then never
+    /// has to wake it. Off on single-CPU machines.
+    pub spin_us: u32,
+}
+
+impl Options {
+    pub(crate) fn queue_limits(&self) -> Limits {
+        Limits {
+            high_messages: self.high_water_messages as usize,
+            high_bytes: self.high_water_bytes as usize,
+            low_messages: self.low_water_messages as usize,
+            low_bytes: self.low_water_bytes as usize,
+        }
+    }
+
+    pub(crate) fn spin(&self) -> Duration {
+        Duration::from_micros(self.spin_us as u64)
+    }
+}
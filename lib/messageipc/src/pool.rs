@@ -0,0 +1,229 @@
+//! Size-classed pool of message buffers.
+//!
+//! Every buffer is allocated with a small header in front of the bytes handed out, which
+//! remembers the pool it came from and its capacity. That lets `mipc_recv_free` return a
+//! buffer to the right pool given nothing but the data pointer, and keeps the hot path free
+//! of heap allocation (and zero-filling) once the pool has warmed up.
+//!
+//! A buffer can also stand for a mapping of someone else's memory (see memfd.rs), in which
+//! case the header lives at the end of a page of its own just in front of the mapping.
+
+use std::alloc::{self, Layout};
+use std::ops::{Deref, DerefMut};
+use std::sync::{Arc, Mutex};
+use std::{cmp, mem, ptr, slice};
+
+const HEADER: usize = 16;
+const ALIGN: usize = 16;
+
+const MIN_CLASS_SHIFT: usize = 6; // 64 bytes
+const MAX_CLASS_SHIFT: usize = 22; // 4 MiB
+const CLASSES: usize = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+
+// How many bytes of idle buffers each size class may hold on to
+const CLASS_BUDGET: usize = 4 << 20;
+const MAX_IDLE: usize = 64;
+
+#[repr(C)]
+struct Header {
+    pool: *const Pool,
+    capacity: usize,
+}
+
+// The pool pointer of a buffer that is a mapping rather than a pool block
+#[cfg(target_os = "linux")]
+const MAPPED: *const Pool = 1 as *const Pool;
+
+struct Block(*mut u8);
+unsafe impl Send for Block {}
+
+fn class_of(len: usize) -> Option<usize> {
+    let shift = cmp::max(len.next_power_of_two().trailing_zeros() as usize, MIN_CLASS_SHIFT);
+    if shift > MAX_CLASS_SHIFT {
+        None
+    } else {
+        Some(shift - MIN_CLASS_SHIFT)
+    }
+}
+
+fn class_size(class: usize) -> usize {
+    1 << (class + MIN_CLASS_SHIFT)
+}
+
+fn max_idle(class: usize) -> usize {
+    cmp::min(cmp::max(CLASS_BUDGET / class_size(class), 1), MAX_IDLE)
+}
+
+fn layout(capacity: usize) -> Layout {
+    Layout::from_size_align(HEADER + capacity, ALIGN).unwrap()
+}
+
+fn allocate(capacity: usize) -> *mut u8 {
+    // Zeroed once when the block is created so it never holds uninitialized bytes;
+    // recycled blocks are handed out as-is.
+    let layout = layout(capacity);
+    let block = unsafe { alloc::alloc_zeroed(layout) };
+    if block.is_null() {
+        alloc::handle_alloc_error(layout);
+    }
+    block
+}
+
+pub struct Pool {
+    classes: Vec<Mutex<Vec<Block>>>,
+}
+
+impl Pool {
+    pub fn new() -> Arc<Pool> {
+        Arc::new(Pool {
+            classes: (0..CLASSES).map(|_| Mutex::new(Vec::new())).collect(),
+        })
+    }
+
+    /// Get a buffer of exactly `len` bytes. The contents are unspecified.
+    pub fn get(pool: &Arc<Pool>, len: usize) -> Buffer {
+        let (block, capacity, owner) = match class_of(len) {
+            Some(class) => {
+                let idle = pool.classes[class].lock().unwrap().pop();
+                let block = match idle {
+                    Some(Block(block)) => block,
+                    None => allocate(class_size(class)),
+                };
+                let owner = Arc::into_raw(pool.clone());
+                (block, class_size(class), owner)
+            }
+            // Too big to be worth keeping around
+            None => (allocate(len), len, ptr::null()),
+        };
+
+        unsafe {
+            ptr::write(block as *mut Header, Header { pool: owner, capacity: capacity });
+            Buffer { data: block.offset(HEADER as isize), len: len }
+        }
+    }
+
+    /// Get a buffer holding a copy of `data`
+    pub fn copy(pool: &Arc<Pool>, data: &[u8]) -> Buffer {
+        let mut buffer = Pool::get(pool, data.len());
+        buffer.copy_from_slice(data);
+        buffer
+    }
+
+    /// Get a buffer holding every part of `parts`, one after another
+    pub fn gather(pool: &Arc<Pool>, parts: &[&[u8]]) -> Buffer {
+        let len = parts.iter().map(|part| part.len()).sum();
+        let mut buffer = Pool::get(pool, len);
+        let mut offset = 0;
+        for part in parts {
+            buffer[offset..offset + part.len()].copy_from_slice(part);
+            offset += part.len();
+        }
+        buffer
+    }
+
+    fn put(&self, block: *mut u8, capacity: usize) {
+        if let Some(class) = class_of(capacity) {
+            let mut idle = self.classes[class].lock().unwrap();
+            if idle.len() < max_idle(class) {
+                idle.push(Block(block));
+                return;
+            }
+        }
+        unsafe { alloc::dealloc(block, layout(capacity)) };
+    }
+}
+
+impl Drop for Pool {
+    fn drop(&mut self) {
+        for (class, idle) in self.classes.iter_mut().enumerate() {
+            for Block(block) in idle.get_mut().unwrap().drain(..) {
+                unsafe { alloc::dealloc(block, layout(class_size(class))) };
+            }
+        }
+    }
+}
+
+/// A message buffer which goes back to its pool when dropped
+pub struct Buffer {
+    data: *mut u8,
+    len: usize,
+}
+
+unsafe impl Send for Buffer {}
+
+impl Buffer {
+    pub fn capacity(&self) -> usize {
+        self.header().capacity
+    }
+
+    /// What the buffer counts for against a queue's byte watermarks
+    pub(crate) fn weight(&self) -> usize {
+        self.len
+    }
+
+    /// Drop everything past `len`, keeping the capacity
+    pub(crate) fn truncate(&mut self, len: usize) {
+        self.len = cmp::min(self.len, len);
+    }
+
+    /// Hand the bytes over to C. Give them back with `from_raw` to release them.
+    pub fn into_raw(self) -> (*mut u8, usize) {
+        let raw = (self.data, self.len);
+        mem::forget(self);
+        raw
+    }
+
+    pub unsafe fn from_raw(data: *mut u8, len: usize) -> Buffer {
+        Buffer { data: data, len: len }
+    }
+
+    /// Wrap `len` bytes mapped at `data`, which must have HEADER writable bytes in front of
+    /// it. Dropping the buffer unmaps it with `memfd::unmap`.
+    #[cfg(target_os = "linux")]
+    pub(crate) unsafe fn mapped(data: *mut u8, len: usize) -> Buffer {
+        ptr::write(data.offset(-(HEADER as isize)) as *mut Header, Header { pool: MAPPED, capacity: len });
+        Buffer { data: data, len: len }
+    }
+
+    fn header(&self) -> &Header {
+        unsafe { &*(self.data.offset(-(HEADER as isize)) as *const Header) }
+    }
+}
+
+impl Deref for Buffer {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.data, self.len) }
+    }
+}
+
+impl DerefMut for Buffer {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        unsafe { slice::from_raw_parts_mut(self.data, self.len) }
+    }
+}
+
+impl Drop for Buffer {
+    fn drop(&mut self) {
+        let (pool, capacity) = {
+            let header = self.header();
+            (header.pool, header.capacity)
+        };
+
+        #[cfg(target_os = "linux")]
+        {
+            if pool == MAPPED {
+                return unsafe { ::memfd::unmap(self.data, capacity) };
+            }
+        }
+
+        let block = unsafe { self.data.offset(-(HEADER as isize)) };
+        if pool.is_null() {
+            unsafe { alloc::dealloc(block, layout(capacity)) };
+        } else {
+            let pool = unsafe { Arc::from_raw(pool) };
+            pool.put(block, capacity);
+        }
+    }
+}
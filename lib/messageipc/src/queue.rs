@@ -0,0 +1,574 @@
+//! The queues between an IpcClient and its I/O threads.
+//!
+//! Unlike `std::sync::mpsc`, a whole batch can be pushed or drained under one lock, and
+//! the condvar is only signalled when somebody is actually waiting on it. Other things that
+//! want to know when a queue has something in it (a pollable fd, for one) register a Watcher.
+//! A Signal is a watcher one thread can wait on for any of several queues to become ready.
+//!
+//! A queue can also be bounded. Pushing never fails because of the bounds; instead producers
+//! call `wait_space` first, which holds them back from the moment the queue reaches a high
+//! watermark until it has drained to the low one.
+//!
+//! Urgent items go in ahead of everything that isn't urgent, behind any other urgent items.
+//!
+//! A queue made with a spin budget has consumers busy-poll for it to become ready before they
+//! block on the condvar, which spares the producer the wakeup as well.
+
+use std::cmp;
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard};
+use std::time::{Duration, Instant};
+
+use spin::Spin;
+
+/// Told when a queue becomes ready (it has items or was closed) and when it stops being ready.
+/// The calls always alternate, starting with `ready`. They are made with the queue locked,
+/// so they have to be quick and must not touch the queue.
+pub trait Watcher: Send + Sync {
+    fn ready(&self);
+    fn drained(&self);
+
+    /// A full queue drained to its low watermark
+    fn space(&self) {}
+
+    /// The queue reached its high watermark
+    fn full(&self) {}
+}
+
+/// Watermarks for a bounded queue. A high watermark of 0 means no limit on that count, and a
+/// low watermark of 0 means half the high one.
+#[derive(Copy, Clone, Debug, Default)]
+pub struct Limits {
+    pub high_messages: usize,
+    pub high_bytes: usize,
+    pub low_messages: usize,
+    pub low_bytes: usize,
+}
+
+impl Limits {
+    fn resolve(mut self) -> Limits {
+        if self.low_messages == 0 || self.low_messages > self.high_messages {
+            self.low_messages = self.high_messages / 2;
+        }
+        if self.low_bytes == 0 || self.low_bytes > self.high_bytes {
+            self.low_bytes = self.high_bytes / 2;
+        }
+        self
+    }
+}
+
+/// Why `recv_into` didn't receive a message
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum RecvError {
+    /// Nothing arrived in time
+    Empty,
+    Disconnected,
+    /// The next message needs a buffer this big. It is still queued.
+    TooSmall(usize),
+    /// A broadcast subscriber fell behind and this many messages were overwritten before it
+    /// read them
+    Lagged(u64),
+}
+
+/// Why a message couldn't be sent
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum SendError {
+    /// The send queue is full. Nothing was queued.
+    WouldBlock,
+    Disconnected,
+    /// The message is longer than `MAX_MESSAGE` bytes
+    TooLarge,
+}
+
+/// How much a queue holds now, and the most it has ever held
+#[derive(Copy, Clone, Debug, Default)]
+pub struct Depth {
+    pub messages: usize,
+    pub bytes: usize,
+    pub peak_messages: usize,
+    pub peak_bytes: usize,
+}
+
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum Space {
+    Available,
+    Full,
+    Closed,
+}
+
+struct State<T> {
+    items: VecDeque<T>,
+    // How many items at the front were pushed as urgent
+    urgent: usize,
+    bytes: usize,
+    peak_items: usize,
+    peak_bytes: usize,
+    closed: bool,
+    full: bool,
+    waiting: usize,
+    waiting_space: usize,
+    watchers: Vec<Arc<dyn Watcher>>,
+    signalled: bool,
+}
+
+impl<T> State<T> {
+    fn over_high(&self, limits: &Limits) -> bool {
+        (limits.high_messages != 0 && self.items.len() >= limits.high_messages) ||
+            (limits.high_bytes != 0 && self.bytes >= limits.high_bytes)
+    }
+
+    fn under_low(&self, limits: &Limits) -> bool {
+        (limits.high_messages == 0 || self.items.len() <= limits.low_messages) &&
+            (limits.high_bytes == 0 || self.bytes <= limits.low_bytes)
+    }
+
+    fn popped(&mut self, count: usize) {
+        self.urgent -= cmp::min(self.urgent, count);
+    }
+
+    fn update_watchers(&mut self) {
+        let ready = self.closed || !self.items.is_empty();
+        if ready != self.signalled {
+            self.signalled = ready;
+            for watcher in &self.watchers {
+                if ready {
+                    watcher.ready();
+                } else {
+                    watcher.drained();
+                }
+            }
+        }
+    }
+}
+
+pub struct Queue<T> {
+    state: Mutex<State<T>>,
+    ready: Condvar,
+    space: Condvar,
+    limits: Limits,
+    weigh: fn(&T) -> usize,
+    spin: Spin,
+    // Whether the queue has items or is closed, readable without the lock while spinning
+    is_ready: AtomicBool,
+}
+
+impl<T> Queue<T> {
+    /// A queue bounded by `limits`, where `weigh` says how many bytes an item counts for.
+    /// Default limits leave it unbounded. Consumers spin for up to `spin` before they block.
+    pub fn spinning(limits: Limits, weigh: fn(&T) -> usize, spin: Duration) -> Arc<Queue<T>> {
+        Arc::new(Queue {
+            state: Mutex::new(State {
+                items: VecDeque::new(),
+                urgent: 0,
+                bytes: 0,
+                peak_items: 0,
+                peak_bytes: 0,
+                closed: false,
+                full: false,
+                waiting: 0,
+                waiting_space: 0,
+                watchers: Vec::new(),
+                signalled: false,
+            }),
+            ready: Condvar::new(),
+            space: Condvar::new(),
+            limits: limits.resolve(),
+            weigh: weigh,
+            spin: Spin::new(spin),
+            is_ready: AtomicBool::new(false),
+        })
+    }
+
+    fn update_ready(&self, state: &mut State<T>) {
+        state.update_watchers();
+        self.is_ready.store(state.signalled, Ordering::Release);
+    }
+
+    // Busy-poll for the queue to become ready, for no longer than the spin budget or `timeout`
+    fn spin_until_ready(&self, timeout: Option<Duration>) {
+        if !self.is_ready.load(Ordering::Acquire) {
+            self.spin.wait(timeout, || self.is_ready.load(Ordering::Acquire));
+        }
+    }
+
+    fn after_push(&self, state: &mut State<T>) {
+        if state.items.len() > state.peak_items {
+            state.peak_items = state.items.len();
+        }
+        if state.bytes > state.peak_bytes {
+            state.peak_bytes = state.bytes;
+        }
+        if !state.full && state.over_high(&self.limits) {
+            state.full = true;
+            for watcher in &state.watchers {
+                watcher.full();
+            }
+        }
+        self.update_ready(state);
+    }
+
+    fn after_pop(&self, state: &mut State<T>) {
+        if state.full && state.under_low(&self.limits) {
+            state.full = false;
+            if state.waiting_space != 0 {
+                self.space.notify_all();
+            }
+            for watcher in &state.watchers {
+                watcher.space();
+            }
+        }
+        self.update_ready(state);
+    }
+
+    /// Wait up to `timeout` (forever if None) for a full queue to drain to its low watermark.
+    /// A queue that isn't full has space straight away.
+    pub fn wait_space(&self, timeout: Option<Duration>) -> Space {
+        let deadline = timeout.map(|timeout| Instant::now() + timeout);
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if state.closed {
+                return Space::Closed;
+            }
+            if !state.full {
+                return Space::Available;
+            }
+
+            state.waiting_space += 1;
+            state = match deadline {
+                None => self.space.wait(state).unwrap(),
+                Some(deadline) => {
+                    let now = Instant::now();
+                    if now >= deadline {
+                        state.waiting_space -= 1;
+                        return Space::Full;
+                    }
+                    self.space.wait_timeout(state, deadline - now).unwrap().0
+                }
+            };
+            state.waiting_space -= 1;
+        }
+    }
+
+    pub fn is_full(&self) -> bool {
+        self.state.lock().unwrap().full
+    }
+
+    /// Returns false if the queue has been closed
+    pub fn push(&self, item: T) -> bool {
+        let mut state = self.state.lock().unwrap();
+        if state.closed {
+            return false;
+        }
+        state.bytes += (self.weigh)(&item);
+        state.items.push_back(item);
+        if state.waiting != 0 {
+            self.ready.notify_one();
+        }
+        self.after_push(&mut state);
+        true
+    }
+
+    /// Push every item at once, so a consumer never sees only part of the batch.
+    /// Returns false if the queue has been closed.
+    pub fn push_all<I: IntoIterator<Item = T>>(&self, items: I) -> bool {
+        let mut state = self.state.lock().unwrap();
+        if state.closed {
+            return false;
+        }
+        for item in items {
+            state.bytes += (self.weigh)(&item);
+            state.items.push_back(item);
+        }
+        if state.waiting != 0 {
+            self.ready.notify_all();
+        }
+        self.after_push(&mut state);
+        true
+    }
+
+    /// Push ahead of every item that isn't urgent, regardless of the bounds. Returns false if
+    /// the queue has been closed.
+    pub fn push_urgent(&self, item: T) -> bool {
+        self.push_urgent_all(Some(item))
+    }
+
+    /// Push every item as urgent at once, keeping their order. Returns false if the queue has
+    /// been closed.
+    pub fn push_urgent_all<I: IntoIterator<Item = T>>(&self, items: I) -> bool {
+        let mut state = self.state.lock().unwrap();
+        if state.closed {
+            return false;
+        }
+        for item in items {
+            state.bytes += (self.weigh)(&item);
+            let at = state.urgent;
+            state.items.insert(at, item);
+            state.urgent += 1;
+        }
+        if state.waiting != 0 {
+            self.ready.notify_all();
+        }
+        self.after_push(&mut state);
+        true
+    }
+
+    /// Block until an item is available. Returns None once the queue is closed and empty.
+    pub fn pop(&self) -> Option<T> {
+        self.spin_until_ready(None);
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if let Some(item) = state.items.pop_front() {
+                state.bytes -= (self.weigh)(&item);
+                state.popped(1);
+                self.after_pop(&mut state);
+                return Some(item);
+            }
+            if state.closed {
+                return None;
+            }
+            state.waiting += 1;
+            state = self.ready.wait(state).unwrap();
+            state.waiting -= 1;
+        }
+    }
+
+    /// Returns None if the queue is closed and empty, Some(None) if it is just empty
+    pub fn try_pop(&self) -> Option<Option<T>> {
+        let mut state = self.state.lock().unwrap();
+        match state.items.pop_front() {
+            Some(item) => {
+                state.bytes -= (self.weigh)(&item);
+                state.popped(1);
+                self.after_pop(&mut state);
+                Some(Some(item))
+            }
+            None if state.closed => None,
+            None => Some(None),
+        }
+    }
+
+    // Lock the queue once it has items, is closed, or `timeout` (forever if None) runs out
+    fn lock_when_ready<'a>(&'a self, timeout: Option<Duration>) -> MutexGuard<'a, State<T>> {
+        self.spin_until_ready(timeout);
+        let deadline = timeout.map(|timeout| Instant::now() + timeout);
+        let mut state = self.state.lock().unwrap();
+        while state.items.is_empty() && !state.closed {
+            let now = Instant::now();
+            if deadline.map_or(false, |deadline| now >= deadline) {
+                break;
+            }
+
+            state.waiting += 1;
+            state = match deadline {
+                None => self.ready.wait(state).unwrap(),
+                Some(deadline) => self.ready.wait_timeout(state, deadline - now).unwrap().0,
+            };
+            state.waiting -= 1;
+        }
+        state
+    }
+
+    /// Wait up to `timeout` (forever if None) for an item, then hand up to `max` items to `f`
+    /// under a single lock. Returns how many were handed over, or None if the queue is
+    /// closed and empty.
+    pub fn pop_many<F: FnMut(T)>(&self, max: usize, timeout: Option<Duration>, mut f: F) -> Option<usize> {
+        let mut state = self.lock_when_ready(timeout);
+        if state.items.is_empty() {
+            return if state.closed { None } else { Some(0) };
+        }
+
+        let count = if state.items.len() < max { state.items.len() } else { max };
+        let state = &mut *state;
+        for item in state.items.drain(..count) {
+            state.bytes -= (self.weigh)(&item);
+            f(item);
+        }
+        state.popped(count);
+        self.after_pop(state);
+        Some(count)
+    }
+
+    /// Hand just the urgent items to `f`, without waiting. Returns how many there were.
+    pub fn pop_urgent<F: FnMut(T)>(&self, mut f: F) -> usize {
+        let mut state = self.state.lock().unwrap();
+        let count = state.urgent;
+        if count == 0 {
+            return 0;
+        }
+
+        let state = &mut *state;
+        for item in state.items.drain(..count) {
+            state.bytes -= (self.weigh)(&item);
+            f(item);
+        }
+        state.popped(count);
+        self.after_pop(state);
+        count
+    }
+
+    /// Wait up to `timeout` (forever if None) for an item, and pop it only if `take` accepts it.
+    /// Returns None if the queue is closed and empty, Some(None) if the wait timed out or the
+    /// item was left where it is.
+    pub fn pop_if<F: FnOnce(&T) -> bool>(&self, timeout: Option<Duration>, take: F) -> Option<Option<T>> {
+        let mut state = self.lock_when_ready(timeout);
+        if state.items.is_empty() {
+            return if state.closed { None } else { Some(None) };
+        }
+        if !take(&state.items[0]) {
+            return Some(None);
+        }
+
+        let item = state.items.pop_front().unwrap();
+        state.bytes -= (self.weigh)(&item);
+        state.popped(1);
+        self.after_pop(&mut state);
+        Some(Some(item))
+    }
+
+    /// Refuse any more pushes. Items already queued can still be popped.
+    pub fn close(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.closed = true;
+        self.ready.notify_all();
+        self.space.notify_all();
+        // Whoever is held back by the bounds needs to find out about the close
+        if state.full {
+            state.full = false;
+            for watcher in &state.watchers {
+                watcher.space();
+            }
+        }
+        self.update_ready(&mut state);
+    }
+
+    pub fn depth(&self) -> Depth {
+        let state = self.state.lock().unwrap();
+        Depth {
+            messages: state.items.len(),
+            bytes: state.bytes,
+            peak_messages: state.peak_items,
+            peak_bytes: state.peak_bytes,
+        }
+    }
+
+    /// True once the queue is closed and everything in it has been popped
+    pub fn is_finished(&self) -> bool {
+        let state = self.state.lock().unwrap();
+        state.closed && state.items.is_empty()
+    }
+
+    /// Start telling `watcher` about this queue. If the queue is already ready or full it is
+    /// told so straight away.
+    pub fn watch(&self, watcher: Arc<dyn Watcher>) {
+        let mut state = self.state.lock().unwrap();
+        if state.signalled {
+            watcher.ready();
+        }
+        if state.full {
+            watcher.full();
+        }
+        state.watchers.push(watcher);
+    }
+
+    /// Stop telling `watcher` about this queue
+    pub fn unwatch(&self, watcher: &Arc<dyn Watcher>) {
+        let target = &**watcher as *const dyn Watcher as *const u8;
+        let mut state = self.state.lock().unwrap();
+        state.watchers.retain(|watcher| &**watcher as *const dyn Watcher as *const u8 != target);
+    }
+
+    /// Whether a pop would return straight away: the queue has items or is closed
+    pub fn is_ready(&self) -> bool {
+        self.is_ready.load(Ordering::Acquire)
+    }
+}
+
+/// Counts how often the queues it watches have become ready, so one thread can wait on all of
+/// them at once: note the count, look at the queues, then wait for the count to move.
+pub struct Signal {
+    generation: Mutex<u64>,
+    changed: Condvar,
+}
+
+impl Signal {
+    pub fn new() -> Arc<Signal> {
+        Arc::new(Signal {
+            generation: Mutex::new(0),
+            changed: Condvar::new(),
+        })
+    }
+
+    pub fn generation(&self) -> u64 {
+        *self.generation.lock().unwrap()
+    }
+
+    /// Wait for the count to move past `seen`, until `deadline` (forever if None). Returns
+    /// false if the deadline passed first.
+    pub fn wait(&self, seen: u64, deadline: Option<Instant>) -> bool {
+        let mut current = self.generation.lock().unwrap();
+        while *current == seen {
+            current = match deadline {
+                None => self.changed.wait(current).unwrap(),
+                Some(deadline) => {
+                    let now = Instant::now();
+                    if now >= deadline {
+                        return false;
+                    }
+                    self.changed.wait_timeout(current, deadline - now).unwrap().0
+                }
+            };
+        }
+        true
+    }
+}
+
+impl Watcher for Signal {
+    fn ready(&self) {
+        *self.generation.lock().unwrap() += 1;
+        self.changed.notify_all();
+    }
+
+    fn drained(&self) {}
+}
+
+/// Wait up to `timeout` (forever if None) for any of `queues` to be ready, and return the
+/// index of the first one that is. Returns None if none became ready in time.
+pub fn wait_any<T>(queues: &[&Queue<T>], timeout: Option<Duration>) -> Option<usize> {
+    if let Some(index) = queues.iter().position(|queue| queue.is_ready()) {
+        return Some(index);
+    }
+    if timeout == Some(Duration::from_secs(0)) {
+        return None;
+    }
+
+    let deadline = timeout.map(|timeout| Instant::now() + timeout);
+    let signal = Signal::new();
+    let watcher: Arc<dyn Watcher> = signal.clone();
+    for queue in queues {
+        queue.watch(watcher.clone());
+    }
+    let found = loop {
+        let seen = signal.generation();
+        if let Some(index) = queues.iter().position(|queue| queue.is_ready()) {
+            break Some(index);
+        }
+        if !signal.wait(seen, deadline) {
+            break None;
+        }
+    };
+    for queue in queues {
+        queue.unwatch(&watcher);
+    }
+    found
+}
+
+/// Closes the queue when dropped. An I/O thread holds one so that however it exits,
+/// the IpcClient on the other side of the queue sees the disconnect.
+pub struct CloseGuard<T>(pub Arc<Queue<T>>);
+
+impl<T> Drop for CloseGuard<T> {
+    fn drop(&mut self) {
+        self.0.close();
+    }
+}
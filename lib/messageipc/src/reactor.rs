@@ -0,0 +1,414 @@
+//! Reactor mode: an epoll loop services connections opened with IO_REACTOR or IO_MANUAL,
+//! instead of a reader and a writer thread per connection.
+//!
+//! The two modes get a reactor each, with its own epoll set. IO_REACTOR connections are
+//! polled by a single background thread which is started with the first of them. IO_MANUAL
+//! connections are polled by the application, either by calling `mipc_reactor_poll` from its
+//! own loop or by waiting on `mipc_reactor_fd` first, so the background thread never touches
+//! them and a poll never waits behind it.
+
+use std::fs::File;
+use std::io;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+use std::{mem, thread, usize};
+
+use libc;
+
+use frame::{Batch, Decoder, Encoder, Frame, Inbox, Session};
+use pool::Pool;
+use queue::{Queue, Watcher};
+
+const WAKE_TOKEN: u64 = !0;
+const MAX_EVENTS: usize = 64;
+
+// A busy connection gets this many reads per wakeup before the others get a turn
+const READS_PER_EVENT: usize = 16;
+
+pub struct Reactor {
+    epoll: RawFd,
+    wake: RawFd,
+    incoming: Mutex<Vec<Conn>>,
+    ready: Mutex<Vec<usize>>,
+    resume: Mutex<Vec<usize>>,
+    core: Mutex<Core>,
+}
+
+struct Core {
+    conns: Vec<Option<Conn>>,
+    free: Vec<usize>,
+    events: Vec<libc::epoll_event>,
+    ready: Vec<usize>,
+}
+
+struct Conn {
+    reader: Option<File>,
+    // Reading stops while the receive queue is full
+    paused: bool,
+    writer: Option<File>,
+    decoder: Decoder,
+    encoder: Encoder,
+    batch: Batch,
+    send: Arc<Queue<Frame>>,
+    inbox: Inbox,
+    pool: Arc<Pool>,
+}
+
+// Queues a connection for flushing when its send queue stops being empty
+struct SendWatcher {
+    reactor: &'static Reactor,
+    index: usize,
+}
+
+impl Watcher for SendWatcher {
+    fn ready(&self) {
+        self.reactor.ready.lock().unwrap().push(self.index);
+        self.reactor.wake();
+    }
+
+    fn drained(&self) {}
+}
+
+// Queues a paused connection to start reading again once a receive queue has room
+struct RecvWatcher {
+    reactor: &'static Reactor,
+    index: usize,
+}
+
+impl Watcher for RecvWatcher {
+    fn ready(&self) {}
+
+    fn drained(&self) {}
+
+    fn space(&self) {
+        self.reactor.resume.lock().unwrap().push(self.index);
+        self.reactor.wake();
+    }
+}
+
+fn set_nonblocking(fd: RawFd) -> io::Result<()> {
+    unsafe {
+        let flags = libc::fcntl(fd, libc::F_GETFL);
+        if flags == -1 || libc::fcntl(fd, libc::F_SETFL, flags | libc::O_NONBLOCK) == -1 {
+            return Err(io::Error::last_os_error());
+        }
+    }
+    Ok(())
+}
+
+fn epoll_add(epoll: RawFd, fd: RawFd, events: u32, token: u64) -> io::Result<()> {
+    let mut event = libc::epoll_event { events: events, u64: token };
+    if unsafe { libc::epoll_ctl(epoll, libc::EPOLL_CTL_ADD, fd, &mut event) } == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn epoll_mod(epoll: RawFd, fd: RawFd, events: u32, token: u64) {
+    let mut event = libc::epoll_event { events: events, u64: token };
+    unsafe { libc::epoll_ctl(epoll, libc::EPOLL_CTL_MOD, fd, &mut event) };
+}
+
+fn epoll_del(epoll: RawFd, fd: RawFd) {
+    unsafe { libc::epoll_ctl(epoll, libc::EPOLL_CTL_DEL, fd, ::std::ptr::null_mut()) };
+}
+
+fn instance(slot: &'static Mutex<Option<&'static Reactor>>, background: bool) -> io::Result<&'static Reactor> {
+    let mut instance = slot.lock().unwrap();
+    if let Some(reactor) = *instance {
+        return Ok(reactor);
+    }
+
+    let reactor: &'static Reactor = Box::leak(Box::new(try!(Reactor::new())));
+    if background {
+        try!(thread::Builder::new()
+            .name("messageipc-reactor".into())
+            .spawn(move || loop {
+                reactor.poll(None).ok();
+            }));
+    }
+    *instance = Some(reactor);
+    Ok(reactor)
+}
+
+/// The reactor for IO_REACTOR connections, created with its thread on first use
+pub fn background() -> io::Result<&'static Reactor> {
+    static INSTANCE: Mutex<Option<&'static Reactor>> = Mutex::new(None);
+    instance(&INSTANCE, true)
+}
+
+/// The reactor for IO_MANUAL connections, which `mipc_reactor_poll` polls. Created on first use.
+pub fn manual() -> io::Result<&'static Reactor> {
+    static INSTANCE: Mutex<Option<&'static Reactor>> = Mutex::new(None);
+    instance(&INSTANCE, false)
+}
+
+impl Reactor {
+    fn new() -> io::Result<Reactor> {
+        let epoll = unsafe { libc::epoll_create1(libc::EPOLL_CLOEXEC) };
+        if epoll == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        let wake = unsafe { libc::eventfd(0, libc::EFD_CLOEXEC | libc::EFD_NONBLOCK) };
+        if wake == -1 {
+            let err = io::Error::last_os_error();
+            unsafe { libc::close(epoll) };
+            return Err(err);
+        }
+        try!(epoll_add(epoll, wake, libc::EPOLLIN as u32, WAKE_TOKEN));
+
+        Ok(Reactor {
+            epoll: epoll,
+            wake: wake,
+            incoming: Mutex::new(Vec::new()),
+            ready: Mutex::new(Vec::new()),
+            resume: Mutex::new(Vec::new()),
+            core: Mutex::new(Core {
+                conns: Vec::new(),
+                free: Vec::new(),
+                events: vec![libc::epoll_event { events: 0, u64: 0 }; MAX_EVENTS],
+                ready: Vec::new(),
+            }),
+        })
+    }
+
+    /// Polls readable whenever `poll` has work to do
+    pub fn fd(&self) -> RawFd {
+        self.epoll
+    }
+
+    fn wake(&self) {
+        let one = 1u64;
+        unsafe { libc::write(self.wake, &one as *const u64 as *const libc::c_void, 8) };
+    }
+
+    /// Hand a connection's descriptors over to the reactor
+    pub fn register(&'static self, reader: File, writer: File, send: &Arc<Queue<Frame>>, inbox: Inbox,
+                    pool: &Arc<Pool>, session: &Arc<Session>) -> io::Result<()> {
+        try!(set_nonblocking(reader.as_raw_fd()));
+        try!(set_nonblocking(writer.as_raw_fd()));
+
+        self.incoming.lock().unwrap().push(Conn {
+            reader: Some(reader),
+            paused: false,
+            writer: Some(writer),
+            decoder: Decoder::new(session),
+            encoder: Encoder::new(session, pool),
+            batch: Batch::new(),
+            send: send.clone(),
+            inbox: inbox,
+            pool: pool.clone(),
+        });
+        self.wake();
+        Ok(())
+    }
+
+    /// Wait up to `timeout` (forever if None) for I/O and service every connection that is
+    /// ready. Only one thread polls at a time; others wait their turn.
+    pub fn poll(&'static self, timeout: Option<Duration>) -> io::Result<usize> {
+        let mut core = self.core.lock().unwrap();
+        let core = &mut *core;
+
+        self.adopt(core);
+        self.resume_paused(core);
+        self.flush_ready(core);
+
+        let timeout_ms = match timeout {
+            None => -1,
+            Some(timeout) => {
+                let ms = timeout.as_secs().saturating_mul(1000) + (timeout.subsec_nanos() as u64 + 999_999) / 1_000_000;
+                if ms > i32::max_value() as u64 { i32::max_value() } else { ms as i32 }
+            }
+        };
+
+        let count = unsafe {
+            libc::epoll_wait(self.epoll, core.events.as_mut_ptr(), MAX_EVENTS as i32, timeout_ms)
+        };
+        if count == -1 {
+            let err = io::Error::last_os_error();
+            if err.kind() == io::ErrorKind::Interrupted {
+                return Ok(0);
+            }
+            return Err(err);
+        }
+
+        for i in 0..count as usize {
+            let token = core.events[i].u64;
+            if token == WAKE_TOKEN {
+                let mut value = 0u64;
+                unsafe { libc::read(self.wake, &mut value as *mut u64 as *mut libc::c_void, 8) };
+                continue;
+            }
+
+            let index = (token >> 1) as usize;
+            if let Some(ref mut conn) = core.conns[index] {
+                if token & 1 == 0 {
+                    conn.on_readable(self.epoll, index);
+                } else {
+                    conn.flush(self.epoll);
+                }
+            }
+            self.reap(core, index);
+        }
+
+        self.adopt(core);
+        self.resume_paused(core);
+        self.flush_ready(core);
+        Ok(count as usize)
+    }
+
+    fn adopt(&'static self, core: &mut Core) {
+        let incoming = mem::replace(&mut *self.incoming.lock().unwrap(), Vec::new());
+        for conn in incoming {
+            let index = match core.free.pop() {
+                Some(index) => index,
+                None => {
+                    core.conns.push(None);
+                    core.conns.len() - 1
+                }
+            };
+
+            let token = (index as u64) << 1;
+            let registered = epoll_add(self.epoll, conn.reader.as_ref().unwrap().as_raw_fd(),
+                                       libc::EPOLLIN as u32, token)
+                .and_then(|_| epoll_add(self.epoll, conn.writer.as_ref().unwrap().as_raw_fd(),
+                                        (libc::EPOLLOUT | libc::EPOLLET) as u32, token | 1));
+            if registered.is_err() {
+                // Dropping the connection closes its queues and its client sees a disconnect
+                conn.send.close();
+                conn.inbox.close();
+                core.free.push(index);
+                continue;
+            }
+
+            conn.send.watch(Arc::new(SendWatcher { reactor: self, index: index }));
+            conn.inbox.watch(Arc::new(RecvWatcher { reactor: self, index: index }));
+            core.conns[index] = Some(conn);
+        }
+    }
+
+    fn resume_paused(&self, core: &mut Core) {
+        let resume = mem::replace(&mut *self.resume.lock().unwrap(), Vec::new());
+        for index in resume {
+            if let Some(Some(ref mut conn)) = core.conns.get_mut(index) {
+                conn.resume(self.epoll, index);
+            }
+        }
+    }
+
+    fn flush_ready(&self, core: &mut Core) {
+        mem::swap(&mut *self.ready.lock().unwrap(), &mut core.ready);
+        let ready = mem::replace(&mut core.ready, Vec::new());
+        for &index in &ready {
+            if let Some(Some(ref mut conn)) = core.conns.get_mut(index) {
+                conn.flush(self.epoll);
+            }
+            self.reap(core, index);
+        }
+        core.ready = ready;
+        core.ready.clear();
+    }
+
+    fn reap(&self, core: &mut Core, index: usize) {
+        let done = match core.conns.get(index) {
+            Some(&Some(ref conn)) => conn.reader.is_none() && conn.writer.is_none(),
+            _ => false,
+        };
+        if done {
+            core.conns[index] = None;
+            core.free.push(index);
+        }
+    }
+}
+
+impl Conn {
+    fn on_readable(&mut self, epoll: RawFd, index: usize) {
+        for _ in 0..READS_PER_EVENT {
+            // Leave the rest in the pipe until the application catches up; the receive
+            // queues' watcher resumes us
+            if self.inbox.is_full() {
+                return self.pause(epoll, index);
+            }
+
+            let result = match self.reader {
+                Some(ref mut reader) => self.decoder.read_from(reader, &self.pool, &mut self.batch),
+                None => return,
+            };
+
+            match result {
+                Ok(true) => {
+                    if !self.batch.push_to(&self.inbox) {
+                        return self.close_read(epoll);
+                    }
+                }
+                Err(ref e) if e.kind() == io::ErrorKind::WouldBlock => return,
+                Err(ref e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Ok(false) | Err(_) => return self.close_read(epoll),
+            }
+        }
+    }
+
+    fn flush(&mut self, epoll: RawFd) {
+        {
+            let writer = match self.writer {
+                Some(ref mut writer) => writer,
+                None => return,
+            };
+
+            // Only take more from the send queue once what we have is written, so a full pipe
+            // leaves the queue full and its producers held back
+            let encoder = &mut self.encoder;
+            loop {
+                match encoder.write_to(writer) {
+                    // Still blocked; the edge-triggered EPOLLOUT brings us back
+                    Ok(false) => return,
+                    Ok(true) => {}
+                    Err(_) => break,
+                }
+                if !encoder.is_empty() {
+                    // Partway through a big message, only urgent frames may go ahead of the rest
+                    self.send.pop_urgent(|frame| encoder.push(frame));
+                    continue;
+                }
+                match self.send.pop_many(usize::MAX, Some(Duration::from_secs(0)), |frame| encoder.push(frame)) {
+                    Some(0) => return,
+                    Some(_) => {}
+                    None => break,
+                }
+            }
+        }
+
+        // Written out and closed, or failed
+        self.close_write(epoll);
+    }
+
+    fn pause(&mut self, epoll: RawFd, index: usize) {
+        if let Some(ref reader) = self.reader {
+            epoll_mod(epoll, reader.as_raw_fd(), 0, (index as u64) << 1);
+            self.paused = true;
+        }
+    }
+
+    fn resume(&mut self, epoll: RawFd, index: usize) {
+        if let (true, Some(ref reader)) = (self.paused, self.reader.as_ref()) {
+            epoll_mod(epoll, reader.as_raw_fd(), libc::EPOLLIN as u32, (index as u64) << 1);
+            self.paused = false;
+        }
+    }
+
+    fn close_read(&mut self, epoll: RawFd) {
+        if let Some(reader) = self.reader.take() {
+            epoll_del(epoll, reader.as_raw_fd());
+        }
+        self.inbox.close();
+    }
+
+    fn close_write(&mut self, epoll: RawFd) {
+        if let Some(writer) = self.writer.take() {
+            epoll_del(epoll, writer.as_raw_fd());
+        }
+        self.send.close();
+        self.encoder.clear();
+    }
+}
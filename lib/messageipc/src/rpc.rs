@@ -0,0 +1,281 @@
+//! Request/response calls over a connection, any number of them in flight at once.
+//!
+//! A request and its response are control frames carrying the id the caller picked, followed
+//! by the body. Requests are queued for the application apart from ordinary messages; a
+//! response never reaches a queue at all, but is handed by the reader straight to whoever is
+//! waiting for it in the connection's table of calls, or to the callback the call was made
+//! with.
+//!
+//! A peer without RPC support ignores requests, so calls to it only ever end by timing out.
+
+use std::collections::HashMap;
+use std::mem;
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+use frame::{self, Frame};
+use pool::{Buffer, Pool};
+use queue::{Queue, RecvError, SendError, Space};
+
+const REQUEST_MAGIC: &'static [u8; 4] = b"MRPQ";
+const RESPONSE_MAGIC: &'static [u8; 4] = b"MRPS";
+/// Bytes in front of the body: the magic and the call's id
+pub const HEADER_LEN: usize = 12;
+/// The longest body a request or response can carry
+pub const MAX_BODY: usize = frame::MAX_MESSAGE - HEADER_LEN;
+
+/// A call the peer made, waiting for `respond`
+pub struct Request {
+    pub id: u64,
+    pub body: Buffer,
+}
+
+impl Request {
+    pub fn weight(&self) -> usize {
+        self.body.len()
+    }
+}
+
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum Kind {
+    Request,
+    Response,
+}
+
+fn frame(pool: &Arc<Pool>, magic: &[u8; 4], id: u64, body: &[u8]) -> Frame {
+    Frame::Rpc(Pool::gather(pool, &[magic, &id.to_le_bytes(), body]))
+}
+
+fn request(pool: &Arc<Pool>, id: u64, body: &[u8]) -> Frame {
+    frame(pool, REQUEST_MAGIC, id, body)
+}
+
+fn response(pool: &Arc<Pool>, id: u64, body: &[u8]) -> Frame {
+    frame(pool, RESPONSE_MAGIC, id, body)
+}
+
+/// What a control frame's payload is, if it is a request or a response
+pub fn parse(payload: &[u8]) -> Option<(Kind, u64)> {
+    if payload.len() < HEADER_LEN {
+        return None;
+    }
+    let kind = match &payload[..4] {
+        magic if magic == REQUEST_MAGIC => Kind::Request,
+        magic if magic == RESPONSE_MAGIC => Kind::Response,
+        _ => return None,
+    };
+    let mut id = [0; 8];
+    id.copy_from_slice(&payload[4..HEADER_LEN]);
+    Some((kind, u64::from_le_bytes(id)))
+}
+
+/// Runs once with the response, or with Disconnected if none will come
+pub type Callback = Box<dyn FnOnce(Result<Buffer, RecvError>) + Send>;
+
+enum Pending {
+    Waiting,
+    Done(Buffer),
+    Callback(Callback),
+}
+
+struct State {
+    next_id: u64,
+    pending: HashMap<u64, Pending>,
+    closed: bool,
+    waiting: usize,
+}
+
+/// A connection's calls that haven't had their response yet
+pub struct Calls {
+    state: Mutex<State>,
+    done: Condvar,
+}
+
+impl Calls {
+    pub fn new() -> Arc<Calls> {
+        Arc::new(Calls {
+            state: Mutex::new(State { next_id: 1, pending: HashMap::new(), closed: false, waiting: 0 }),
+            done: Condvar::new(),
+        })
+    }
+
+    // Returns the new call's id, or None once the connection is gone
+    fn register(&self, pending: Pending) -> Option<u64> {
+        let mut state = self.state.lock().unwrap();
+        if state.closed {
+            return None;
+        }
+        let id = state.next_id;
+        state.next_id += 1;
+        state.pending.insert(id, pending);
+        Some(id)
+    }
+
+    /// Start a call whose response is waited for with `Call::wait`
+    pub fn begin(calls: &Arc<Calls>) -> Option<Call> {
+        calls.register(Pending::Waiting).map(|id| Call { calls: calls.clone(), id: id })
+    }
+
+    /// Start a call whose response goes to `callback`
+    pub fn begin_with(&self, callback: Callback) -> Option<u64> {
+        self.register(Pending::Callback(callback))
+    }
+
+    /// Forget a call, dropping its response if it comes after all. A callback is dropped
+    /// without being run. Returns false if the call was already finished.
+    pub fn cancel(&self, id: u64) -> bool {
+        let pending = self.state.lock().unwrap().pending.remove(&id);
+        pending.is_some()
+    }
+
+    /// Hand a response to its call. Callbacks run here, on the reader's thread.
+    pub fn complete(&self, id: u64, body: Buffer) {
+        let callback = {
+            let mut state = self.state.lock().unwrap();
+            match state.pending.remove(&id) {
+                Some(Pending::Waiting) => {
+                    state.pending.insert(id, Pending::Done(body));
+                    if state.waiting != 0 {
+                        self.done.notify_all();
+                    }
+                    return;
+                }
+                Some(Pending::Callback(callback)) => callback,
+                // Already answered; the first response stands
+                Some(pending) => {
+                    state.pending.insert(id, pending);
+                    return;
+                }
+                // Cancelled, or a response we never asked for
+                None => return,
+            }
+        };
+        callback(Ok(body));
+    }
+
+    /// No more responses are coming. Every callback still waiting runs with Disconnected.
+    pub fn close(&self) {
+        let mut callbacks = Vec::new();
+        {
+            let mut state = self.state.lock().unwrap();
+            state.closed = true;
+            self.done.notify_all();
+            // Responses already in stay there for their waiters
+            for (id, pending) in mem::replace(&mut state.pending, HashMap::new()) {
+                match pending {
+                    Pending::Callback(callback) => callbacks.push(callback),
+                    pending => { state.pending.insert(id, pending); }
+                }
+            }
+        }
+        for callback in callbacks {
+            callback(Err(RecvError::Disconnected));
+        }
+    }
+
+    fn wait(&self, id: u64, timeout: Option<Duration>) -> Result<Buffer, RecvError> {
+        let deadline = timeout.map(|timeout| Instant::now() + timeout);
+        let mut state = self.state.lock().unwrap();
+        loop {
+            match state.pending.remove(&id) {
+                Some(Pending::Done(body)) => return Ok(body),
+                Some(pending) => { state.pending.insert(id, pending); }
+                None => return Err(RecvError::Disconnected),
+            }
+            if state.closed {
+                return Err(RecvError::Disconnected);
+            }
+
+            let now = Instant::now();
+            if deadline.map_or(false, |deadline| now >= deadline) {
+                return Err(RecvError::Empty);
+            }
+            state.waiting += 1;
+            state = match deadline {
+                None => self.done.wait(state).unwrap(),
+                Some(deadline) => self.done.wait_timeout(state, deadline - now).unwrap().0,
+            };
+            state.waiting -= 1;
+        }
+    }
+}
+
+/// A call in flight. Dropping it abandons the call.
+pub struct Call {
+    calls: Arc<Calls>,
+    id: u64,
+}
+
+impl Call {
+    pub fn id(&self) -> u64 {
+        self.id
+    }
+
+    /// Wait up to `timeout` (forever if None) for the response. Fails with Empty if it didn't
+    /// come in time, in which case the call can be waited on again, and with Disconnected if
+    /// it never will, or was already returned by an earlier wait.
+    pub fn wait(&self, timeout: Option<Duration>) -> Result<Buffer, RecvError> {
+        self.calls.wait(self.id, timeout)
+    }
+}
+
+impl Drop for Call {
+    fn drop(&mut self) {
+        self.calls.cancel(self.id);
+    }
+}
+
+// Wait up to `timeout` (forever if None) for the send queue to have room, then queue a frame
+fn send(send: &Queue<Frame>, frame: Frame, timeout: Option<Duration>) -> Result<(), SendError> {
+    match send.wait_space(timeout) {
+        Space::Available if send.push(frame) => Ok(()),
+        Space::Full => Err(SendError::WouldBlock),
+        _ => Err(SendError::Disconnected),
+    }
+}
+
+/// Send a request whose response is waited for with `Call::wait`. `timeout` only covers
+/// waiting for the send queue to have room.
+pub fn call(queue: &Queue<Frame>, pool: &Arc<Pool>, calls: &Arc<Calls>, body: &[u8],
+            timeout: Option<Duration>) -> Result<Call, SendError> {
+    if body.len() > MAX_BODY {
+        return Err(SendError::TooLarge);
+    }
+    let call = try!(Calls::begin(calls).ok_or(SendError::Disconnected));
+    // A call that wasn't sent is cancelled when it's dropped
+    try!(send(queue, request(pool, call.id, body), timeout));
+    Ok(call)
+}
+
+/// Send a request whose response goes to `callback`. On success the callback runs exactly
+/// once; on failure it is dropped without being run.
+pub fn call_with(queue: &Queue<Frame>, pool: &Arc<Pool>, calls: &Calls, body: &[u8],
+                 timeout: Option<Duration>, callback: Callback) -> Result<(), SendError> {
+    if body.len() > MAX_BODY {
+        return Err(SendError::TooLarge);
+    }
+    let id = try!(calls.begin_with(callback).ok_or(SendError::Disconnected));
+    match send(queue, request(pool, id, body), timeout) {
+        Err(err) if calls.cancel(id) => Err(err),
+        // Or the connection closed in the meantime, which ran the callback already
+        _ => Ok(()),
+    }
+}
+
+/// Send the response to the peer's request `id`
+pub fn respond(queue: &Queue<Frame>, pool: &Arc<Pool>, id: u64, body: &[u8],
+               timeout: Option<Duration>) -> Result<(), SendError> {
+    if body.len() > MAX_BODY {
+        return Err(SendError::TooLarge);
+    }
+    send(queue, response(pool, id, body), timeout)
+}
+
+/// Wait up to `timeout` (forever if None) for the peer's next request
+pub fn recv_request(requests: &Queue<Request>, timeout: Option<Duration>) -> Result<Request, RecvError> {
+    let mut request = None;
+    match requests.pop_many(1, timeout, |item| request = Some(item)) {
+        Some(_) => request.ok_or(RecvError::Empty),
+        None => Err(RecvError::Disconnected),
+    }
+}
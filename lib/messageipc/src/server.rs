@@ -0,0 +1,114 @@
+//! A server that many clients connect to at once, over one SOCK_SEQPACKET socket.
+//!
+//! Every accepted connection is an ordinary IpcClient handle with its own id. Besides
+//! receiving from each handle, the server can receive from all of them at once; it takes
+//! turns between clients so a chatty one can't starve the rest.
+
+use std::io;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use libc;
+
+use options::Options;
+use pool::Buffer;
+use queue::{Queue, Signal};
+use socket::{self, Listener};
+use unix::IpcClient;
+
+struct Member {
+    id: u32,
+    recv: Arc<Queue<Buffer>>,
+}
+
+struct Members {
+    list: Vec<Member>,
+    // Where the next `recv` starts looking
+    next: usize,
+    next_id: u32,
+}
+
+pub struct IpcServer {
+    listener: Listener,
+    options: Options,
+    members: Mutex<Members>,
+    // Bumped whenever any client's receive queue becomes ready, so `recv` knows to look again
+    signal: Arc<Signal>,
+}
+
+impl IpcServer {
+    /// Start listening. Clients connect with `open_client` and TRANSPORT_SOCKET, passing this
+    /// process's pid. `options` apply to every accepted connection.
+    pub fn listen(name: &str, options: &Options) -> io::Result<IpcServer> {
+        let pid = unsafe { libc::getpid() as u32 };
+        let listener = try!(Listener::bind(&socket::path(name, pid)));
+
+        Ok(IpcServer {
+            listener: listener,
+            options: *options,
+            members: Mutex::new(Members {
+                list: Vec::new(),
+                next: 0,
+                next_id: 1,
+            }),
+            signal: Signal::new(),
+        })
+    }
+
+    /// Wait up to `timeout` (forever if None) for a client to connect. Returns None if none did.
+    pub fn accept(&self, timeout: Option<Duration>) -> io::Result<Option<IpcClient>> {
+        let socket = match try!(self.listener.accept(timeout)) {
+            Some(socket) => socket,
+            None => return Ok(None),
+        };
+
+        let mut members = self.members.lock().unwrap();
+        let id = members.next_id;
+        let client = try!(IpcClient::accepted(socket, id, &self.options));
+        members.next_id = members.next_id.wrapping_add(1).max(1);
+        members.list.push(Member { id: id, recv: client.recv_queue().clone() });
+        client.recv_queue().watch(self.signal.clone());
+        Ok(Some(client))
+    }
+
+    /// Wait up to `timeout` (forever if None) for a message from any client and return it
+    /// along with the id of the client it came from. Once a client has disconnected and all it
+    /// sent was received, its id is returned once more without a message. Returns None if
+    /// nothing arrived in time.
+    pub fn recv(&self, timeout: Option<Duration>) -> Option<(u32, Option<Buffer>)> {
+        let deadline = timeout.map(|timeout| Instant::now() + timeout);
+        loop {
+            let generation = self.signal.generation();
+            if let Some(event) = self.take_next() {
+                return Some(event);
+            }
+            if !self.signal.wait(generation, deadline) {
+                return None;
+            }
+        }
+    }
+
+    // One message from the first client with one, starting after whoever was served last.
+    // A client that has disconnected and been drained is reported in turn, then dropped.
+    fn take_next(&self) -> Option<(u32, Option<Buffer>)> {
+        let mut members = self.members.lock().unwrap();
+        let count = members.list.len();
+        for offset in 0..count {
+            let index = (members.next + offset) % count;
+            match members.list[index].recv.try_pop() {
+                Some(Some(message)) => {
+                    members.next = index + 1;
+                    return Some((members.list[index].id, Some(message)));
+                }
+                Some(None) => {}
+                None => {
+                    // Whoever came after it now sits at `index`, and is next in line
+                    let member = members.list.remove(index);
+                    members.next = index;
+                    return Some((member.id, None));
+                }
+            }
+        }
+        None
+    }
+}
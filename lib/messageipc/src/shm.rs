@@ -0,0 +1,428 @@
+//! Shared-memory transport for Linux.
+//!
+//! A connection is a single segment in /dev/shm holding one single-producer single-consumer
+//! byte ring per direction. Both ends copy straight into and out of the mapping and only make
+//! a futex syscall when the other side is actually parked waiting for data or space. A reader
+//! given a spin budget polls the head for a while before it parks, so a writer streaming to
+//! it never has to make one.
+
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::io::{self, IoSlice, Read, Write};
+use std::fs::{self, File, OpenOptions};
+use std::os::unix::fs::OpenOptionsExt;
+use std::os::unix::io::AsRawFd;
+use std::{cmp, mem, ptr, thread};
+use std::time::Duration;
+
+use libc;
+
+use spin::Spin;
+
+const MAGIC: u32 = 0x4350494d; // "MIPC"
+const DEFAULT_RING_SIZE: usize = 1 << 20;
+const MIN_RING_SIZE: usize = 1 << 12;
+const MAX_RING_SIZE: usize = 1 << 30;
+
+const WRITER_CLOSED: u32 = 1;
+const READER_CLOSED: u32 = 2;
+
+// A parked side wakes up this often to make sure the peer process hasn't died
+// without getting the chance to mark its end of the ring closed.
+pub(crate) const PEER_CHECK_MS: u64 = 250;
+
+#[repr(C)]
+struct Segment {
+    magic: AtomicU32,
+    attached: AtomicU32,
+    capacity: AtomicU32,
+    server_pid: AtomicU32,
+    client_pid: AtomicU32,
+    _pad: [u8; 44],
+}
+
+// Producer and consumer cursors live on separate cache lines so the two
+// processes don't false-share while streaming.
+#[repr(C)]
+struct Ring {
+    head: AtomicU64,
+    _pad0: [u8; 56],
+    tail: AtomicU64,
+    _pad1: [u8; 56],
+    data_seq: AtomicU32,
+    reader_waiting: AtomicU32,
+    space_seq: AtomicU32,
+    writer_waiting: AtomicU32,
+    closed: AtomicU32,
+    _pad2: [u8; 44],
+}
+
+fn ring_offset(index: usize) -> usize {
+    mem::size_of::<Segment>() + index * mem::size_of::<Ring>()
+}
+
+fn data_offset(index: usize, capacity: usize) -> usize {
+    ring_offset(2) + index * capacity
+}
+
+pub(crate) fn ring_capacity(requested: u32) -> usize {
+    match requested as usize {
+        0 => DEFAULT_RING_SIZE,
+        n => cmp::min(cmp::max(n, MIN_RING_SIZE), MAX_RING_SIZE).next_power_of_two(),
+    }
+}
+
+fn segment_path(name: &str, pid: u32) -> String {
+    format!("/dev/shm/messageipc_{}_{}", name, pid)
+}
+
+/// Returns true if the wait timed out
+pub(crate) fn futex_wait(word: &AtomicU32, expected: u32, timeout_ms: Option<u64>) -> bool {
+    let ts = timeout_ms.map(|ms| libc::timespec {
+        tv_sec: (ms / 1000) as libc::time_t,
+        tv_nsec: ((ms % 1000) * 1_000_000) as libc::c_long,
+    });
+    let ts_ptr = match ts {
+        Some(ref ts) => ts as *const libc::timespec,
+        None => ptr::null(),
+    };
+    let result = unsafe {
+        libc::syscall(libc::SYS_futex, word as *const AtomicU32, libc::FUTEX_WAIT, expected, ts_ptr)
+    };
+    result == -1 && io::Error::last_os_error().raw_os_error() == Some(libc::ETIMEDOUT)
+}
+
+pub(crate) fn futex_wake(word: &AtomicU32) {
+    unsafe {
+        libc::syscall(libc::SYS_futex, word as *const AtomicU32, libc::FUTEX_WAKE, libc::INT_MAX);
+    }
+}
+
+pub(crate) fn process_alive(pid: u32) -> bool {
+    if unsafe { libc::kill(pid as libc::pid_t, 0) } != 0 {
+        return io::Error::last_os_error().raw_os_error() != Some(libc::ESRCH);
+    }
+
+    // A peer that exited but hasn't been reaped yet still answers kill(), so ask /proc
+    // whether it is a zombie
+    match fs::read_to_string(format!("/proc/{}/stat", pid)) {
+        Ok(stat) => match stat.rsplit(')').next().and_then(|rest| rest.trim_start().chars().next()) {
+            Some('Z') | Some('X') => false,
+            _ => true,
+        },
+        Err(_) => true,
+    }
+}
+
+pub(crate) struct Mapping {
+    ptr: *mut u8,
+    len: usize,
+}
+
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    pub(crate) fn new(file: &File, len: usize) -> io::Result<Mapping> {
+        let ptr = unsafe {
+            libc::mmap(ptr::null_mut(), len, libc::PROT_READ | libc::PROT_WRITE,
+                       libc::MAP_SHARED, file.as_raw_fd(), 0)
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Mapping { ptr: ptr as *mut u8, len: len })
+    }
+
+    pub(crate) fn as_ptr(&self) -> *mut u8 {
+        self.ptr
+    }
+
+    fn segment(&self) -> &Segment {
+        unsafe { &*(self.ptr as *const Segment) }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr as *mut libc::c_void, self.len) };
+    }
+}
+
+struct Half {
+    _map: Arc<Mapping>,
+    ring: *const Ring,
+    data: *mut u8,
+    mask: usize,
+    peer_pid: u32,
+    peer_gone: bool,
+}
+
+unsafe impl Send for Half {}
+
+impl Half {
+    fn new(map: &Arc<Mapping>, index: usize, capacity: usize, peer_pid: u32) -> Half {
+        Half {
+            _map: map.clone(),
+            ring: unsafe { map.ptr.offset(ring_offset(index) as isize) as *const Ring },
+            data: unsafe { map.ptr.offset(data_offset(index, capacity) as isize) },
+            mask: capacity - 1,
+            peer_pid: peer_pid,
+            peer_gone: false,
+        }
+    }
+
+    fn ring(&self) -> &Ring {
+        unsafe { &*self.ring }
+    }
+
+    fn park(&mut self, seq: &AtomicU32, expected: u32) {
+        if futex_wait(seq, expected, Some(PEER_CHECK_MS)) && !process_alive(self.peer_pid) {
+            self.peer_gone = true;
+        }
+    }
+
+    fn copy_in(&self, pos: u64, src: &[u8]) {
+        let off = pos as usize & self.mask;
+        let first = cmp::min(src.len(), self.mask + 1 - off);
+        unsafe {
+            ptr::copy_nonoverlapping(src.as_ptr(), self.data.offset(off as isize), first);
+            ptr::copy_nonoverlapping(src.as_ptr().offset(first as isize), self.data, src.len() - first);
+        }
+    }
+
+    fn copy_out(&self, pos: u64, dst: &mut [u8]) {
+        let off = pos as usize & self.mask;
+        let first = cmp::min(dst.len(), self.mask + 1 - off);
+        unsafe {
+            ptr::copy_nonoverlapping(self.data.offset(off as isize), dst.as_mut_ptr(), first);
+            ptr::copy_nonoverlapping(self.data, dst.as_mut_ptr().offset(first as isize), dst.len() - first);
+        }
+    }
+}
+
+pub struct RingReader(Half, Spin);
+pub struct RingWriter(Half);
+
+impl Read for RingReader {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        if buf.is_empty() {
+            return Ok(0);
+        }
+
+        loop {
+            let (tail, head) = {
+                let ring = self.0.ring();
+                (ring.tail.load(Ordering::Relaxed), ring.head.load(Ordering::Acquire))
+            };
+
+            if head != tail {
+                let n = cmp::min(buf.len(), (head - tail) as usize);
+                self.0.copy_out(tail, &mut buf[..n]);
+
+                let ring = self.0.ring();
+                ring.tail.store(tail + n as u64, Ordering::SeqCst);
+                if ring.writer_waiting.load(Ordering::SeqCst) != 0 {
+                    ring.space_seq.fetch_add(1, Ordering::SeqCst);
+                    futex_wake(&ring.space_seq);
+                }
+                return Ok(n);
+            }
+
+            if self.0.peer_gone || self.0.ring().closed.load(Ordering::Acquire) & WRITER_CLOSED != 0 {
+                // Anything published before the close still gets delivered
+                if self.0.ring().head.load(Ordering::Acquire) == tail {
+                    return Ok(0);
+                }
+                continue;
+            }
+
+            let ring = unsafe { &*self.0.ring };
+            if self.1.wait(None, || ring.head.load(Ordering::Acquire) != tail || ring.closed.load(Ordering::Acquire) != 0) {
+                continue;
+            }
+            let seq = ring.data_seq.load(Ordering::SeqCst);
+            ring.reader_waiting.store(1, Ordering::SeqCst);
+            if ring.head.load(Ordering::SeqCst) == tail && ring.closed.load(Ordering::SeqCst) == 0 {
+                self.0.park(&ring.data_seq, seq);
+            }
+            ring.reader_waiting.store(0, Ordering::SeqCst);
+        }
+    }
+}
+
+impl Drop for RingReader {
+    fn drop(&mut self) {
+        let ring = self.0.ring();
+        ring.closed.fetch_or(READER_CLOSED, Ordering::SeqCst);
+        ring.space_seq.fetch_add(1, Ordering::SeqCst);
+        futex_wake(&ring.space_seq);
+    }
+}
+
+impl RingWriter {
+    /// Block until there is room in the ring, returning the head and how much is free
+    fn wait_for_space(&mut self) -> io::Result<(u64, usize)> {
+        let capacity = self.0.mask + 1;
+        loop {
+            if self.0.peer_gone || self.0.ring().closed.load(Ordering::Acquire) & READER_CLOSED != 0 {
+                return Err(io::Error::new(io::ErrorKind::BrokenPipe, "shared memory reader closed"));
+            }
+
+            let (head, tail) = {
+                let ring = self.0.ring();
+                (ring.head.load(Ordering::Relaxed), ring.tail.load(Ordering::Acquire))
+            };
+
+            let free = capacity - (head - tail) as usize;
+            if free != 0 {
+                return Ok((head, free));
+            }
+
+            let ring = unsafe { &*self.0.ring };
+            let seq = ring.space_seq.load(Ordering::SeqCst);
+            ring.writer_waiting.store(1, Ordering::SeqCst);
+            if ring.tail.load(Ordering::SeqCst) == tail && ring.closed.load(Ordering::SeqCst) == 0 {
+                self.0.park(&ring.space_seq, seq);
+            }
+            ring.writer_waiting.store(0, Ordering::SeqCst);
+        }
+    }
+
+    fn publish(&self, head: u64) {
+        let ring = self.0.ring();
+        ring.head.store(head, Ordering::SeqCst);
+        if ring.reader_waiting.load(Ordering::SeqCst) != 0 {
+            ring.data_seq.fetch_add(1, Ordering::SeqCst);
+            futex_wake(&ring.data_seq);
+        }
+    }
+}
+
+impl Write for RingWriter {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        if buf.is_empty() {
+            return Ok(0);
+        }
+
+        let (head, free) = try!(self.wait_for_space());
+        let n = cmp::min(buf.len(), free);
+        self.0.copy_in(head, &buf[..n]);
+        self.publish(head + n as u64);
+        Ok(n)
+    }
+
+    /// Copies as many of the slices as fit and publishes them all with a single head update
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        if bufs.iter().all(|buf| buf.is_empty()) {
+            return Ok(0);
+        }
+
+        let (head, mut free) = try!(self.wait_for_space());
+        let mut pos = head;
+        for buf in bufs {
+            let n = cmp::min(buf.len(), free);
+            self.0.copy_in(pos, &buf[..n]);
+            pos += n as u64;
+            free -= n;
+            if free == 0 {
+                break;
+            }
+        }
+        self.publish(pos);
+        Ok((pos - head) as usize)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+impl Drop for RingWriter {
+    fn drop(&mut self) {
+        let ring = self.0.ring();
+        ring.closed.fetch_or(WRITER_CLOSED, Ordering::SeqCst);
+        ring.data_seq.fetch_add(1, Ordering::SeqCst);
+        futex_wake(&ring.data_seq);
+    }
+}
+
+// Ring 0 carries client -> server traffic, ring 1 carries server -> client.
+
+pub fn open_server(name: &str, pid: u32, ring_size: u32, spin: Duration) -> io::Result<(RingReader, RingWriter)> {
+    let capacity = ring_capacity(ring_size);
+    let len = data_offset(2, capacity);
+    let path = segment_path(name, pid);
+
+    fs::remove_file(&path).ok();
+    let file = try!(OpenOptions::new().read(true).write(true).create_new(true).mode(0o660).open(&path));
+    try!(file.set_len(len as u64));
+    let map = Arc::new(try!(Mapping::new(&file, len)));
+
+    let client_pid = {
+        let seg = map.segment();
+        seg.capacity.store(capacity as u32, Ordering::Relaxed);
+        seg.server_pid.store(pid, Ordering::Relaxed);
+        seg.magic.store(MAGIC, Ordering::Release);
+
+        // Block until a client maps the segment, the same way opening a FIFO blocks
+        while seg.attached.load(Ordering::Acquire) == 0 {
+            futex_wait(&seg.attached, 0, None);
+        }
+        seg.client_pid.load(Ordering::Acquire)
+    };
+
+    // Both sides have it mapped now, so nobody needs the name any more
+    fs::remove_file(&path).ok();
+
+    Ok((RingReader(Half::new(&map, 0, capacity, client_pid), Spin::new(spin)),
+        RingWriter(Half::new(&map, 1, capacity, client_pid))))
+}
+
+pub fn open_client(name: &str, pid: u32, spin: Duration) -> io::Result<(RingReader, RingWriter)> {
+    let path = segment_path(name, pid);
+    let file = try!(OpenOptions::new().read(true).write(true).open(&path));
+
+    // The server creates the file before it sizes and initializes it, so give it a moment
+    let mut len = 0;
+    for _ in 0..1000 {
+        len = try!(file.metadata()).len() as usize;
+        if len > ring_offset(2) {
+            break;
+        }
+        thread::sleep(Duration::from_millis(1));
+    }
+    if len <= ring_offset(2) {
+        return Err(io::Error::new(io::ErrorKind::InvalidData, "shared memory segment was never initialized"));
+    }
+
+    let map = Arc::new(try!(Mapping::new(&file, len)));
+    let (capacity, server_pid) = {
+        let seg = map.segment();
+        for _ in 0..1000 {
+            if seg.magic.load(Ordering::Acquire) == MAGIC {
+                break;
+            }
+            thread::sleep(Duration::from_millis(1));
+        }
+        if seg.magic.load(Ordering::Acquire) != MAGIC {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "shared memory segment was never initialized"));
+        }
+
+        let capacity = seg.capacity.load(Ordering::Relaxed) as usize;
+        if !capacity.is_power_of_two() || data_offset(2, capacity) != len {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "shared memory segment has a bad size"));
+        }
+
+        seg.client_pid.store(unsafe { libc::getpid() as u32 }, Ordering::Release);
+        if seg.attached.swap(1, Ordering::AcqRel) != 0 {
+            return Err(io::Error::new(io::ErrorKind::AddrInUse, "shared memory segment already has a client"));
+        }
+        futex_wake(&seg.attached);
+
+        (capacity, seg.server_pid.load(Ordering::Relaxed))
+    };
+
+    Ok((RingReader(Half::new(&map, 1, capacity, server_pid), Spin::new(spin)),
+        RingWriter(Half::new(&map, 0, capacity, server_pid))))
+}
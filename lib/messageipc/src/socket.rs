@@ -0,0 +1,371 @@
+//! SOCK_SEQPACKET Unix domain sockets, used by TRANSPORT_SOCKET and IpcServer.
+//!
+//! Packets keep their boundaries and a packet has to be read in one go, or the rest of it is
+//! thrown away. Writes are therefore cut into packets of at most PACKET_SIZE bytes, and a
+//! read into anything smaller goes through a packet-sized buffer of the reader's own.
+//!
+//! Descriptors ride along with packets as SCM_RIGHTS; the reader keeps the ones it receives
+//! in order until the decoder claims them.
+//!
+//! Linux creates, accepts and receives descriptors close-on-exec in the same call. Other
+//! systems set it with fcntl straight afterwards, so an exec on another thread at just that
+//! moment could still inherit one.
+
+use std::collections::VecDeque;
+use std::ffi::CString;
+use std::fs::{self, File};
+use std::io::{self, IoSlice, Read, Write};
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::time::{Duration, Instant};
+use std::{cmp, mem, ptr};
+
+use libc;
+
+use frame::{Sink, Source, STAGING_SIZE};
+
+// No bigger than the decoder's staging buffer, so it can read straight into its own buffers
+pub const PACKET_SIZE: usize = STAGING_SIZE;
+
+const MAX_IOVECS: usize = 1024;
+
+// Room for a few descriptors per packet, though a writer only ever sends one
+const CONTROL_WORDS: usize = 8;
+
+pub fn path(name: &str, pid: u32) -> String {
+    format!("/tmp/messageipc_{}_{}.sock", name, pid)
+}
+
+fn cvt(result: libc::c_int) -> io::Result<libc::c_int> {
+    if result == -1 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(result)
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn set_cloexec(fd: RawFd) -> io::Result<()> {
+    cvt(unsafe { libc::fcntl(fd, libc::F_SETFD, libc::FD_CLOEXEC) }).map(|_| ())
+}
+
+fn set_nonblocking(fd: RawFd, nonblocking: bool) -> io::Result<()> {
+    unsafe {
+        let flags = try!(cvt(libc::fcntl(fd, libc::F_GETFL)));
+        let flags = if nonblocking { flags | libc::O_NONBLOCK } else { flags & !libc::O_NONBLOCK };
+        cvt(libc::fcntl(fd, libc::F_SETFL, flags)).map(|_| ())
+    }
+}
+
+// MSG_NOSIGNAL isn't honoured by older macOS, the socket option is
+#[cfg(any(target_os = "macos", target_os = "ios"))]
+fn set_nosigpipe(fd: RawFd) -> io::Result<()> {
+    let on: libc::c_int = 1;
+    cvt(unsafe {
+        libc::setsockopt(fd, libc::SOL_SOCKET, libc::SO_NOSIGPIPE, &on as *const _ as *const libc::c_void,
+                         mem::size_of_val(&on) as libc::socklen_t)
+    }).map(|_| ())
+}
+
+#[cfg(target_os = "linux")]
+fn new_socket() -> io::Result<File> {
+    let fd = try!(cvt(unsafe { libc::socket(libc::AF_UNIX, libc::SOCK_SEQPACKET | libc::SOCK_CLOEXEC, 0) }));
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+#[cfg(not(target_os = "linux"))]
+fn new_socket() -> io::Result<File> {
+    let fd = try!(cvt(unsafe { libc::socket(libc::AF_UNIX, libc::SOCK_SEQPACKET, 0) }));
+    let socket = unsafe { File::from_raw_fd(fd) };
+    try!(set_cloexec(fd));
+    #[cfg(any(target_os = "macos", target_os = "ios"))]
+    try!(set_nosigpipe(fd));
+    Ok(socket)
+}
+
+// Accepted non-blocking so a lost race can't block
+#[cfg(target_os = "linux")]
+fn accept(listener: &File) -> io::Result<File> {
+    let fd = try!(cvt(unsafe {
+        libc::accept4(listener.as_raw_fd(), ptr::null_mut(), ptr::null_mut(), libc::SOCK_CLOEXEC | libc::SOCK_NONBLOCK)
+    }));
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+// Without accept4 the listener itself is non-blocking, and the accepted socket inherits that
+#[cfg(not(target_os = "linux"))]
+fn accept(listener: &File) -> io::Result<File> {
+    let fd = try!(cvt(unsafe { libc::accept(listener.as_raw_fd(), ptr::null_mut(), ptr::null_mut()) }));
+    let socket = unsafe { File::from_raw_fd(fd) };
+    try!(set_cloexec(fd));
+    #[cfg(any(target_os = "macos", target_os = "ios"))]
+    try!(set_nosigpipe(fd));
+    Ok(socket)
+}
+
+// Received descriptors are close-on-exec from the start where the system can do that
+#[cfg(target_os = "linux")]
+const RECV_FLAGS: libc::c_int = libc::MSG_CMSG_CLOEXEC;
+#[cfg(not(target_os = "linux"))]
+const RECV_FLAGS: libc::c_int = 0;
+
+fn address(path: &str) -> io::Result<(libc::sockaddr_un, libc::socklen_t)> {
+    let path = try!(CString::new(path).map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "bad socket path")));
+    let bytes = path.as_bytes_with_nul();
+
+    let mut addr: libc::sockaddr_un = unsafe { mem::zeroed() };
+    if bytes.len() > addr.sun_path.len() {
+        return Err(io::Error::new(io::ErrorKind::InvalidInput, "socket path is too long"));
+    }
+    addr.sun_family = libc::AF_UNIX as libc::sa_family_t;
+    for (dst, &src) in addr.sun_path.iter_mut().zip(bytes) {
+        *dst = src as libc::c_char;
+    }
+
+    let len = mem::size_of::<libc::sa_family_t>() + bytes.len();
+    Ok((addr, len as libc::socklen_t))
+}
+
+/// A bound, listening socket. The socket file is removed again when it is dropped.
+pub struct Listener {
+    socket: File,
+    path: String,
+}
+
+impl Listener {
+    pub fn bind(path: &str) -> io::Result<Listener> {
+        fs::remove_file(path).ok();
+
+        let socket = try!(new_socket());
+        let (addr, len) = try!(address(path));
+        try!(cvt(unsafe { libc::bind(socket.as_raw_fd(), &addr as *const _ as *const libc::sockaddr, len) }));
+        let listener = Listener { socket: socket, path: path.to_string() };
+        try!(cvt(unsafe { libc::listen(listener.socket.as_raw_fd(), 128) }));
+        if cfg!(not(target_os = "linux")) {
+            try!(set_nonblocking(listener.socket.as_raw_fd(), true));
+        }
+        Ok(listener)
+    }
+
+    /// Wait up to `timeout` (forever if None) for a connection. Returns None if none came.
+    pub fn accept(&self, timeout: Option<Duration>) -> io::Result<Option<File>> {
+        let deadline = timeout.map(|timeout| Instant::now() + timeout);
+        loop {
+            let wait_ms = match deadline {
+                None => -1,
+                Some(deadline) => {
+                    let now = Instant::now();
+                    if now >= deadline {
+                        return Ok(None);
+                    }
+                    let left = deadline - now;
+                    cmp::min(left.as_secs() * 1000 + (left.subsec_nanos() as u64 + 999_999) / 1_000_000,
+                             i32::max_value() as u64) as libc::c_int
+                }
+            };
+
+            let mut pollfd = libc::pollfd { fd: self.socket.as_raw_fd(), events: libc::POLLIN, revents: 0 };
+            match cvt(unsafe { libc::poll(&mut pollfd, 1, wait_ms) }) {
+                Ok(0) => continue,
+                Ok(_) => {}
+                Err(ref e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e),
+            }
+
+            let socket = match accept(&self.socket) {
+                Ok(socket) => socket,
+                // Someone else took it, or the client gave up already
+                Err(ref e) if match e.kind() {
+                    io::ErrorKind::WouldBlock | io::ErrorKind::Interrupted | io::ErrorKind::ConnectionAborted => true,
+                    _ => false,
+                } => continue,
+                Err(e) => return Err(e),
+            };
+
+            // The connection itself blocks
+            try!(set_nonblocking(socket.as_raw_fd(), false));
+            return Ok(Some(socket));
+        }
+    }
+}
+
+impl Drop for Listener {
+    fn drop(&mut self) {
+        fs::remove_file(&self.path).ok();
+    }
+}
+
+pub fn connect(path: &str) -> io::Result<File> {
+    let socket = try!(new_socket());
+    let (addr, len) = try!(address(path));
+    try!(cvt(unsafe { libc::connect(socket.as_raw_fd(), &addr as *const _ as *const libc::sockaddr, len) }));
+    Ok(socket)
+}
+
+/// Split a connected socket into the halves the I/O threads use
+pub fn split(socket: File) -> io::Result<(PacketReader, PacketWriter)> {
+    let writer = try!(socket.try_clone());
+    let reader = PacketReader {
+        socket: socket,
+        packet: vec![0; PACKET_SIZE].into_boxed_slice(),
+        start: 0,
+        end: 0,
+        fds: VecDeque::new(),
+    };
+    Ok((reader, PacketWriter { socket: writer }))
+}
+
+pub struct PacketReader {
+    socket: File,
+    packet: Box<[u8]>,
+    start: usize,
+    end: usize,
+    fds: VecDeque<File>,
+}
+
+impl PacketReader {
+    fn recv(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let mut iovec = libc::iovec { iov_base: buf.as_mut_ptr() as *mut libc::c_void, iov_len: buf.len() };
+        let mut control = [0u64; CONTROL_WORDS];
+        let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+        msg.msg_iov = &mut iovec;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+        msg.msg_controllen = mem::size_of_val(&control) as _;
+
+        let n = unsafe { libc::recvmsg(self.socket.as_raw_fd(), &mut msg, RECV_FLAGS) };
+        if n == -1 {
+            return Err(io::Error::last_os_error());
+        }
+
+        unsafe {
+            let mut cmsg = libc::CMSG_FIRSTHDR(&msg);
+            while !cmsg.is_null() {
+                if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+                    let fds = libc::CMSG_DATA(cmsg) as *const libc::c_int;
+                    let count = ((*cmsg).cmsg_len as usize - libc::CMSG_LEN(0) as usize) / mem::size_of::<libc::c_int>();
+                    for i in 0..count {
+                        let fd = ptr::read_unaligned(fds.offset(i as isize));
+                        self.fds.push_back(File::from_raw_fd(fd));
+                        // Can't fail on a descriptor that was just received
+                        #[cfg(not(target_os = "linux"))]
+                        set_cloexec(fd).ok();
+                    }
+                }
+                cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+            }
+        }
+        Ok(n as usize)
+    }
+}
+
+impl Read for PacketReader {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        if self.start == self.end {
+            if buf.len() >= PACKET_SIZE {
+                return self.recv(buf);
+            }
+
+            let mut packet = mem::replace(&mut self.packet, Box::new([]));
+            let result = self.recv(&mut packet);
+            self.packet = packet;
+            self.start = 0;
+            self.end = try!(result);
+        }
+
+        let n = cmp::min(buf.len(), self.end - self.start);
+        buf[..n].copy_from_slice(&self.packet[self.start..self.start + n]);
+        self.start += n;
+        Ok(n)
+    }
+}
+
+impl Source for PacketReader {
+    fn take_fd(&mut self) -> Option<File> {
+        self.fds.pop_front()
+    }
+}
+
+impl AsRawFd for PacketReader {
+    fn as_raw_fd(&self) -> RawFd {
+        self.socket.as_raw_fd()
+    }
+}
+
+pub struct PacketWriter {
+    socket: File,
+}
+
+impl PacketWriter {
+    fn send(&mut self, bufs: &[IoSlice], fd: Option<RawFd>) -> io::Result<usize> {
+        // Take as much of the slices as fits in one packet
+        let mut iovecs = [libc::iovec { iov_base: ptr::null_mut(), iov_len: 0 }; MAX_IOVECS];
+        let mut count = 0;
+        let mut total = 0;
+        for buf in bufs.iter().take(MAX_IOVECS) {
+            if total == PACKET_SIZE {
+                break;
+            }
+            let len = cmp::min(buf.len(), PACKET_SIZE - total);
+            iovecs[count] = libc::iovec { iov_base: buf.as_ptr() as *mut libc::c_void, iov_len: len };
+            count += 1;
+            total += len;
+        }
+
+        let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+        msg.msg_iov = iovecs.as_mut_ptr();
+        msg.msg_iovlen = count as _;
+
+        let mut control = [0u64; CONTROL_WORDS];
+        if let Some(fd) = fd {
+            unsafe {
+                msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+                msg.msg_controllen = libc::CMSG_SPACE(mem::size_of::<libc::c_int>() as u32) as _;
+                let cmsg = libc::CMSG_FIRSTHDR(&msg);
+                (*cmsg).cmsg_level = libc::SOL_SOCKET;
+                (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+                (*cmsg).cmsg_len = libc::CMSG_LEN(mem::size_of::<libc::c_int>() as u32) as _;
+                ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut libc::c_int, fd);
+            }
+        }
+
+        // MSG_NOSIGNAL: a peer that went away is an error, not a SIGPIPE
+        let n = unsafe { libc::sendmsg(self.socket.as_raw_fd(), &msg, libc::MSG_NOSIGNAL) };
+        if n == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(n as usize)
+    }
+}
+
+impl Write for PacketWriter {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.send(&[IoSlice::new(buf)], None)
+    }
+
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        self.send(bufs, None)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+impl Sink for PacketWriter {
+    fn write_with_fd(&mut self, bufs: &[IoSlice], fd: &File) -> io::Result<usize> {
+        self.send(bufs, Some(fd.as_raw_fd()))
+    }
+}
+
+impl AsRawFd for PacketWriter {
+    fn as_raw_fd(&self) -> RawFd {
+        self.socket.as_raw_fd()
+    }
+}
+
+impl Drop for PacketWriter {
+    fn drop(&mut self) {
+        // The reader half shares the socket, so closing this fd alone wouldn't tell the peer
+        unsafe { libc::shutdown(self.socket.as_raw_fd(), libc::SHUT_WR) };
+    }
+}
@@ -0,0 +1,80 @@
+//! Busy-polling for the low-latency mode.
+//!
+//! Instead of parking straight away, a receiver can spin for a while on the bet that the next
+//! message is only microseconds off. Parking costs a futex syscall on both sides and a trip
+//! through the scheduler, which is most of a round trip once the transport itself needs no
+//! syscall per message.
+//!
+//! The budget adapts. A spin that runs out halves it, down to a sixteenth, and one that pays
+//! off restores it, so a connection gone quiet doesn't keep burning a core. Spinning only
+//! helps while the other side has a core of its own, so it is off on a single-CPU machine.
+
+use std::cmp;
+use std::hint;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+#[cfg(unix)]
+use libc;
+
+// Reading the clock costs more than a poll, so only look at it every so often
+const POLLS_PER_CLOCK: u32 = 64;
+
+pub struct Spin {
+    budget_ns: u64,
+    current_ns: AtomicU64,
+}
+
+fn nanos(duration: Duration) -> u64 {
+    duration.as_secs().saturating_mul(1000000000).saturating_add(duration.subsec_nanos() as u64)
+}
+
+#[cfg(unix)]
+fn multi_core() -> bool {
+    unsafe { libc::sysconf(libc::_SC_NPROCESSORS_ONLN) > 1 }
+}
+
+#[cfg(windows)]
+fn multi_core() -> bool {
+    true
+}
+
+impl Spin {
+    pub fn new(budget: Duration) -> Spin {
+        let budget_ns = if budget == Duration::from_secs(0) || !multi_core() { 0 } else { nanos(budget) };
+        Spin {
+            budget_ns: budget_ns,
+            current_ns: AtomicU64::new(budget_ns),
+        }
+    }
+
+    /// Poll `done` until it returns true, for no longer than the budget or `limit` (no limit
+    /// if None). Returns what `done` last returned.
+    pub fn wait<F: FnMut() -> bool>(&self, limit: Option<Duration>, mut done: F) -> bool {
+        let current = self.current_ns.load(Ordering::Relaxed);
+        let budget = limit.map_or(current, |limit| cmp::min(current, nanos(limit)));
+        if budget == 0 {
+            return done();
+        }
+
+        let start = Instant::now();
+        let mut polls = 0u32;
+        loop {
+            if done() {
+                self.current_ns.store(self.budget_ns, Ordering::Relaxed);
+                return true;
+            }
+            polls += 1;
+            if polls % POLLS_PER_CLOCK == 0 && nanos(start.elapsed()) >= budget {
+                break;
+            }
+            hint::spin_loop();
+        }
+
+        // Running into the caller's own limit says nothing about how useful spinning is
+        if budget == current {
+            self.current_ns.store(cmp::max(current / 2, self.budget_ns / 16), Ordering::Relaxed);
+        }
+        false
+    }
+}
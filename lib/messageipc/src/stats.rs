@@ -0,0 +1,143 @@
+//! Per-connection counters, kept by the I/O side of a connection and read by anyone.
+//!
+//! Each counter has a single writer (the read side counts what it receives, the write side
+//! what it sends), so they are plain relaxed atomics. A snapshot is not taken atomically
+//! across counters, but every counter in it only ever grows.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+use queue::Depth;
+
+/// Buckets in a message size histogram. Bucket 0 counts empty messages, bucket `i` those of
+/// 2^(i-1) to 2^i - 1 bytes, and the last bucket everything bigger as well.
+pub const SIZE_BUCKETS: usize = 32;
+
+fn bucket(len: usize) -> usize {
+    let bits = (0usize.leading_zeros() - len.leading_zeros()) as usize;
+    if bits < SIZE_BUCKETS { bits } else { SIZE_BUCKETS - 1 }
+}
+
+/// A snapshot of a connection's counters. Mirrors `IpcStats` in messageipc.h, so fields may
+/// only ever be appended.
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default)]
+pub struct Stats {
+    /// Messages handed to the transport, and their bytes before any compression. Streams add
+    /// to the bytes but are not messages.
+    pub messages_sent: u64,
+    pub bytes_sent: u64,
+    /// Messages taken off the transport, and their bytes after any decompression. Streams
+    /// add to the bytes but are not messages.
+    pub messages_received: u64,
+    pub bytes_received: u64,
+    /// Bytes actually written to and read from the transport, framing and compression
+    /// included
+    pub wire_bytes_sent: u64,
+    pub wire_bytes_received: u64,
+    /// What is waiting in the send queue now, and the most it has ever held
+    pub send_queue_messages: u64,
+    pub send_queue_bytes: u64,
+    pub send_queue_peak_messages: u64,
+    pub send_queue_peak_bytes: u64,
+    /// The same for the receive queue. Stream chunks wait in a queue of their own and are
+    /// not included.
+    pub recv_queue_messages: u64,
+    pub recv_queue_bytes: u64,
+    pub recv_queue_peak_messages: u64,
+    pub recv_queue_peak_bytes: u64,
+    /// Time the writer spent in write calls, most of which is waiting for the peer to make
+    /// room. Always 0 in the reactor I/O modes, whose writes never wait.
+    pub write_blocked_ns: u64,
+    /// Message sizes, bucketed as described for SIZE_BUCKETS
+    pub sent_sizes: [u64; SIZE_BUCKETS],
+    pub received_sizes: [u64; SIZE_BUCKETS],
+}
+
+#[derive(Default)]
+struct Direction {
+    messages: AtomicU64,
+    bytes: AtomicU64,
+    wire_bytes: AtomicU64,
+    sizes: [AtomicU64; SIZE_BUCKETS],
+}
+
+impl Direction {
+    fn message(&self, len: usize) {
+        self.messages.fetch_add(1, Ordering::Relaxed);
+        self.bytes.fetch_add(len as u64, Ordering::Relaxed);
+        self.sizes[bucket(len)].fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn snapshot(&self, sizes: &mut [u64; SIZE_BUCKETS]) -> (u64, u64, u64) {
+        for (count, size) in sizes.iter_mut().zip(&self.sizes) {
+            *count = size.load(Ordering::Relaxed);
+        }
+        (self.messages.load(Ordering::Relaxed), self.bytes.load(Ordering::Relaxed),
+         self.wire_bytes.load(Ordering::Relaxed))
+    }
+}
+
+/// The live counters behind `Stats`
+#[derive(Default)]
+pub struct Counters {
+    sent: Direction,
+    received: Direction,
+    write_blocked_ns: AtomicU64,
+}
+
+impl Counters {
+    pub fn sent_message(&self, len: usize) {
+        self.sent.message(len);
+    }
+
+    pub fn sent_chunk(&self, len: usize) {
+        self.sent.bytes.fetch_add(len as u64, Ordering::Relaxed);
+    }
+
+    pub fn wrote(&self, wire_bytes: usize) {
+        self.sent.wire_bytes.fetch_add(wire_bytes as u64, Ordering::Relaxed);
+    }
+
+    pub fn write_blocked(&self, elapsed: Duration) {
+        let ns = elapsed.as_secs() * 1_000_000_000 + elapsed.subsec_nanos() as u64;
+        self.write_blocked_ns.fetch_add(ns, Ordering::Relaxed);
+    }
+
+    pub fn received_message(&self, len: usize) {
+        self.received.message(len);
+    }
+
+    pub fn received_chunk(&self, len: usize) {
+        self.received.bytes.fetch_add(len as u64, Ordering::Relaxed);
+    }
+
+    pub fn read(&self, wire_bytes: usize) {
+        self.received.wire_bytes.fetch_add(wire_bytes as u64, Ordering::Relaxed);
+    }
+
+    /// Take a snapshot, filling in the queue depths from the connection's queues
+    pub fn snapshot(&self, send: Depth, recv: Depth) -> Stats {
+        let mut stats = Stats::default();
+        let (messages, bytes, wire_bytes) = self.sent.snapshot(&mut stats.sent_sizes);
+        stats.messages_sent = messages;
+        stats.bytes_sent = bytes;
+        stats.wire_bytes_sent = wire_bytes;
+        let (messages, bytes, wire_bytes) = self.received.snapshot(&mut stats.received_sizes);
+        stats.messages_received = messages;
+        stats.bytes_received = bytes;
+        stats.wire_bytes_received = wire_bytes;
+
+        stats.send_queue_messages = send.messages as u64;
+        stats.send_queue_bytes = send.bytes as u64;
+        stats.send_queue_peak_messages = send.peak_messages as u64;
+        stats.send_queue_peak_bytes = send.peak_bytes as u64;
+        stats.recv_queue_messages = recv.messages as u64;
+        stats.recv_queue_bytes = recv.bytes as u64;
+        stats.recv_queue_peak_messages = recv.peak_messages as u64;
+        stats.recv_queue_peak_bytes = recv.peak_bytes as u64;
+
+        stats.write_blocked_ns = self.write_blocked_ns.load(Ordering::Relaxed);
+        stats
+    }
+}
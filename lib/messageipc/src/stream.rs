@@ -0,0 +1,73 @@
+//! Streams: one message of any length, sent and received a chunk at a time.
+//!
+//! Chunks go through the connection's queues like messages do, so they are held to the same
+//! watermarks and neither end ever has more of a stream in memory than those allow. A
+//! connection has at most one outgoing stream at a time, which is what lets the receiver read
+//! the chunks back in order without any stream ids on the wire.
+
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+
+use frame::{self, Frame};
+use pool::{Buffer, Pool};
+use queue::{Queue, RecvError, SendError, Space};
+
+/// The sending end of a stream. Dropping it ends the stream.
+pub struct StreamWriter {
+    send: Arc<Queue<Frame>>,
+    pool: Arc<Pool>,
+    open: Arc<AtomicBool>,
+}
+
+impl StreamWriter {
+    /// Start a stream on `send`, unless `open` says one already is
+    pub(crate) fn begin(send: &Arc<Queue<Frame>>, pool: &Arc<Pool>, open: &Arc<AtomicBool>) -> Option<StreamWriter> {
+        if open.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed).is_err() {
+            return None;
+        }
+        Some(StreamWriter {
+            send: send.clone(),
+            pool: pool.clone(),
+            open: open.clone(),
+        })
+    }
+
+    /// Wait up to `timeout` (forever if None) for the send queue to have room, then queue
+    /// `data` as the next chunk. Empty chunks are skipped, since an empty chunk is what ends
+    /// a stream on the wire.
+    pub fn write_chunk(&self, data: &[u8], timeout: Option<Duration>) -> Result<(), SendError> {
+        if data.len() > frame::MAX_MESSAGE {
+            return Err(SendError::TooLarge);
+        }
+        if data.is_empty() {
+            return Ok(());
+        }
+        match self.send.wait_space(timeout) {
+            Space::Available if self.send.push(Frame::Chunk(Pool::copy(&self.pool, data))) => Ok(()),
+            Space::Full => Err(SendError::WouldBlock),
+            _ => Err(SendError::Disconnected),
+        }
+    }
+}
+
+impl Drop for StreamWriter {
+    fn drop(&mut self) {
+        // Let in over the watermarks; there is nobody left to wait for room
+        self.send.push(Frame::Chunk(Pool::get(&self.pool, 0)));
+        self.open.store(false, Ordering::Release);
+    }
+}
+
+/// Wait up to `timeout` (forever if None) for the next chunk of the stream being received.
+/// Ok(None) means the stream has ended, and the next call reads the one after it.
+pub(crate) fn read_chunk(chunks: &Queue<Buffer>, timeout: Option<Duration>) -> Result<Option<Buffer>, RecvError> {
+    let mut chunk = None;
+    match chunks.pop_many(1, timeout, |buffer| chunk = Some(buffer)) {
+        Some(_) => match chunk {
+            Some(chunk) => Ok(if chunk.is_empty() { None } else { Some(chunk) }),
+            None => Err(RecvError::Empty),
+        },
+        None => Err(RecvError::Disconnected),
+    }
+}
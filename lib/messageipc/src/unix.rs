@@ -1,12 +1,32 @@
-use std::sync::mpsc::{channel, Sender, Receiver, TryRecvError};
-use std::io::{Read, Write};
+use std::io::{IoSlice, Read, Write};
 use std::{io, thread};
 use std::ffi::CString;
 use std::fs::{self, File};
+use std::os::unix::io::RawFd;
+use std::path::Path;
+use std::sync::atomic::AtomicBool;
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
 
-use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
 use libc;
 
+use dispatch::{Dispatch, ReceiveHandler};
+use frame::{self, Frame, Inbox, Session, Sink, Source};
+use notify::{ReadyFd, SpaceFd};
+use options::{self, Options};
+use pool::{Buffer, Pool};
+use queue::{self, CloseGuard, Queue, RecvError, SendError, Space};
+use rpc::{self, Call, Calls, Request};
+#[cfg(target_os = "linux")]
+use memfd::SharedBuffer;
+#[cfg(target_os = "linux")]
+use reactor;
+#[cfg(target_os = "linux")]
+use shm;
+use socket::{self, PacketReader, PacketWriter};
+use stats::Stats;
+use stream::{self, StreamWriter};
+
 fn make_server(read_path: &str, write_path: &str) -> io::Result<(File, File)> {
     fs::remove_file(read_path).ok();
     fs::remove_file(write_path).ok();
@@ -23,115 +43,488 @@ fn make_server(read_path: &str, write_path: &str) -> io::Result<(File, File)> {
         }
     }
 
-    make_client(read_path, write_path)
+    // Opening a FIFO blocks until the other end is opened too, so the server opens
+    // its read end first and the client opens its write end first.
+    let read = try!(File::open(read_path));
+    let write = try!(fs::OpenOptions::new().write(true).read(false).open(write_path));
+    Ok((read, write))
 }
 
 fn make_client(read_path: &str, write_path: &str) -> io::Result<(File, File)> {
-    Ok((try!(File::open(read_path)), try!(fs::OpenOptions::new().write(true).read(false).open(write_path))))
+    let write = try!(fs::OpenOptions::new().write(true).read(false).open(write_path));
+    let read = try!(File::open(read_path));
+    Ok((read, write))
 }
 
 fn run<F: FnOnce() -> io::Result<()> + Send + 'static>(f: F) {
     thread::spawn(f);
 }
 
+enum Reader {
+    Pipe(File),
+    Socket(PacketReader),
+    #[cfg(target_os = "linux")]
+    Shm(shm::RingReader),
+}
+
+impl Read for Reader {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        match *self {
+            Reader::Pipe(ref mut file) => file.read(buf),
+            Reader::Socket(ref mut socket) => socket.read(buf),
+            #[cfg(target_os = "linux")]
+            Reader::Shm(ref mut ring) => ring.read(buf),
+        }
+    }
+}
+
+impl Source for Reader {
+    fn take_fd(&mut self) -> Option<File> {
+        match *self {
+            Reader::Socket(ref mut socket) => socket.take_fd(),
+            _ => None,
+        }
+    }
+}
+
+enum Writer {
+    Pipe(File),
+    Socket(PacketWriter),
+    #[cfg(target_os = "linux")]
+    Shm(shm::RingWriter),
+}
+
+impl Write for Writer {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        match *self {
+            Writer::Pipe(ref mut file) => file.write(buf),
+            Writer::Socket(ref mut socket) => socket.write(buf),
+            #[cfg(target_os = "linux")]
+            Writer::Shm(ref mut ring) => ring.write(buf),
+        }
+    }
+
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        match *self {
+            Writer::Pipe(ref mut file) => file.write_vectored(bufs),
+            Writer::Socket(ref mut socket) => socket.write_vectored(bufs),
+            #[cfg(target_os = "linux")]
+            Writer::Shm(ref mut ring) => ring.write_vectored(bufs),
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        match *self {
+            Writer::Pipe(ref mut file) => file.flush(),
+            Writer::Socket(ref mut socket) => socket.flush(),
+            #[cfg(target_os = "linux")]
+            Writer::Shm(ref mut ring) => ring.flush(),
+        }
+    }
+}
+
+impl Sink for Writer {
+    fn write_with_fd(&mut self, bufs: &[IoSlice], fd: &File) -> io::Result<usize> {
+        match *self {
+            Writer::Socket(ref mut socket) => socket.write_with_fd(bufs, fd),
+            _ => Err(io::Error::new(io::ErrorKind::InvalidInput, "transport can't pass descriptors")),
+        }
+    }
+}
+
+fn unsupported_transport() -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidInput, "transport is not supported on this platform")
+}
+
+fn check_io_mode(options: &Options) -> io::Result<()> {
+    let supported = match options.io_mode {
+        options::IO_THREADS => true,
+        // The reactor reads and writes raw descriptors. The shared-memory ring has none, and a
+        // socket's packet boundaries need the buffering in PacketReader.
+        #[cfg(target_os = "linux")]
+        options::IO_REACTOR | options::IO_MANUAL => options.transport == options::TRANSPORT_PIPE,
+        _ => false,
+    };
+    if supported {
+        Ok(())
+    } else {
+        Err(io::Error::new(io::ErrorKind::InvalidInput, "I/O mode is not supported for this transport"))
+    }
+}
+
 pub struct IpcClient {
-    send: Sender<Vec<u8>>,
-    recv: Receiver<Vec<u8>>,
+    send: Arc<Queue<Frame>>,
+    recv: Arc<Queue<Buffer>>,
+    chunks: Arc<Queue<Buffer>>,
+    requests: Arc<Queue<Request>>,
+    calls: Arc<Calls>,
+    dispatch: Arc<Dispatch>,
+    streaming: Arc<AtomicBool>,
+    pool: Arc<Pool>,
+    session: Arc<Session>,
+    ready_fd: Mutex<Option<Arc<ReadyFd>>>,
+    space_fd: Mutex<Option<Arc<SpaceFd>>>,
+    id: u32,
+    transport: u32,
 }
 
 impl IpcClient {
-    pub fn send(&self, message: Vec<u8>) -> bool {
-        self.send.send(message).is_ok()
+    /// Queue a message without waiting. Fails with WouldBlock while the send queue is over
+    /// its high watermark, or TooLarge if the message is over MAX_MESSAGE bytes.
+    pub fn send(&self, message: &[u8]) -> Result<(), SendError> {
+        self.send_timeout(message, Some(Duration::from_secs(0)))
     }
 
-    pub fn recv(&self) -> Option<Vec<u8>> {
-        self.recv.recv().ok()
+    /// Wait up to `timeout` (forever if None) for the send queue to have room, then queue a message
+    pub fn send_timeout(&self, message: &[u8], timeout: Option<Duration>) -> Result<(), SendError> {
+        if message.len() > frame::MAX_MESSAGE {
+            return Err(SendError::TooLarge);
+        }
+        match self.send.wait_space(timeout) {
+            Space::Available if self.send.push(Frame::Message(Pool::copy(&self.pool, message))) => Ok(()),
+            Space::Full => Err(SendError::WouldBlock),
+            _ => Err(SendError::Disconnected),
+        }
     }
 
-    pub fn try_recv(&self) -> Option<Option<Vec<u8>>> {
-        match self.recv.try_recv() {
-            Ok(buf) => Some(Some(buf)),
-            Err(TryRecvError::Empty) => Some(None),
-            Err(TryRecvError::Disconnected) => None
+    /// Queue one message made of all of `parts`, without concatenating them first. Fails with
+    /// WouldBlock while the send queue is over its high watermark.
+    pub fn send_vectored(&self, parts: &[&[u8]]) -> Result<(), SendError> {
+        if parts.iter().fold(0usize, |len, part| len.saturating_add(part.len())) > frame::MAX_MESSAGE {
+            return Err(SendError::TooLarge);
+        }
+        match self.send.wait_space(Some(Duration::from_secs(0))) {
+            Space::Available if self.send.push(Frame::Message(Pool::gather(&self.pool, parts))) => Ok(()),
+            Space::Full => Err(SendError::WouldBlock),
+            _ => Err(SendError::Disconnected),
         }
     }
 
-    pub fn open_server(name: &str) -> io::Result<IpcClient> {
-        let (send_tx, send_rx) = channel::<Vec<u8>>();
-        let (recv_tx, recv_rx) = channel::<Vec<u8>>();
+    /// Queue every message at once, so the writer thread flushes them together. The batch is
+    /// let in whole if the send queue has room at all, so it may overshoot the high watermark.
+    pub fn send_batch(&self, messages: &[&[u8]]) -> Result<(), SendError> {
+        if messages.iter().any(|message| message.len() > frame::MAX_MESSAGE) {
+            return Err(SendError::TooLarge);
+        }
+        let pool = &self.pool;
+        match self.send.wait_space(Some(Duration::from_secs(0))) {
+            Space::Available if self.send.push_all(messages.iter().map(|message| Frame::Message(Pool::copy(pool, message)))) => Ok(()),
+            Space::Full => Err(SendError::WouldBlock),
+            _ => Err(SendError::Disconnected),
+        }
+    }
 
-        let pid = unsafe { libc::getpid() as u32 };
-        let read_path = format!("/tmp/messageipc_{}_{}_toserver", name, pid);
-        let write_path = format!("/tmp/messageipc_{}_{}_toclient", name, pid);
+    /// Queue a message on the urgent lane. It goes out ahead of every normal message that hasn't
+    /// started yet, and between the fragments of a big one, and is delivered ahead of them too.
+    /// Never waits on the watermarks, so keep urgent traffic small.
+    pub fn send_urgent(&self, message: &[u8]) -> Result<(), SendError> {
+        if message.len() > frame::MAX_MESSAGE {
+            return Err(SendError::TooLarge);
+        }
+        if self.send.push_urgent(Frame::Urgent(Pool::copy(&self.pool, message))) {
+            Ok(())
+        } else {
+            Err(SendError::Disconnected)
+        }
+    }
 
-        let (mut read_server, mut write_server) = try!(make_server(&read_path, &write_path));
+    pub fn recv(&self) -> Option<Buffer> {
+        self.recv.pop()
+    }
 
-        // Read thread
-        run(move || {
-            loop {
-                let bytes = try!(read_server.read_u32::<LittleEndian>());
-                let mut buffer = vec![0; bytes as usize];
-                try!(read_server.read_exact(&mut buffer[..]));
-
-                if let Err(_) = recv_tx.send(buffer) {
-                    return Ok(());
-                }
-            }
+    pub fn try_recv(&self) -> Option<Option<Buffer>> {
+        self.recv.try_pop()
+    }
+
+    /// Wait up to `timeout` (forever if None) for a message. Returns None if disconnected,
+    /// Some(None) if nothing arrived in time.
+    pub fn recv_timeout(&self, timeout: Option<Duration>) -> Option<Option<Buffer>> {
+        let mut message = None;
+        self.recv.pop_many(1, timeout, |buffer| message = Some(buffer)).map(|_| message)
+    }
+
+    /// Wait up to `timeout` (forever if None) for a message and copy it into `buf`, returning
+    /// its length. A message that doesn't fit stays queued.
+    pub fn recv_into(&self, buf: &mut [u8], timeout: Option<Duration>) -> Result<usize, RecvError> {
+        let mut needed = 0;
+        let message = self.recv.pop_if(timeout, |message| {
+            needed = message.len();
+            needed <= buf.len()
         });
 
-        // Write thread
-        run(move || {
-            while let Ok(buffer) = send_rx.recv() {
-                let size = buffer.len() as u32;
-                try!(write_server.write_u32::<LittleEndian>(size));
-                try!(write_server.write_all(&buffer[..]));
+        match message {
+            Some(Some(message)) => {
+                buf[..message.len()].copy_from_slice(&message);
+                Ok(message.len())
             }
+            Some(None) if needed > buf.len() => Err(RecvError::TooSmall(needed)),
+            Some(None) => Err(RecvError::Empty),
+            None => Err(RecvError::Disconnected),
+        }
+    }
 
-            Ok(())
-        });
+    /// Wait up to `timeout` (forever if None) for messages, then hand up to `max` of the
+    /// ones already received to `f`. Returns None once disconnected and drained.
+    pub fn recv_many<F: FnMut(Buffer)>(&self, max: usize, timeout: Option<Duration>, f: F) -> Option<usize> {
+        self.recv.pop_many(max, timeout, f)
+    }
 
-        Ok(IpcClient {
-            send: send_tx,
-            recv: recv_rx,
-        })
+    /// Wait up to `timeout` (forever if None) for any of `clients` to have a message waiting or
+    /// be disconnected, and return the index of the first that does. Returns None if none did
+    /// in time. Clients with a receive handler never have messages waiting.
+    pub fn wait_any(clients: &[&IpcClient], timeout: Option<Duration>) -> Option<usize> {
+        let queues: Vec<&Queue<Buffer>> = clients.iter().map(|client| &*client.recv).collect();
+        queue::wait_any(&queues, timeout)
     }
-    
-    pub fn open_client(name: &str, pid: u32) -> io::Result<IpcClient> {
-        let (send_tx, send_rx) = channel::<Vec<u8>>();
-        let (recv_tx, recv_rx) = channel::<Vec<u8>>();
 
-        let read_path = format!("/tmp/messageipc_{}_{}_toclient", name, pid);
-        let write_path = format!("/tmp/messageipc_{}_{}_toserver", name, pid);
+    /// Have messages handed to `handler` on the I/O thread as they arrive instead of queued
+    /// for `recv`, starting with any already queued. None goes back to queueing. Not to be
+    /// called from inside a handler.
+    pub fn set_receive_handler(&self, handler: Option<ReceiveHandler>) {
+        self.dispatch.set(handler, &self.recv);
+    }
 
-        let (mut read_client, mut write_client) = try!(make_client(&read_path, &write_path));
+    /// Allocate a buffer to fill and then send with `send_shared`. Only TRANSPORT_SOCKET can
+    /// pass one to the peer.
+    #[cfg(target_os = "linux")]
+    pub fn alloc_shared(&self, len: usize) -> io::Result<SharedBuffer> {
+        if self.transport != options::TRANSPORT_SOCKET {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "only sockets can send shared buffers"));
+        }
+        SharedBuffer::new(len)
+    }
 
-        // Read thread
-        run(move || {
-            loop {
-                let bytes = try!(read_client.read_u32::<LittleEndian>());
-                let mut buffer = vec![0; bytes as usize];
-                try!(read_client.read_exact(&mut buffer[..]));
-
-                if let Err(_) = recv_tx.send(buffer) {
-                    return Ok(());
+    /// Wait up to `timeout` (forever if None) for the send queue to have room, then hand the
+    /// buffer's memory to the peer as the next message. Nothing is copied; the peer maps it.
+    /// The buffer is gone either way.
+    #[cfg(target_os = "linux")]
+    pub fn send_shared(&self, buffer: SharedBuffer, timeout: Option<Duration>) -> Result<(), SendError> {
+        match self.send.wait_space(timeout) {
+            Space::Available => {
+                let (file, len) = buffer.seal();
+                if self.send.push(Frame::Shared(file, len)) {
+                    Ok(())
+                } else {
+                    Err(SendError::Disconnected)
                 }
             }
-        });
+            Space::Full => Err(SendError::WouldBlock),
+            Space::Closed => Err(SendError::Disconnected),
+        }
+    }
 
-        // Write thread
-        run(move || {
-            while let Ok(buffer) = send_rx.recv() {
-                let size = buffer.len() as u32;
-                try!(write_client.write_u32::<LittleEndian>(size));
-                try!(write_client.write_all(&buffer[..]));
+    /// Start sending a stream. Returns None while the last one is still open.
+    pub fn begin_stream(&self) -> Option<StreamWriter> {
+        StreamWriter::begin(&self.send, &self.pool, &self.streaming)
+    }
+
+    /// Wait up to `timeout` (forever if None) for the next chunk of the stream being received.
+    /// Ok(None) means the stream has ended, and the next call reads the one after it.
+    pub fn read_chunk(&self, timeout: Option<Duration>) -> Result<Option<Buffer>, RecvError> {
+        stream::read_chunk(&self.chunks, timeout)
+    }
+
+    /// Send `body` as a request and return the call to wait on for its response. `timeout`
+    /// (forever if None) only covers waiting for the send queue to have room.
+    pub fn call(&self, body: &[u8], timeout: Option<Duration>) -> Result<Call, SendError> {
+        rpc::call(&self.send, &self.pool, &self.calls, body, timeout)
+    }
+
+    /// Send `body` as a request and have `callback` run with the response, on the I/O thread
+    /// that receives it. It runs with Disconnected instead if the response never comes.
+    pub fn call_with<F>(&self, body: &[u8], timeout: Option<Duration>, callback: F) -> Result<(), SendError>
+        where F: FnOnce(Result<Buffer, RecvError>) + Send + 'static {
+        rpc::call_with(&self.send, &self.pool, &self.calls, body, timeout, Box::new(callback))
+    }
+
+    /// Wait up to `timeout` (forever if None) for the peer's next request
+    pub fn recv_request(&self, timeout: Option<Duration>) -> Result<Request, RecvError> {
+        rpc::recv_request(&self.requests, timeout)
+    }
+
+    /// Send the response to the peer's request `id`
+    pub fn respond(&self, id: u64, body: &[u8], timeout: Option<Duration>) -> Result<(), SendError> {
+        rpc::respond(&self.send, &self.pool, id, body, timeout)
+    }
+
+    /// A descriptor that polls readable while messages are waiting or once the connection is
+    /// gone. It is created on first use and belongs to the client.
+    pub fn readable_fd(&self) -> io::Result<RawFd> {
+        let mut ready_fd = self.ready_fd.lock().unwrap();
+        if let Some(ref fd) = *ready_fd {
+            return Ok(fd.fd());
+        }
+
+        let fd = Arc::new(try!(ReadyFd::new()));
+        self.recv.watch(fd.clone());
+        *ready_fd = Some(fd.clone());
+        Ok(fd.fd())
+    }
+
+    /// A descriptor that polls readable while `send` would queue a message rather than fail
+    /// with WouldBlock, and once the connection is gone. Created on first use, like
+    /// `readable_fd`.
+    pub fn writable_fd(&self) -> io::Result<RawFd> {
+        let mut space_fd = self.space_fd.lock().unwrap();
+        if let Some(ref fd) = *space_fd {
+            return Ok(fd.fd());
+        }
+
+        let fd = Arc::new(try!(SpaceFd::new()));
+        self.send.watch(fd.clone());
+        *space_fd = Some(fd.clone());
+        Ok(fd.fd())
+    }
+
+    /// Which of an IpcServer's clients this is, or 0 if it didn't come from an IpcServer
+    pub fn id(&self) -> u32 {
+        self.id
+    }
+
+    /// What has gone through the connection so far, and how full its queues are
+    pub fn stats(&self) -> Stats {
+        self.session.stats.snapshot(self.send.depth(), self.recv.depth())
+    }
+
+    /// Record every message sent and received from now on to a new file at `path`, ending
+    /// any capture already running. Read it back with CaptureReader.
+    pub fn start_capture<P: AsRef<Path>>(&self, path: P) -> io::Result<()> {
+        self.session.capture.start(path.as_ref())
+    }
+
+    /// Stop recording and flush the file. Returns the first error writing it, if any; the
+    /// capture stopped there. A capture still running when the client closes is flushed then.
+    pub fn stop_capture(&self) -> io::Result<()> {
+        self.session.capture.stop()
+    }
+
+    pub(crate) fn recv_queue(&self) -> &Arc<Queue<Buffer>> {
+        &self.recv
+    }
+
+    pub fn open_server(name: &str, options: &Options) -> io::Result<IpcClient> {
+        try!(check_io_mode(options));
+        let pid = unsafe { libc::getpid() as u32 };
+
+        let (reader, writer) = match options.transport {
+            options::TRANSPORT_PIPE => {
+                let read_path = format!("/tmp/messageipc_{}_{}_toserver", name, pid);
+                let write_path = format!("/tmp/messageipc_{}_{}_toclient", name, pid);
+                let (read, write) = try!(make_server(&read_path, &write_path));
+                (Reader::Pipe(read), Writer::Pipe(write))
+            }
+            #[cfg(target_os = "linux")]
+            options::TRANSPORT_SHM => {
+                let (read, write) = try!(shm::open_server(name, pid, options.ring_size, options.spin()));
+                (Reader::Shm(read), Writer::Shm(write))
             }
+            options::TRANSPORT_SOCKET => {
+                // Exactly one client, like the other transports; IpcServer takes many
+                let listener = try!(socket::Listener::bind(&socket::path(name, pid)));
+                let (read, write) = try!(socket::split(try!(listener.accept(None)).unwrap()));
+                (Reader::Socket(read), Writer::Socket(write))
+            }
+            _ => return Err(unsupported_transport()),
+        };
 
-            Ok(())
-        });
+        IpcClient::start(reader, writer, options)
+    }
+
+    pub fn open_client(name: &str, pid: u32, options: &Options) -> io::Result<IpcClient> {
+        try!(check_io_mode(options));
+        let (reader, writer) = match options.transport {
+            options::TRANSPORT_PIPE => {
+                let read_path = format!("/tmp/messageipc_{}_{}_toclient", name, pid);
+                let write_path = format!("/tmp/messageipc_{}_{}_toserver", name, pid);
+                let (read, write) = try!(make_client(&read_path, &write_path));
+                (Reader::Pipe(read), Writer::Pipe(write))
+            }
+            #[cfg(target_os = "linux")]
+            options::TRANSPORT_SHM => {
+                let (read, write) = try!(shm::open_client(name, pid, options.spin()));
+                (Reader::Shm(read), Writer::Shm(write))
+            }
+            options::TRANSPORT_SOCKET => {
+                let (read, write) = try!(socket::split(try!(socket::connect(&socket::path(name, pid)))));
+                (Reader::Socket(read), Writer::Socket(write))
+            }
+            _ => return Err(unsupported_transport()),
+        };
+
+        IpcClient::start(reader, writer, options)
+    }
+
+    /// Wrap a connection an IpcServer accepted
+    pub(crate) fn accepted(socket: File, id: u32, options: &Options) -> io::Result<IpcClient> {
+        let options = &Options { transport: options::TRANSPORT_SOCKET, ..*options };
+        try!(check_io_mode(options));
+        let (read, write) = try!(socket::split(socket));
+        let mut client = try!(IpcClient::start(Reader::Socket(read), Writer::Socket(write), options));
+        client.id = id;
+        Ok(client)
+    }
+
+    fn start(reader: Reader, writer: Writer, options: &Options) -> io::Result<IpcClient> {
+        let client = IpcClient {
+            send: Queue::spinning(options.queue_limits(), Frame::weight, options.spin()),
+            recv: Queue::spinning(options.queue_limits(), Buffer::weight, options.spin()),
+            chunks: Queue::spinning(options.queue_limits(), Buffer::weight, options.spin()),
+            requests: Queue::spinning(options.queue_limits(), Request::weight, options.spin()),
+            calls: Calls::new(),
+            dispatch: Dispatch::new(),
+            streaming: Arc::new(AtomicBool::new(false)),
+            pool: Pool::new(),
+            session: Session::new(options),
+            ready_fd: Mutex::new(None),
+            space_fd: Mutex::new(None),
+            id: 0,
+            transport: options.transport,
+        };
+
+        match (reader, writer) {
+            #[cfg(target_os = "linux")]
+            (Reader::Pipe(read), Writer::Pipe(write)) if options.io_mode != options::IO_THREADS => {
+                let reactor = try!(if options.io_mode == options::IO_REACTOR {
+                    reactor::background()
+                } else {
+                    reactor::manual()
+                });
+                try!(reactor.register(read, write, &client.send, client.inbox(), &client.pool, &client.session));
+            }
+            (reader, writer) => client.spawn(reader, writer),
+        }
+
+        Ok(client)
+    }
+
+    fn inbox(&self) -> Inbox {
+        Inbox {
+            messages: self.recv.clone(),
+            chunks: self.chunks.clone(),
+            requests: self.requests.clone(),
+            calls: self.calls.clone(),
+            dispatch: self.dispatch.clone(),
+        }
+    }
+
+    fn spawn(&self, mut reader: Reader, mut writer: Writer) {
+        // Read thread
+        let (inbox, read_pool, read_session) = (self.inbox(), self.pool.clone(), self.session.clone());
+        run(move || frame::read_messages(&mut reader, &read_session, &read_pool, &inbox));
+
+        // Write thread
+        let (write_queue, write_pool, session) = (CloseGuard(self.send.clone()), self.pool.clone(), self.session.clone());
+        run(move || frame::write_messages(&mut writer, &session, &write_pool, &write_queue.0));
+    }
+}
 
-        Ok(IpcClient {
-            send: send_tx,
-            recv: recv_rx,
-        })
+impl Drop for IpcClient {
+    fn drop(&mut self) {
+        // The writer thread still flushes whatever was already queued
+        self.send.close();
+        self.recv.close();
+        self.chunks.close();
+        self.requests.close();
+        self.calls.close();
     }
 }
@@ -1,11 +1,22 @@
-use std::sync::mpsc::{channel, Sender, Receiver, TryRecvError, sync_channel, SyncSender};
-use std::io::{Read, Write};
+use std::path::Path;
+use std::sync::mpsc::{sync_channel, SyncSender};
 use std::{io, thread};
+use std::sync::atomic::AtomicBool;
+use std::sync::Arc;
+use std::time::Duration;
 
-use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
-use named_pipe::{PipeOptions, OpenMode, PipeClient};
+use named_pipe::{PipeOptions, OpenMode, PipeClient, PipeServer};
 use libc;
 
+use options::{self, Options};
+use dispatch::{Dispatch, ReceiveHandler};
+use frame::{self, Frame, Inbox, Session, Sink, Source};
+use pool::{Buffer, Pool};
+use queue::{self, CloseGuard, Queue, RecvError, SendError, Space};
+use rpc::{self, Call, Calls, Request};
+use stats::Stats;
+use stream::{self, StreamWriter};
+
 fn run<F: FnOnce(&SyncSender<()>) -> io::Result<()> + Send + 'static>(_: &'static str, f: F) {
     let (sync_tx, sync_rx) = sync_channel(0);
     thread::spawn(move || {
@@ -21,33 +32,220 @@ fn run<F: FnOnce(&SyncSender<()>) -> io::Result<()> + Send + 'static>(_: &'stati
 }
 
 pub struct IpcClient {
-    send: Sender<Vec<u8>>,
-    recv: Receiver<Vec<u8>>,
+    send: Arc<Queue<Frame>>,
+    recv: Arc<Queue<Buffer>>,
+    chunks: Arc<Queue<Buffer>>,
+    requests: Arc<Queue<Request>>,
+    calls: Arc<Calls>,
+    dispatch: Arc<Dispatch>,
+    streaming: Arc<AtomicBool>,
+    pool: Arc<Pool>,
+    session: Arc<Session>,
 }
 
+impl Source for PipeServer {}
+impl Sink for PipeServer {}
+impl Source for PipeClient {}
+impl Sink for PipeClient {}
+
 struct S<T>(T);
 unsafe impl<T> Send for S<T> {}
 
 impl IpcClient {
-    pub fn send(&self, message: Vec<u8>) -> bool {
-        self.send.send(message).is_ok()
+    /// Queue a message without waiting. Fails with WouldBlock while the send queue is over
+    /// its high watermark, or TooLarge if the message is over MAX_MESSAGE bytes.
+    pub fn send(&self, message: &[u8]) -> Result<(), SendError> {
+        self.send_timeout(message, Some(Duration::from_secs(0)))
     }
 
-    pub fn recv(&self) -> Option<Vec<u8>> {
-        self.recv.recv().ok()
+    /// Wait up to `timeout` (forever if None) for the send queue to have room, then queue a message
+    pub fn send_timeout(&self, message: &[u8], timeout: Option<Duration>) -> Result<(), SendError> {
+        if message.len() > frame::MAX_MESSAGE {
+            return Err(SendError::TooLarge);
+        }
+        match self.send.wait_space(timeout) {
+            Space::Available if self.send.push(Frame::Message(Pool::copy(&self.pool, message))) => Ok(()),
+            Space::Full => Err(SendError::WouldBlock),
+            _ => Err(SendError::Disconnected),
+        }
     }
 
-    pub fn try_recv(&self) -> Option<Option<Vec<u8>>> {
-        match self.recv.try_recv() {
-            Ok(buf) => Some(Some(buf)),
-            Err(TryRecvError::Empty) => Some(None),
-            Err(TryRecvError::Disconnected) => None
+    /// Queue one message made of all of `parts`, without concatenating them first. Fails with
+    /// WouldBlock while the send queue is over its high watermark.
+    pub fn send_vectored(&self, parts: &[&[u8]]) -> Result<(), SendError> {
+        if parts.iter().fold(0usize, |len, part| len.saturating_add(part.len())) > frame::MAX_MESSAGE {
+            return Err(SendError::TooLarge);
+        }
+        match self.send.wait_space(Some(Duration::from_secs(0))) {
+            Space::Available if self.send.push(Frame::Message(Pool::gather(&self.pool, parts))) => Ok(()),
+            Space::Full => Err(SendError::WouldBlock),
+            _ => Err(SendError::Disconnected),
+        }
+    }
+
+    /// Queue every message at once, so the writer thread flushes them together. The batch is
+    /// let in whole if the send queue has room at all, so it may overshoot the high watermark.
+    pub fn send_batch(&self, messages: &[&[u8]]) -> Result<(), SendError> {
+        if messages.iter().any(|message| message.len() > frame::MAX_MESSAGE) {
+            return Err(SendError::TooLarge);
+        }
+        let pool = &self.pool;
+        match self.send.wait_space(Some(Duration::from_secs(0))) {
+            Space::Available if self.send.push_all(messages.iter().map(|message| Frame::Message(Pool::copy(pool, message)))) => Ok(()),
+            Space::Full => Err(SendError::WouldBlock),
+            _ => Err(SendError::Disconnected),
         }
     }
 
-    pub fn open_server(name: &str) -> io::Result<IpcClient> {
-        let (send_tx, send_rx) = channel::<Vec<u8>>();
-        let (recv_tx, recv_rx) = channel::<Vec<u8>>();
+    /// Queue a message on the urgent lane. It goes out ahead of every normal message that hasn't
+    /// started yet, and between the fragments of a big one, and is delivered ahead of them too.
+    /// Never waits on the watermarks, so keep urgent traffic small.
+    pub fn send_urgent(&self, message: &[u8]) -> Result<(), SendError> {
+        if message.len() > frame::MAX_MESSAGE {
+            return Err(SendError::TooLarge);
+        }
+        if self.send.push_urgent(Frame::Urgent(Pool::copy(&self.pool, message))) {
+            Ok(())
+        } else {
+            Err(SendError::Disconnected)
+        }
+    }
+
+    pub fn recv(&self) -> Option<Buffer> {
+        self.recv.pop()
+    }
+
+    pub fn try_recv(&self) -> Option<Option<Buffer>> {
+        self.recv.try_pop()
+    }
+
+    /// Wait up to `timeout` (forever if None) for a message. Returns None if disconnected,
+    /// Some(None) if nothing arrived in time.
+    pub fn recv_timeout(&self, timeout: Option<Duration>) -> Option<Option<Buffer>> {
+        let mut message = None;
+        self.recv.pop_many(1, timeout, |buffer| message = Some(buffer)).map(|_| message)
+    }
+
+    /// Wait up to `timeout` (forever if None) for a message and copy it into `buf`, returning
+    /// its length. A message that doesn't fit stays queued.
+    pub fn recv_into(&self, buf: &mut [u8], timeout: Option<Duration>) -> Result<usize, RecvError> {
+        let mut needed = 0;
+        let message = self.recv.pop_if(timeout, |message| {
+            needed = message.len();
+            needed <= buf.len()
+        });
+
+        match message {
+            Some(Some(message)) => {
+                buf[..message.len()].copy_from_slice(&message);
+                Ok(message.len())
+            }
+            Some(None) if needed > buf.len() => Err(RecvError::TooSmall(needed)),
+            Some(None) => Err(RecvError::Empty),
+            None => Err(RecvError::Disconnected),
+        }
+    }
+
+    /// Wait up to `timeout` (forever if None) for messages, then hand up to `max` of the
+    /// ones already received to `f`. Returns None once disconnected and drained.
+    pub fn recv_many<F: FnMut(Buffer)>(&self, max: usize, timeout: Option<Duration>, f: F) -> Option<usize> {
+        self.recv.pop_many(max, timeout, f)
+    }
+
+    /// Wait up to `timeout` (forever if None) for any of `clients` to have a message waiting or
+    /// be disconnected, and return the index of the first that does. Returns None if none did
+    /// in time. Clients with a receive handler never have messages waiting.
+    pub fn wait_any(clients: &[&IpcClient], timeout: Option<Duration>) -> Option<usize> {
+        let queues: Vec<&Queue<Buffer>> = clients.iter().map(|client| &*client.recv).collect();
+        queue::wait_any(&queues, timeout)
+    }
+
+    /// Have messages handed to `handler` on the I/O thread as they arrive instead of queued
+    /// for `recv`, starting with any already queued. None goes back to queueing. Not to be
+    /// called from inside a handler.
+    pub fn set_receive_handler(&self, handler: Option<ReceiveHandler>) {
+        self.dispatch.set(handler, &self.recv);
+    }
+
+    /// Start sending a stream. Returns None while the last one is still open.
+    pub fn begin_stream(&self) -> Option<StreamWriter> {
+        StreamWriter::begin(&self.send, &self.pool, &self.streaming)
+    }
+
+    /// Wait up to `timeout` (forever if None) for the next chunk of the stream being received.
+    /// Ok(None) means the stream has ended, and the next call reads the one after it.
+    pub fn read_chunk(&self, timeout: Option<Duration>) -> Result<Option<Buffer>, RecvError> {
+        stream::read_chunk(&self.chunks, timeout)
+    }
+
+    /// Send `body` as a request and return the call to wait on for its response. `timeout`
+    /// (forever if None) only covers waiting for the send queue to have room.
+    pub fn call(&self, body: &[u8], timeout: Option<Duration>) -> Result<Call, SendError> {
+        rpc::call(&self.send, &self.pool, &self.calls, body, timeout)
+    }
+
+    /// Send `body` as a request and have `callback` run with the response, on the I/O thread
+    /// that receives it. It runs with Disconnected instead if the response never comes.
+    pub fn call_with<F>(&self, body: &[u8], timeout: Option<Duration>, callback: F) -> Result<(), SendError>
+        where F: FnOnce(Result<Buffer, RecvError>) + Send + 'static {
+        rpc::call_with(&self.send, &self.pool, &self.calls, body, timeout, Box::new(callback))
+    }
+
+    /// Wait up to `timeout` (forever if None) for the peer's next request
+    pub fn recv_request(&self, timeout: Option<Duration>) -> Result<Request, RecvError> {
+        rpc::recv_request(&self.requests, timeout)
+    }
+
+    /// Send the response to the peer's request `id`
+    pub fn respond(&self, id: u64, body: &[u8], timeout: Option<Duration>) -> Result<(), SendError> {
+        rpc::respond(&self.send, &self.pool, id, body, timeout)
+    }
+
+    /// What has gone through the connection so far, and how full its queues are
+    pub fn stats(&self) -> Stats {
+        self.session.stats.snapshot(self.send.depth(), self.recv.depth())
+    }
+
+    /// Record every message sent and received from now on to a new file at `path`, ending
+    /// any capture already running. Read it back with CaptureReader.
+    pub fn start_capture<P: AsRef<Path>>(&self, path: P) -> io::Result<()> {
+        self.session.capture.start(path.as_ref())
+    }
+
+    /// Stop recording and flush the file. Returns the first error writing it, if any; the
+    /// capture stopped there. A capture still running when the client closes is flushed then.
+    pub fn stop_capture(&self) -> io::Result<()> {
+        self.session.capture.stop()
+    }
+
+    pub fn open_server(name: &str, options: &Options) -> io::Result<IpcClient> {
+        if options.transport != options::TRANSPORT_PIPE {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "transport is not supported on this platform"));
+        }
+        if options.io_mode != options::IO_THREADS {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "I/O mode is not supported on this platform"));
+        }
+
+        let send = Queue::spinning(options.queue_limits(), Frame::weight, options.spin());
+        let recv = Queue::spinning(options.queue_limits(), Buffer::weight, options.spin());
+        let chunks = Queue::spinning(options.queue_limits(), Buffer::weight, options.spin());
+        let requests = Queue::spinning(options.queue_limits(), Request::weight, options.spin());
+        let calls = Calls::new();
+        let dispatch = Dispatch::new();
+        let pool = Pool::new();
+        let read_pool = pool.clone();
+        let write_pool = pool.clone();
+        let session = Session::new(options);
+        let read_session = session.clone();
+        let write_session = session.clone();
+        let inbox = Inbox {
+            messages: recv.clone(),
+            chunks: chunks.clone(),
+            requests: requests.clone(),
+            calls: calls.clone(),
+            dispatch: dispatch.clone(),
+        };
+        let write_queue = CloseGuard(send.clone());
 
         let pid = unsafe { libc::getpid() as u32 };
         let path = format!("\\\\.\\pipe\\messageipc_{}_{}", name, pid);
@@ -67,35 +265,53 @@ impl IpcClient {
                 let mut write_server = try!(write_server.0.wait());
                 sync.send(()).unwrap();
                 
-                while let Ok(buffer) = send_rx.recv() {
-                    let size = buffer.len() as u32;
-                    try!(write_server.write_u32::<LittleEndian>(size));
-                    try!(write_server.write_all(&buffer[..]));
-                }
-
-                Ok(())
+                frame::write_messages(&mut write_server, &write_session, &write_pool, &write_queue.0)
             });
 
-            loop {
-                let bytes = try!(read_server.read_u32::<LittleEndian>());
-                let mut buffer = vec![0; bytes as usize];
-                try!(read_server.read_exact(&mut buffer[..]));
-
-                if let Err(_) = recv_tx.send(buffer) {
-                    return Ok(());
-                }
-            }
+            frame::read_messages(&mut read_server, &read_session, &read_pool, &inbox)
         });
 
         Ok(IpcClient {
-            send: send_tx,
-            recv: recv_rx,
+            send: send,
+            recv: recv,
+            chunks: chunks,
+            requests: requests,
+            calls: calls,
+            dispatch: dispatch,
+            streaming: Arc::new(AtomicBool::new(false)),
+            pool: pool,
+            session: session,
         })
     }
     
-    pub fn open_client(name: &str, pid: u32) -> io::Result<IpcClient> {
-        let (send_tx, send_rx) = channel::<Vec<u8>>();
-        let (recv_tx, recv_rx) = channel::<Vec<u8>>();
+    pub fn open_client(name: &str, pid: u32, options: &Options) -> io::Result<IpcClient> {
+        if options.transport != options::TRANSPORT_PIPE {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "transport is not supported on this platform"));
+        }
+        if options.io_mode != options::IO_THREADS {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "I/O mode is not supported on this platform"));
+        }
+
+        let send = Queue::spinning(options.queue_limits(), Frame::weight, options.spin());
+        let recv = Queue::spinning(options.queue_limits(), Buffer::weight, options.spin());
+        let chunks = Queue::spinning(options.queue_limits(), Buffer::weight, options.spin());
+        let requests = Queue::spinning(options.queue_limits(), Request::weight, options.spin());
+        let calls = Calls::new();
+        let dispatch = Dispatch::new();
+        let pool = Pool::new();
+        let read_pool = pool.clone();
+        let write_pool = pool.clone();
+        let session = Session::new(options);
+        let read_session = session.clone();
+        let write_session = session.clone();
+        let inbox = Inbox {
+            messages: recv.clone(),
+            chunks: chunks.clone(),
+            requests: requests.clone(),
+            calls: calls.clone(),
+            dispatch: dispatch.clone(),
+        };
+        let write_queue = CloseGuard(send.clone());
 
         let read_path = format!("\\\\.\\pipe\\messageipc_{}_{}", name, pid);
         let write_path = format!("\\\\.\\pipe\\messageipc_{}_{}", name, pid);
@@ -109,31 +325,35 @@ impl IpcClient {
                 let mut write_client = try!(PipeClient::connect(write_path));
                 sync.send(()).unwrap();
                 
-                while let Ok(buffer) = send_rx.recv() {
-                    let size = buffer.len() as u32;
-                    try!(write_client.write_u32::<LittleEndian>(size));
-                    try!(write_client.write_all(&buffer[..]));
-                }
-
-                Ok(())
+                frame::write_messages(&mut write_client, &write_session, &write_pool, &write_queue.0)
             });
 
             sync.send(()).unwrap();
 
-            loop {
-                let bytes = try!(read_client.read_u32::<LittleEndian>());
-                let mut buffer = vec![0; bytes as usize];
-                try!(read_client.read_exact(&mut buffer[..]));
-
-                if let Err(_) = recv_tx.send(buffer) {
-                    return Ok(());
-                }
-            }
+            frame::read_messages(&mut read_client, &read_session, &read_pool, &inbox)
         });
 
         Ok(IpcClient {
-            send: send_tx,
-            recv: recv_rx,
+            send: send,
+            recv: recv,
+            chunks: chunks,
+            requests: requests,
+            calls: calls,
+            dispatch: dispatch,
+            streaming: Arc::new(AtomicBool::new(false)),
+            pool: pool,
+            session: session,
         })
     }
 }
+
+impl Drop for IpcClient {
+    fn drop(&mut self) {
+        // The writer thread still flushes whatever was already queued
+        self.send.close();
+        self.recv.close();
+        self.chunks.close();
+        self.requests.close();
+        self.calls.close();
+    }
+}